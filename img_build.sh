@@ -144,7 +144,7 @@ USERSPACE_BUILD ()
                                     #-static \ # this overrides -pie and -fpie :(
 }
 
-USERSPACE_PROGRAMS=( cat.cpp cp.cpp ls.cpp mkdir.cpp mv.cpp pwd.cpp rm.cpp rmdir.cpp sh.cpp stdentry.cpp test.cpp touch.cpp write.cpp )
+USERSPACE_PROGRAMS=( bigexec.cpp cat.cpp cp.cpp forktest.cpp ls.cpp mkdir.cpp mmaptest.cpp mv.cpp pwd.cpp rm.cpp rmdir.cpp sh.cpp stdentry.cpp test.cpp touch.cpp write.cpp )
 
 for F in "${USERSPACE_PROGRAMS[@]}"; do
     USERSPACE_BUILD "$F"
@@ -100,6 +100,19 @@ int sys_exec(const char *bin_path, char **argv, u64 flags)
     return result;
 }
 
+int sys_fork()
+{
+    u64 result;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FORK)
+        : "rcx", "memory"
+    );
+    return result;
+}
+
 void sys_tty_write(const char *str)
 {
     sys_tty_write(str, strlen_workaround(str));
@@ -457,3 +470,177 @@ bool sys_is_dir_path(const char *path)
     );
     return result == 0;
 }
+
+int sys_fs_open(const char *path, u64 flags)
+{
+    s64 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "movq %3, %%r8\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_OPEN),
+            "r"((u64)path),
+            "r"(flags)
+        : "rcx", "rdx", "r8"
+    );
+    return (int)result;
+}
+
+u16 sys_fs_close(int fd)
+{
+    int result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_CLOSE),
+            "r"((u64)fd)
+        : "rcx", "rdx"
+    );
+    return result;
+}
+
+s64 sys_fs_read_fd(int fd, char *buffer, u64 size)
+{
+    s64 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "movq %3, %%r8\n"
+        "movq %4, %%r9\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_READ_FD),
+            "r"((u64)fd),
+            "r"((u64)buffer),
+            "r"(size)
+        : "rcx", "rdx", "r8", "r9", "memory"
+    );
+    return result;
+}
+
+s64 sys_fs_write_fd(int fd, char *buffer, u64 size)
+{
+    s64 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "movq %3, %%r8\n"
+        "movq %4, %%r9\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_WRITE_FD),
+            "r"((u64)fd),
+            "r"((u64)buffer),
+            "r"(size)
+        : "rcx", "rdx", "r8", "r9", "memory"
+    );
+    return result;
+}
+
+s64 sys_fs_seek(int fd, s64 offset, int whence)
+{
+    s64 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "movq %3, %%r8\n"
+        "movq %4, %%r9\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_SEEK),
+            "r"((u64)fd),
+            "r"((u64)offset),
+            "r"((u64)whence)
+        : "rcx", "rdx", "r8", "r9"
+    );
+    return result;
+}
+
+FileStatResult sys_fs_fstat(int fd)
+{
+    FileStatResult result = {};
+    asm volatile(
+        "movq %0, %%rcx\n"
+        "movq %1, %%rdx\n"
+        "movq %2, %%r8\n"
+        "int $0xff\n"
+        :
+        :   "i"(SYSCALL_FS_FSTAT),
+            "r"((u64)fd),
+            "r"((u64)&result)
+        : "rcx", "rdx", "r8", "memory"
+    );
+    return result;
+}
+
+s64 sys_fs_copy_fd(int src_fd, int dst_fd, u64 size)
+{
+    s64 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "movq %3, %%r8\n"
+        "movq %4, %%r9\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_COPY_FD),
+            "r"((u64)src_fd),
+            "r"((u64)dst_fd),
+            "r"(size)
+        : "rcx", "rdx", "r8", "r9", "memory"
+    );
+    return result;
+}
+
+void *sys_fs_mmap(int fd, u64 offset, u64 size)
+{
+    void *result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "movq %3, %%r8\n"
+        "movq %4, %%r9\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_MMAP),
+            "r"((u64)fd),
+            "r"(offset),
+            "r"(size)
+        : "rcx", "rdx", "r8", "r9", "memory"
+    );
+    return result;
+}
+
+u16 sys_fs_msync(void *addr)
+{
+    u16 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_MSYNC),
+            "r"((u64)addr)
+        : "rcx", "rdx", "memory"
+    );
+    return result;
+}
+
+u16 sys_fs_munmap(void *addr)
+{
+    u16 result = 0;
+    asm volatile(
+        "movq %1, %%rcx\n"
+        "movq %2, %%rdx\n"
+        "int $0xff\n"
+        :   "=a"(result)
+        :   "i"(SYSCALL_FS_MUNMAP),
+            "r"((u64)addr)
+        : "rcx", "rdx", "memory"
+    );
+    return result;
+}
@@ -33,6 +33,17 @@ const u64 SYSCALL_FS_WRITE = 0x1a;
 const u64 SYSCALL_FS_TRUNC = 0x1b;
 const u64 SYSCALL_FS_IS_SAME_PATH = 0x1c;
 const u64 SYSCALL_FS_IS_DIR_PATH = 0x1d;
+const u64 SYSCALL_FS_OPEN = 0x1e;
+const u64 SYSCALL_FS_CLOSE = 0x1f;
+const u64 SYSCALL_FS_READ_FD = 0x20;
+const u64 SYSCALL_FS_WRITE_FD = 0x21;
+const u64 SYSCALL_FS_SEEK = 0x22;
+const u64 SYSCALL_FS_FSTAT = 0x23;
+const u64 SYSCALL_FS_COPY_FD = 0x24;
+const u64 SYSCALL_FS_MMAP = 0x25;
+const u64 SYSCALL_FS_MSYNC = 0x26;
+const u64 SYSCALL_FS_MUNMAP = 0x27;
+const u64 SYSCALL_FORK = 0x28;
 
 // NOTE: if these started from 0 then they can't be combined like EXEC_IS_BLOCKING | EXEC_CAN_BE_ORPHANED
 const u64 EXEC_IS_BLOCKING = 0x1;
@@ -42,6 +53,17 @@ const u64 SYS_SUCCESS = 0x0;
 const u64 SYS_BAD_PATH = 0X1;
 const u64 SYS_FILE_NOT_FOUND = 0x2;
 const u64 SYS_FILE_ALREADY_EXISTS = 0x3;
+const u64 SYS_BAD_FD = 0x4;
+const u64 SYS_BAD_ADDR = 0x5;
+
+// NOTE: these can be combined, e.g. OPEN_CREATE | OPEN_TRUNCATE
+const u64 OPEN_CREATE = 0x1; // create the file if it doesn't exist
+const u64 OPEN_TRUNCATE = 0x2; // truncate the file to size 0
+const u64 OPEN_APPEND = 0x4; // start at the end of the file instead of the start
+
+const int SEEK_SET = 0;
+const int SEEK_CUR = 1;
+const int SEEK_END = 2;
 
 void sys_yield();
 
@@ -64,6 +86,11 @@ void sys_poll_keyboard(PollKeyboardResult *result);
     //new ((void *)g_init_process) Process("/userspace/test.elf", false, false, "/");
 int sys_exec(const char *bin_path, char **argv, u64 flags);
 
+// makes a copy of the calling process that shares its' memory copy on write, returns the child's pid in the parent
+// and 0 in the child, or -1 on error
+// NOTE the child is killed when the parent exits, and doesn't inherit memory mapped files
+int sys_fork();
+
 void sys_tty_write(const char *str, int len);
 void sys_tty_write(const char *str);
 
@@ -112,3 +139,26 @@ u16 sys_fs_truncate(const char *path, int new_size);
 
 bool sys_is_same_path(const char *path1, const char *path2);
 bool sys_is_dir_path(const char *path);
+
+// file descriptor based API, the path is only looked up once by sys_fs_open()
+// returns the file descriptor, or -1 on error
+int sys_fs_open(const char *path, u64 flags);
+u16 sys_fs_close(int fd);
+// these return the number of bytes read/written and advance the file offset, or -1 on error
+// NOTE sys_fs_read_fd() returns 0 at the end of the file
+s64 sys_fs_read_fd(int fd, char *buffer, u64 size);
+s64 sys_fs_write_fd(int fd, char *buffer, u64 size);
+// returns the new file offset, or -1 on error
+s64 sys_fs_seek(int fd, s64 offset, int whence);
+FileStatResult sys_fs_fstat(int fd);
+// copies up to size bytes from src_fd to dst_fd inside the kernel, without going through a user buffer, and advances
+// both file offsets. returns the number of bytes copied, or -1 on error
+// NOTE returns 0 at the end of the source file, and -1 if both are the same file and the ranges overlap
+s64 sys_fs_copy_fd(int src_fd, int dst_fd, u64 size);
+// maps size bytes of the file starting at offset into memory, offset must be a multiple of 4096. returns 0 on error
+// the pages are read from the file when they are first touched, modified pages are written back by sys_fs_msync()
+// and sys_fs_munmap() (and when the process exits), the file is never extended by writes past its' end
+// NOTE the mapping stays valid after the file is closed
+void *sys_fs_mmap(int fd, u64 offset, u64 size);
+u16 sys_fs_msync(void *addr);
+u16 sys_fs_munmap(void *addr);
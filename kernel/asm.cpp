@@ -59,11 +59,17 @@ void outs16(u16 port, u32 count, void *buffer)
 }
 
 bool is_aligned(u64, u64);
+// with PCIDs enabled the low 12 bits of cr3 are the PCID, and setting bit 63 on a write keeps the TLB entries of
+// that PCID instead of flushing them (it always reads back as 0)
+const u64 CR3_PCID_MASK = 0xfff;
+const u64 CR3_NO_FLUSH = (u64)1 << 63;
+extern bool g_tlb_has_pcids;
+
 // NOTE: writes to cr3, cr4 and cr0 are serializing
-void write_cr3(u64 addr)
+void write_cr3(u64 val)
 {
-    ASSERT(is_aligned(addr, 4096));
-    asm volatile("mov %%rax, %%cr3" : : "a"(addr) : "memory");
+    ASSERT(g_tlb_has_pcids || is_aligned(val, 4096));
+    asm volatile("mov %%rax, %%cr3" : : "a"(val) : "memory");
 }
 
 u64 read_cr3()
@@ -73,6 +79,41 @@ u64 read_cr3()
     return addr;
 }
 
+const u64 CR4_PGE = (u64)1 << 7; // global pages
+const u64 CR4_PCIDE = (u64)1 << 17; // process context identifiers
+
+void write_cr4(u64 val)
+{
+    asm volatile("mov %%rax, %%cr4" : : "a"(val) : "memory");
+}
+
+u64 read_cr4()
+{
+    u64 val;
+    asm volatile("mov %%cr4, %%rax" : "=a"(val));
+    return val;
+}
+
+// invalidates the TLB entries for the page containing addr, including a global one, along with the paging structure
+// caches of the current PCID
+void invlpg(u64 addr)
+{
+    asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+void cpuid(u32 leaf, u32 *eax, u32 *ebx, u32 *ecx, u32 *edx)
+{
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// the address that caused the last page fault
+u64 read_cr2()
+{
+    u64 addr;
+    asm volatile("mov %%cr2, %%rax" : "=a"(addr));
+    return addr;
+}
+
 void sti()
 {
     asm volatile("sti" : : : "memory");
@@ -99,6 +140,14 @@ bool are_interrupts_enabled()
     return res;
 }
 
+u64 rdtsc()
+{
+    u32 low;
+    u32 high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64)high << 32) | low;
+}
+
 // TODO should rsp() and rbp() be always_inline since entering them as functions will modyify the rsp & rbp
 u64 rsp()
 {
@@ -1,9 +1,15 @@
 #pragma once
 #include "kernel/types.h"
 #include "kernel/asm.cpp"
+#include "kernel/pci.cpp"
+#include "kernel/physical_allocator.h"
+#include "kernel/page_tables.h"
+#include "kernel/pic.cpp"
+#include "kernel/scheduler.h"
 
 // based on info and code from
 //  https://wiki.osdev.org/PCI_IDE_Controller
+//  https://wiki.osdev.org/ATA/ATAPI_using_DMA
 //  https://github.com/SerenityOS/serenity/blob/master/Kernel/Devices/Storage/ATA/GenericIDE/Channel.cpp
 
 const u8 COMMAND_IDENTIFY_PACKET = 0xa1;
@@ -15,6 +21,50 @@ const u8 COMMAND_PIO_WRITE_28BIT = 0x30;
 const u8 COMMAND_PIO_READ_48BIT = 0x24;
 const u8 COMMAND_PIO_WRITE_48BIT = 0x34;
 
+const u8 COMMAND_DMA_READ_28BIT = 0xc8;
+const u8 COMMAND_DMA_WRITE_28BIT = 0xca;
+
+const u8 COMMAND_DMA_READ_48BIT = 0x25;
+const u8 COMMAND_DMA_WRITE_48BIT = 0x35;
+
+// bus master IDE registers, these are offsets from the bus master base address (BAR4 of the IDE controller)
+// NOTE the secondary channel registers are at BUS_MASTER_SECONDARY_OFFSET from the primary channel registers
+const u16 BUS_MASTER_COMMAND = 0x0;
+const u16 BUS_MASTER_STATUS = 0x2;
+const u16 BUS_MASTER_PRDT = 0x4;
+const u16 BUS_MASTER_SECONDARY_OFFSET = 0x8;
+
+const u8 BUS_MASTER_COMMAND_START = 1 << 0;
+const u8 BUS_MASTER_COMMAND_READ = 1 << 3; // NOTE this is from the perspective of the bus master, set this to read from the disk into memory
+
+const u8 BUS_MASTER_STATUS_ACTIVE = 1 << 0;
+const u8 BUS_MASTER_STATUS_ERROR = 1 << 1;
+const u8 BUS_MASTER_STATUS_INTERRUPT = 1 << 2;
+
+// physical region descriptor, the bus master reads a table of these to know where to transfer data to/from
+// NOTE a region must not cross a 64KB boundary, and must be in the first 4GB of physical memory
+struct __attribute__((__packed__)) PRDEntry
+{
+    u32 buffer_paddr;
+    u16 byte_count; // 0 means 64KB
+    u16 flags;
+    static const u16 END_OF_TABLE = 1 << 15;
+};
+static_assert(sizeof(PRDEntry) == 8);
+
+// the PRDT is one physical page, so the max size of a single DMA command is capped to keep the entry count below
+// 4096 / sizeof(PRDEntry) entries (each page of the buffer can take at most 2 entries)
+const u16 DMA_MAX_SECTORS_PER_COMMAND = 256 * (4096 / 512);
+const u32 PRDT_MAX_ENTRIES = 4096 / sizeof(PRDEntry);
+
+// one piece of a scatter/gather transfer, the sectors of a transfer are split across the segments in order
+// NOTE byte_count must be a multiple of the sector size
+struct IOSegment
+{
+    u8 *buffer = nullptr;
+    u32 byte_count = 0;
+};
+
 struct IDEDevice
 {
     bool is_present = false;
@@ -64,6 +114,8 @@ struct IDEDevice
         u8 identify_packet = COMMAND_IDENTIFY;
         u8 pio_read = COMMAND_PIO_READ_28BIT;
         u8 pio_write = COMMAND_PIO_WRITE_28BIT;
+        u8 dma_read = COMMAND_DMA_READ_28BIT;
+        u8 dma_write = COMMAND_DMA_WRITE_28BIT;
     };
     Commands commands;
     bool lba_48bit = false;
@@ -164,6 +216,17 @@ struct IDEDevice
         Status(u8 val) : raw(val) {}
     };
 
+    // set if the drive and the IDE controller support bus master DMA, if this is not set then transfers fall back to PIO
+    bool dma_supported = false;
+    u16 bus_master_base = 0;
+    PRDEntry *prdt = 0; // NOTE this is a physical page, it's accessed through the pmap
+
+    // state for the DMA request currently being run by the drive, a process that issues a request from a
+    // syscall is blocked until the drive raises an IRQ (see wait_for_request())
+    bool request_in_flight = false;
+    u8 request_bus_master_status = 0;
+    Status request_status = 0;
+
     bool interrupts_enabled = true;
     void disable_interrupts();
     void enable_interrupts();
@@ -177,6 +240,16 @@ struct IDEDevice
     void read_sectors_pio(u8*, u16, u64);
     void write_sectors_pio(u8*, u16, u64);
     void setup_readwrite(u16, u64);
+    bool build_prdt(const IOSegment*, u32);
+    void complete_request();
+    void wait_for_request();
+    void handle_irq();
+    bool transfer_sectors_dma(const IOSegment*, u32, u16, u64, bool);
+    bool read_sectors_dma(u8*, u16, u64);
+    bool write_sectors_dma(u8*, u16, u64);
+    void read_sectors(u8*, u16, u64);
+    void write_sectors(u8*, u16, u64);
+    void transfer_sectors_gather(const IOSegment*, u32, u64, bool);
 };
 
 static_assert(sizeof(IDEDevice::identity_packet) % 2 == 0); // must be aligned to 4 for insd instruction to work
@@ -338,15 +411,309 @@ void IDEDevice::write_sectors_pio(u8 *buffer, u16 sector_count, u64 lba)
     ASSERT((u64)(ptr - buffer) / 512 == sector_count);
 }
 
+// fills in the PRDT with the physical pages that back the segments
+// returns false if the buffers can't be used for DMA (the caller should then fall back to PIO)
+bool IDEDevice::build_prdt(const IOSegment *segments, u32 segment_count)
+{
+    PML4T *pml4t = current_pml4t();
+    u32 entry_i = 0;
+    for(u32 segment_i = 0; segment_i < segment_count; ++segment_i) {
+        if(!is_aligned((u64)segments[segment_i].buffer, 2))
+            return false;
+
+        vaddr addr = (vaddr)segments[segment_i].buffer;
+        vaddr one_past_end = addr + segments[segment_i].byte_count;
+        while(addr < one_past_end) {
+            paddr region_paddr = vaddr_to_paddr(addr, pml4t);
+            if(region_paddr == 0 || region_paddr + 4096 > 4*GB)
+                return false;
+
+            // a region ends at whichever comes first: the end of the page, a 64KB boundary or the end of the buffer
+            u64 region_length = round_up_align(addr + 1, 4096) - addr;
+            region_length = min(region_length, round_up_align(region_paddr + 1, 64*KB) - region_paddr);
+            region_length = min(region_length, one_past_end - addr);
+
+            // merge physically contiguous regions into the previous entry where possible
+            // NOTE a byte_count of 0 means 64KB, so entries can only be merged if they stay below 64KB
+            if(entry_i > 0) {
+                PRDEntry& prev = prdt[entry_i - 1];
+                bool is_contiguous = prev.buffer_paddr + prev.byte_count == region_paddr;
+                bool crosses_64kb = (region_paddr & ~(64*KB - 1)) != (prev.buffer_paddr & ~(64*KB - 1));
+                if(is_contiguous && !crosses_64kb && prev.byte_count + region_length < 64*KB) {
+                    prev.byte_count += region_length;
+                    addr += region_length;
+                    continue;
+                }
+            }
+
+            if(entry_i >= PRDT_MAX_ENTRIES)
+                return false;
+
+            prdt[entry_i].buffer_paddr = (u32)region_paddr;
+            prdt[entry_i].byte_count = (u16)region_length;
+            prdt[entry_i].flags = 0;
+            ++entry_i;
+            addr += region_length;
+        }
+        ASSERT(addr == one_past_end);
+    }
+    ASSERT(entry_i > 0);
+    prdt[entry_i - 1].flags = PRDEntry::END_OF_TABLE;
+
+    return true;
+}
+
+// finishes the request that is in flight, this is called from the IRQ handler or by polling
+void IDEDevice::complete_request()
+{
+    ASSERT(request_in_flight);
+    u16 bm_status = bus_master_base + BUS_MASTER_STATUS;
+
+    out8(bus_master_base + BUS_MASTER_COMMAND, 0);
+    request_bus_master_status = in8(bm_status);
+    request_status = read_status(); // NOTE reading the status register also acknowledges the drive's interrupt
+    // the error and interrupt bits are cleared by writing 1 to them
+    out8(bm_status, BUS_MASTER_STATUS_ERROR | BUS_MASTER_STATUS_INTERRUPT);
+
+    if(interrupts_enabled)
+        disable_interrupts();
+    request_in_flight = false;
+    unblock_processes_on_io((u64)this);
+}
+
+// waits until there is no request in flight on this drive
+// if called from a syscall the calling process is blocked until the IRQ handler completes the request, which
+// lets other processes run in the meantime, otherwise this busy polls the bus master status
+void IDEDevice::wait_for_request()
+{
+    while(request_in_flight) {
+        if(interrupts_enabled && can_block_current_process()) {
+            block_current_process_on_io((u64)this);
+            continue;
+        }
+
+        // NOTE if the drive's interrupts are disabled (nIEN), the interrupt bit may never get set, so also wait
+        //      for the bus master to clear the active bit once it reaches the end of the PRDT
+        u16 bm_status = bus_master_base + BUS_MASTER_STATUS;
+        u8 status = in8(bm_status);
+        while((status & BUS_MASTER_STATUS_ACTIVE) && !(status & BUS_MASTER_STATUS_INTERRUPT) && !(status & BUS_MASTER_STATUS_ERROR)) {
+            status = in8(bm_status);
+        }
+        poll_busy(false);
+        complete_request();
+    }
+}
+
+void IDEDevice::handle_irq()
+{
+    u8 bm_status = in8(bus_master_base + BUS_MASTER_STATUS);
+    if(!request_in_flight || !(bm_status & (BUS_MASTER_STATUS_INTERRUPT | BUS_MASTER_STATUS_ERROR))) {
+        // not for us (the other drive on the channel, or a request that was already completed by polling)
+        read_status();
+        return;
+    }
+    complete_request();
+}
+
+// returns false if the transfer was not done, in which case the caller should fall back to PIO
+bool IDEDevice::transfer_sectors_dma(const IOSegment *segments, u32 segment_count, u16 sector_count, u64 lba, bool is_read)
+{
+    ASSERT(dma_supported);
+    ASSERT(sector_count <= DMA_MAX_SECTORS_PER_COMMAND);
+    ASSERT(!request_in_flight);
+    if(!build_prdt(segments, segment_count))
+        return false;
+
+    u16 bm_command = bus_master_base + BUS_MASTER_COMMAND;
+    u16 bm_status = bus_master_base + BUS_MASTER_STATUS;
+
+    // stop any previous transfer, point the bus master at the PRDT and set the direction
+    out8(bm_command, 0);
+    out32(bus_master_base + BUS_MASTER_PRDT, (u32)(paddr)prdt);
+    out8(bm_command, is_read ? BUS_MASTER_COMMAND_READ : 0);
+    // the error and interrupt bits are cleared by writing 1 to them
+    out8(bm_status, in8(bm_status) | BUS_MASTER_STATUS_ERROR | BUS_MASTER_STATUS_INTERRUPT);
+
+    // the drive only raises an IRQ if the issuing process is going to sleep until the transfer is done
+    if(can_block_current_process())
+        enable_interrupts();
+
+    setup_readwrite(sector_count, lba);
+    request_in_flight = true;
+    out8(regs.command, is_read ? commands.dma_read : commands.dma_write);
+    out8(bm_command, (is_read ? BUS_MASTER_COMMAND_READ : 0) | BUS_MASTER_COMMAND_START);
+
+    wait_for_request();
+    ASSERT(!(request_bus_master_status & BUS_MASTER_STATUS_ERROR));
+    ASSERT(!request_status.bitfield.error);
+    ASSERT(!request_status.bitfield.write_fault);
+    return true;
+}
+
+bool IDEDevice::read_sectors_dma(u8 *buffer, u16 sector_count, u64 lba)
+{
+    IOSegment segment = {buffer, (u32)sector_count * 512};
+    return transfer_sectors_dma(&segment, 1, sector_count, lba, true);
+}
+
+bool IDEDevice::write_sectors_dma(u8 *buffer, u16 sector_count, u64 lba)
+{
+    IOSegment segment = {buffer, (u32)sector_count * 512};
+    return transfer_sectors_dma(&segment, 1, sector_count, lba, false);
+}
+
+bool g_ata_dma_enabled = true;
+
+// uses DMA where possible, else falls back to PIO
+void IDEDevice::read_sectors(u8 *buffer, u16 sector_count, u64 lba)
+{
+    // another process may have been blocked in the middle of a request on this drive
+    wait_for_request();
+
+    if(!dma_supported || !g_ata_dma_enabled) {
+        read_sectors_pio(buffer, sector_count, lba);
+        return;
+    }
+
+    while(sector_count > 0) {
+        u16 count = min(sector_count, DMA_MAX_SECTORS_PER_COMMAND);
+        if(!read_sectors_dma(buffer, count, lba))
+            read_sectors_pio(buffer, count, lba);
+        buffer += count * 512;
+        lba += count;
+        sector_count -= count;
+    }
+}
+
+// uses DMA where possible, else falls back to PIO
+void IDEDevice::write_sectors(u8 *buffer, u16 sector_count, u64 lba)
+{
+    // another process may have been blocked in the middle of a request on this drive
+    wait_for_request();
+
+    if(!dma_supported || !g_ata_dma_enabled) {
+        write_sectors_pio(buffer, sector_count, lba);
+        return;
+    }
+
+    while(sector_count > 0) {
+        u16 count = min(sector_count, DMA_MAX_SECTORS_PER_COMMAND);
+        if(!write_sectors_dma(buffer, count, lba))
+            write_sectors_pio(buffer, count, lba);
+        buffer += count * 512;
+        lba += count;
+        sector_count -= count;
+    }
+}
+
+// transfers consecutive sectors starting at lba to/from the segments with a single command, where possible
+// NOTE the segments must add up to at most DMA_MAX_SECTORS_PER_COMMAND sectors
+void IDEDevice::transfer_sectors_gather(const IOSegment *segments, u32 segment_count, u64 lba, bool is_read)
+{
+    u64 total_bytes = 0;
+    for(u32 i = 0; i < segment_count; ++i) {
+        ASSERT(segments[i].byte_count % 512 == 0);
+        total_bytes += segments[i].byte_count;
+    }
+    u16 sector_count = total_bytes / 512;
+    ASSERT(sector_count > 0 && sector_count <= DMA_MAX_SECTORS_PER_COMMAND);
+
+    // another process may have been blocked in the middle of a request on this drive
+    wait_for_request();
+
+    if(dma_supported && g_ata_dma_enabled && transfer_sectors_dma(segments, segment_count, sector_count, lba, is_read))
+        return;
+
+    // PIO can't scatter/gather, so fall back to one command per segment
+    for(u32 i = 0; i < segment_count; ++i) {
+        u16 count = segments[i].byte_count / 512;
+        if(is_read)
+            read_sectors_pio(segments[i].buffer, count, lba);
+        else
+            write_sectors_pio(segments[i].buffer, count, lba);
+        lba += count;
+    }
+}
+
+// NOTE this assumes all the files are only on hdd00
+void read_sectors(u8 *buffer, u16 sector_count, u64 lba)
+{
+    ide_drives[0].read_sectors(buffer, sector_count, lba);
+}
+// NOTE this assumes all the files are only on hdd00
+void write_sectors(u8 *buffer, u16 sector_count, u64 lba)
+{
+    ide_drives[0].write_sectors(buffer, sector_count, lba);
+}
+
 // NOTE this assumes all the files are only on hdd00
-void read_sectors_pio(u8 *buffer, u16 sector_count, u64 lba)
+void read_sectors_gather(const IOSegment *segments, u32 segment_count, u64 lba)
 {
-    ide_drives[0].read_sectors_pio(buffer, sector_count, lba);
+    ide_drives[0].transfer_sectors_gather(segments, segment_count, lba, true);
 }
+
 // NOTE this assumes all the files are only on hdd00
-void write_sectors_pio(u8 *buffer, u16 sector_count, u64 lba)
+void write_sectors_gather(const IOSegment *segments, u32 segment_count, u64 lba)
 {
-    ide_drives[0].write_sectors_pio(buffer, sector_count, lba);
+    ide_drives[0].transfer_sectors_gather(segments, segment_count, lba, false);
+}
+
+// IRQ14 is raised by the primary channel, IRQ15 by the secondary channel
+const u8 IDE_PRIMARY_IRQ = 14;
+const u8 IDE_SECONDARY_IRQ = 15;
+void ide_handle_irq(u8 irq)
+{
+    u8 channel = (irq == IDE_PRIMARY_IRQ) ? IDEDevice::CHANNEL_PRIMARY : IDEDevice::CHANNEL_SECONDARY;
+    for(int i = 0; i < NUM_DRIVES; ++i) {
+        IDEDevice& drive = ide_drives[i];
+        if(!drive.is_present || !drive.dma_supported)
+            continue;
+        // NOTE the secondary drives have channel set to 2 (see init_ide_devices())
+        bool is_primary = drive.channel == IDEDevice::CHANNEL_PRIMARY;
+        if(is_primary != (channel == IDEDevice::CHANNEL_PRIMARY))
+            continue;
+        drive.handle_irq();
+    }
+}
+
+// sets up bus master DMA for all present drives, drives stay on PIO if the IDE controller or the drive
+// doesn't support DMA
+void init_ide_dma()
+{
+    PCIDevice controller = pci_find_device(PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_IDE);
+    if(!controller.found) {
+        dbg_str("no PCI IDE controller found, using PIO\n");
+        return;
+    }
+
+    // BAR4 is an IO space BAR, bit 0 is set for IO space BARs and must be masked out
+    u32 bar4 = pci_config_read32(controller, PCI_OFFSET_BAR4);
+    if(!(bar4 & 1) || (bar4 & ~3u) == 0) {
+        dbg_str("PCI IDE controller has no bus master registers, using PIO\n");
+        return;
+    }
+    u16 bus_master_base = (u16)(bar4 & ~3u);
+    pci_enable_bus_master(controller);
+
+    for(int i = 0; i < NUM_DRIVES; ++i) {
+        IDEDevice& drive = ide_drives[i];
+        if(!drive.is_present || drive.type != IDEDevice::Types::ATA)
+            continue;
+        if(!drive.identity_packet.capabilities.dma_supported)
+            continue;
+
+        drive.bus_master_base = bus_master_base;
+        if(drive.channel != IDEDevice::CHANNEL_PRIMARY)
+            drive.bus_master_base += BUS_MASTER_SECONDARY_OFFSET;
+
+        // NOTE the PRDT must not cross a 64KB boundary, a 4KB aligned page never does
+        paddr prdt_page = alloc_phys_page();
+        ASSERT(prdt_page + 4096 <= 4*GB);
+        drive.prdt = (PRDEntry *)prdt_page;
+        drive.dma_supported = true;
+
+        g_pic.unmask_irq(drive.channel == IDEDevice::CHANNEL_PRIMARY ? IDE_PRIMARY_IRQ : IDE_SECONDARY_IRQ);
+    }
 }
 
 void init_ide_devices()
@@ -398,13 +765,19 @@ void init_ide_devices()
             ide_drives[i].lba_48bit = true;
             ide_drives[i].commands.pio_read = COMMAND_PIO_READ_48BIT;
             ide_drives[i].commands.pio_write = COMMAND_PIO_WRITE_48BIT;
+            ide_drives[i].commands.dma_read = COMMAND_DMA_READ_48BIT;
+            ide_drives[i].commands.dma_write = COMMAND_DMA_WRITE_48BIT;
         } else {
             ide_drives[i].sector_count = ide_drives[i].identity_packet.user_addressable_sectors;
             ide_drives[i].lba_48bit = false;
             ide_drives[i].commands.pio_read = COMMAND_PIO_READ_28BIT;
             ide_drives[i].commands.pio_write = COMMAND_PIO_WRITE_28BIT;
+            ide_drives[i].commands.dma_read = COMMAND_DMA_READ_28BIT;
+            ide_drives[i].commands.dma_write = COMMAND_DMA_WRITE_28BIT;
         }
         ide_drives[i].size_bytes = (ide_drives[i].sector_count * 512) / 1024 / 1024;
 
     }
+
+    init_ide_dma();
 }
@@ -0,0 +1,237 @@
+#pragma once
+#include "kernel/types.h"
+#include "kernel/debug.cpp"
+#include "include/math.h"
+#include "kernel/physical_allocator.h"
+
+// AVL tree, for the ordered lookups of the vspace allocators, which can't use a Vector since kmalloc() allocates
+// from them
+// the nodes are carved out of whole physical pages (used through the pmap), which are only given back by clear()
+// less(a, b) must return true if a should come before b, elements where neither is less than the other are equal
+// NOTE the tree has no destructor, since it's copied around by value along with its' owner (see VSpace)
+// resource: The Art of Computer Programming Vol 3 (Knuth), section 6.2.3
+template<typename T, typename Less>
+struct AvlTree
+{
+    struct Node
+    {
+        Node *left;
+        Node *right;
+        s32 height;
+        T val;
+    };
+    // each page of nodes starts with a pointer to the next page, so clear() can find them
+    struct NodePage
+    {
+        NodePage *next;
+    };
+
+    Node *m_root = 0;
+    Node *m_free_nodes = 0;
+    NodePage *m_pages = 0;
+    u64 m_count = 0;
+
+    // val must not already be in the tree
+    void insert(const T& val)
+    {
+        Node *node = take_free_node();
+        node->left = 0;
+        node->right = 0;
+        node->height = 1;
+        node->val = val;
+        m_root = insert_at(m_root, node);
+        ++m_count;
+    }
+
+    // returns false if val isn't in the tree
+    bool remove(const T& val)
+    {
+        Node *removed = 0;
+        m_root = remove_at(m_root, val, &removed);
+        if(!removed)
+            return false;
+        removed->left = m_free_nodes;
+        m_free_nodes = removed;
+        --m_count;
+        return true;
+    }
+
+    // returns nullptr if val isn't in the tree
+    T *find(const T& val)
+    {
+        Less less = {};
+        for(Node *node = m_root; node;) {
+            if(less(val, node->val))
+                node = node->left;
+            else if(less(node->val, val))
+                node = node->right;
+            else
+                return &node->val;
+        }
+        return nullptr;
+    }
+
+    // the smallest element that isn't less than val, or nullptr if there isn't one
+    T *lower_bound(const T& val)
+    {
+        Less less = {};
+        T *found = nullptr;
+        for(Node *node = m_root; node;) {
+            if(less(node->val, val)) {
+                node = node->right;
+            } else {
+                found = &node->val;
+                node = node->left;
+            }
+        }
+        return found;
+    }
+
+    // the largest element that isn't greater than val, or nullptr if there isn't one
+    T *floor(const T& val)
+    {
+        Less less = {};
+        T *found = nullptr;
+        for(Node *node = m_root; node;) {
+            if(less(val, node->val)) {
+                node = node->left;
+            } else {
+                found = &node->val;
+                node = node->right;
+            }
+        }
+        return found;
+    }
+
+    // frees every node, along with the pages they are in
+    void clear()
+    {
+        while(m_pages) {
+            NodePage *next = m_pages->next;
+            free_phys_page((paddr)m_pages);
+            m_pages = next;
+        }
+        m_root = 0;
+        m_free_nodes = 0;
+        m_count = 0;
+    }
+
+    static s32 height(Node *node)
+    {
+        return node ? node->height : 0;
+    }
+
+    static void update_height(Node *node)
+    {
+        s32 left = height(node->left);
+        s32 right = height(node->right);
+        node->height = 1 + (left > right ? left : right);
+    }
+
+    static Node *rotate_right(Node *node)
+    {
+        Node *new_top = node->left;
+        node->left = new_top->right;
+        new_top->right = node;
+        update_height(node);
+        update_height(new_top);
+        return new_top;
+    }
+
+    static Node *rotate_left(Node *node)
+    {
+        Node *new_top = node->right;
+        node->right = new_top->left;
+        new_top->left = node;
+        update_height(node);
+        update_height(new_top);
+        return new_top;
+    }
+
+    // the subtrees of node differ in height by at most 2, returns the new root of the subtree
+    static Node *rebalance(Node *node)
+    {
+        update_height(node);
+        s32 balance = height(node->left) - height(node->right);
+        if(balance > 1) {
+            if(height(node->left->left) < height(node->left->right))
+                node->left = rotate_left(node->left);
+            return rotate_right(node);
+        }
+        if(balance < -1) {
+            if(height(node->right->right) < height(node->right->left))
+                node->right = rotate_right(node->right);
+            return rotate_left(node);
+        }
+        return node;
+    }
+
+    Node *insert_at(Node *node, Node *new_node)
+    {
+        if(!node)
+            return new_node;
+        Less less = {};
+        if(less(new_node->val, node->val)) {
+            node->left = insert_at(node->left, new_node);
+        } else {
+            ASSERT(less(node->val, new_node->val));
+            node->right = insert_at(node->right, new_node);
+        }
+        return rebalance(node);
+    }
+
+    Node *remove_at(Node *node, const T& val, Node **removed)
+    {
+        if(!node)
+            return 0;
+        Less less = {};
+        if(less(val, node->val)) {
+            node->left = remove_at(node->left, val, removed);
+        } else if(less(node->val, val)) {
+            node->right = remove_at(node->right, val, removed);
+        } else {
+            *removed = node;
+            if(!node->left)
+                return node->right;
+            if(!node->right)
+                return node->left;
+            // the smallest node of the right subtree takes the removed node's place
+            Node *successor = 0;
+            Node *right = remove_min(node->right, &successor);
+            successor->left = node->left;
+            successor->right = right;
+            return rebalance(successor);
+        }
+        return rebalance(node);
+    }
+
+    static Node *remove_min(Node *node, Node **min)
+    {
+        if(!node->left) {
+            *min = node;
+            return node->right;
+        }
+        node->left = remove_min(node->left, min);
+        return rebalance(node);
+    }
+
+    Node *take_free_node()
+    {
+        if(!m_free_nodes) {
+            auto page = (NodePage *)alloc_phys_page();
+            page->next = m_pages;
+            m_pages = page;
+
+            u64 first_node = round_up_align((u64)page + sizeof(NodePage), alignof(Node));
+            u64 nodes_per_page = ((u64)page + 4096 - first_node) / sizeof(Node);
+            for(u64 i = 0; i < nodes_per_page; ++i) {
+                auto node = (Node *)first_node + i;
+                node->left = m_free_nodes;
+                m_free_nodes = node;
+            }
+        }
+        Node *node = m_free_nodes;
+        m_free_nodes = node->left;
+        return node;
+    }
+};
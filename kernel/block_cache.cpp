@@ -0,0 +1,426 @@
+#pragma once
+#include "kernel/types.h"
+#include "kernel/utils.h"
+#include "kernel/debug.cpp"
+#include "kernel/ata.cpp"
+#include "kernel/kmalloc.h"
+#include "kernel/sort.h"
+#include "include/math.h"
+#include "include/stdlib_workaround.h"
+
+// fixed size write-back cache of filesystem blocks, all block reads/writes from the filesystem go through this
+// so repeated path lookups and indirect block walks don't have to touch the disk
+//
+// entries are found with a hash table keyed by block number, and evicted in least recently used order,
+// dirty entries are only written to the disk when they get evicted or when block_cache_sync() is called
+//
+// disk transfers are sorted and merged into runs of adjacent blocks, which are then sent to the drive as one
+// scatter/gather command each, so e.g. reading or flushing a contiguous file costs a few commands instead of one per block
+//
+// NOTE the cache has no locking of its own, it relies on filesystem code being serialized by the fs lock
+
+const u64 BLOCK_CACHE_SIZE_BYTES = 4*MB; // the number of entries depends on the block size, see init_block_cache()
+const u32 BLOCK_CACHE_HASH_BUCKET_COUNT = 4096; // must be a power of 2, one per entry with 1KB blocks
+
+// one block of a list transfer, buffer is where the block is copied to/from
+struct BlockIO
+{
+    u32 blocknum = 0;
+    u8 *buffer = nullptr;
+};
+
+// the largest run of blocks sent to the drive in one command
+const u32 BLOCK_CACHE_MAX_RUN_SECTORS = DMA_MAX_SECTORS_PER_COMMAND;
+
+struct BlockCacheEntry
+{
+    u32 blocknum = 0;
+    bool is_valid = false;
+    bool is_dirty = false;
+    u8 *data = nullptr;
+
+    BlockCacheEntry *hash_next = nullptr;
+    BlockCacheEntry *lru_prev = nullptr; // towards the most recently used entry
+    BlockCacheEntry *lru_next = nullptr; // towards the least recently used entry
+};
+
+struct BlockCache
+{
+    BlockCacheEntry *entries = nullptr;
+    BlockCacheEntry *buckets[BLOCK_CACHE_HASH_BUCKET_COUNT];
+    BlockCacheEntry *lru_head = nullptr; // most recently used
+    BlockCacheEntry *lru_tail = nullptr; // least recently used
+
+    u64 partition_start_lba = 0;
+    u32 block_size_bytes = 0;
+    u32 block_size_sectors = 0;
+    u32 max_run_blocks = 0;
+    u32 block_count = 0;
+
+    // scratch space for building disk commands
+    // NOTE reads and flushes have separate arrays, since a read can cause a flush by evicting a dirty block
+    BlockCacheEntry **flush_list = nullptr; // block_count entries
+    IOSegment *flush_segments = nullptr; // max_run_blocks entries
+    IOSegment *read_segments = nullptr; // max_run_blocks entries
+};
+BlockCache g_block_cache;
+
+u64 g_block_cache_hits = 0;
+u64 g_block_cache_misses = 0;
+u64 g_block_cache_writebacks = 0;
+u64 g_block_cache_read_commands = 0;
+u64 g_block_cache_write_commands = 0;
+u64 g_block_cache_prefetched = 0;
+
+u64 block_cache_blocknum_to_lba(u32 blocknum)
+{
+    return g_block_cache.partition_start_lba + (u64)blocknum * g_block_cache.block_size_sectors;
+}
+
+u32 block_cache_hash(u32 blocknum)
+{
+    // consecutive block numbers land in consecutive buckets, which is the common access pattern
+    return blocknum & (BLOCK_CACHE_HASH_BUCKET_COUNT - 1);
+}
+
+void block_cache_lru_remove(BlockCacheEntry *entry)
+{
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        g_block_cache.lru_head = entry->lru_next;
+
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        g_block_cache.lru_tail = entry->lru_prev;
+
+    entry->lru_prev = nullptr;
+    entry->lru_next = nullptr;
+}
+
+void block_cache_lru_push_front(BlockCacheEntry *entry)
+{
+    entry->lru_prev = nullptr;
+    entry->lru_next = g_block_cache.lru_head;
+    if(g_block_cache.lru_head)
+        g_block_cache.lru_head->lru_prev = entry;
+    g_block_cache.lru_head = entry;
+    if(!g_block_cache.lru_tail)
+        g_block_cache.lru_tail = entry;
+}
+
+void block_cache_hash_remove(BlockCacheEntry *entry)
+{
+    BlockCacheEntry **slot = &g_block_cache.buckets[block_cache_hash(entry->blocknum)];
+    while(*slot && *slot != entry)
+        slot = &(*slot)->hash_next;
+    ASSERT(*slot == entry);
+    *slot = entry->hash_next;
+    entry->hash_next = nullptr;
+}
+
+BlockCacheEntry *block_cache_lookup(u32 blocknum)
+{
+    BlockCacheEntry *entry = g_block_cache.buckets[block_cache_hash(blocknum)];
+    while(entry && entry->blocknum != blocknum)
+        entry = entry->hash_next;
+    return entry;
+}
+
+void block_cache_sync();
+
+// returns an entry for blocknum that is not in the cache yet, the caller must fill its data
+// NOTE this evicts the least recently used entry, if it is dirty then all dirty entries are flushed together, since
+//      one sorted flush is much cheaper than writing back every evicted block on its' own
+BlockCacheEntry *block_cache_insert(u32 blocknum)
+{
+    ASSERT(!block_cache_lookup(blocknum));
+
+    BlockCacheEntry *entry = g_block_cache.lru_tail;
+    ASSERT(entry);
+    if(entry->is_valid) {
+        if(entry->is_dirty)
+            block_cache_sync();
+        ASSERT(!entry->is_dirty);
+        block_cache_hash_remove(entry);
+    }
+
+    entry->blocknum = blocknum;
+    entry->is_valid = true;
+    entry->is_dirty = false;
+
+    u32 bucket = block_cache_hash(blocknum);
+    entry->hash_next = g_block_cache.buckets[bucket];
+    g_block_cache.buckets[bucket] = entry;
+
+    block_cache_lru_remove(entry);
+    block_cache_lru_push_front(entry);
+    return entry;
+}
+
+void block_cache_touch(BlockCacheEntry *entry)
+{
+    if(g_block_cache.lru_head == entry)
+        return;
+    block_cache_lru_remove(entry);
+    block_cache_lru_push_front(entry);
+}
+
+bool block_io_less(const BlockIO& a, const BlockIO& b)
+{
+    return a.blocknum < b.blocknum;
+}
+
+// reads every block in the list into its' buffer
+// NOTE this sorts ios by block number
+void block_cache_read_list(BlockIO *ios, u64 count)
+{
+    sort(ios, count, block_io_less);
+
+    u32 block_size = g_block_cache.block_size_bytes;
+    u64 i = 0;
+    while(i < count) {
+        BlockCacheEntry *entry = block_cache_lookup(ios[i].blocknum);
+        if(entry) {
+            ++g_block_cache_hits;
+            block_cache_touch(entry);
+            memmove_workaround(ios[i].buffer, entry->data, block_size);
+            ++i;
+            continue;
+        }
+
+        // read the whole run of adjacent missing blocks straight into the callers' buffers with one disk command,
+        // and then fill the cache from there
+        u32 run_blocknum = ios[i].blocknum;
+        u64 run_start = i;
+        u32 segment_count = 0;
+        IOSegment *segments = g_block_cache.read_segments;
+        while(i < count && i - run_start < g_block_cache.max_run_blocks) {
+            if(ios[i].blocknum != run_blocknum + (i - run_start) || block_cache_lookup(ios[i].blocknum))
+                break;
+
+            // buffers that follow each other in memory are merged into one segment, which also keeps the PIO fallback at one command
+            IOSegment *prev = segment_count > 0 ? &segments[segment_count - 1] : nullptr;
+            if(prev && prev->buffer + prev->byte_count == ios[i].buffer)
+                prev->byte_count += block_size;
+            else
+                segments[segment_count++] = {ios[i].buffer, block_size};
+            ++i;
+        }
+        u64 run_count = i - run_start;
+        g_block_cache_misses += run_count;
+        ++g_block_cache_read_commands;
+        read_sectors_gather(segments, segment_count, block_cache_blocknum_to_lba(run_blocknum));
+
+        for(u64 j = run_start; j < run_start + run_count; ++j) {
+            entry = block_cache_insert(ios[j].blocknum);
+            memmove_workaround(entry->data, ios[j].buffer, block_size);
+        }
+        // NOTE duplicate block numbers end the run, they are then handled as hits on the next iteration
+    }
+}
+
+void block_cache_read(u8 *buffer, u32 blocknum, u32 block_count)
+{
+    const u32 CHUNK_SIZE = 64;
+    BlockIO ios[CHUNK_SIZE];
+    for(u32 i = 0; i < block_count; i += CHUNK_SIZE) {
+        u32 count = min(CHUNK_SIZE, block_count - i);
+        for(u32 j = 0; j < count; ++j)
+            ios[j] = {blocknum + i + j, buffer + (u64)(i + j) * g_block_cache.block_size_bytes};
+        block_cache_read_list(ios, count);
+    }
+}
+
+bool blocknum_less(const u32& a, const u32& b)
+{
+    return a < b;
+}
+
+// reads the blocks that aren't cached yet into the cache, without copying them anywhere, runs of adjacent blocks
+// are read straight into their cache entries with one disk command each
+// NOTE this sorts blocknums
+void block_cache_prefetch_list(u32 *blocknums, u64 count)
+{
+    ASSERT(count <= g_block_cache.block_count / 2); // otherwise the run being read could evict its' own entries
+    sort(blocknums, count, blocknum_less);
+
+    u64 i = 0;
+    while(i < count) {
+        BlockCacheEntry *entry = block_cache_lookup(blocknums[i]);
+        if(entry) {
+            block_cache_touch(entry);
+            ++i;
+            continue;
+        }
+
+        u32 run_blocknum = blocknums[i];
+        u32 run_count = 0;
+        IOSegment *segments = g_block_cache.read_segments;
+        while(i < count && run_count < g_block_cache.max_run_blocks && blocknums[i] == run_blocknum + run_count) {
+            entry = block_cache_insert(blocknums[i]);
+            segments[run_count++] = {entry->data, g_block_cache.block_size_bytes};
+            ++i;
+            // NOTE a block that is already cached ends the run, and is touched on the next iteration
+            if(i < count && block_cache_lookup(blocknums[i]))
+                break;
+        }
+        ++g_block_cache_read_commands;
+        g_block_cache_prefetched += run_count;
+        read_sectors_gather(segments, run_count, block_cache_blocknum_to_lba(run_blocknum));
+    }
+}
+
+// NOTE this only marks the blocks dirty, the disk is updated on eviction or block_cache_sync()
+void block_cache_write(u8 *buffer, u32 blocknum, u32 block_count)
+{
+    u32 block_size = g_block_cache.block_size_bytes;
+    for(u32 i = 0; i < block_count; ++i) {
+        BlockCacheEntry *entry = block_cache_lookup(blocknum + i);
+        if(entry)
+            block_cache_touch(entry);
+        else
+            entry = block_cache_insert(blocknum + i); // the whole block is overwritten, so don't read it first
+
+        memmove_workaround(entry->data, buffer + (u64)i * block_size, block_size);
+        entry->is_dirty = true;
+    }
+}
+
+// NOTE this only marks the blocks dirty, the disk is updated on eviction or block_cache_sync()
+void block_cache_write_list(BlockIO *ios, u64 count)
+{
+    for(u64 i = 0; i < count; ++i)
+        block_cache_write(ios[i].buffer, ios[i].blocknum, 1);
+}
+
+// returns a pointer to the cached copy of the block, reading it from the disk if it isn't cached yet
+// NOTE the pointer is only valid until the next block cache call, since that can evict the block
+u8 *block_cache_get(u32 blocknum)
+{
+    BlockCacheEntry *entry = block_cache_lookup(blocknum);
+    if(entry) {
+        ++g_block_cache_hits;
+        block_cache_touch(entry);
+        return entry->data;
+    }
+
+    ++g_block_cache_misses;
+    ++g_block_cache_read_commands;
+    entry = block_cache_insert(blocknum);
+    read_sectors(entry->data, g_block_cache.block_size_sectors, block_cache_blocknum_to_lba(blocknum));
+    return entry->data;
+}
+
+// like block_cache_get(), but for blocks whose old contents don't matter, the block is zeroed instead of being read
+// NOTE the block is marked dirty
+u8 *block_cache_get_zeroed(u32 blocknum)
+{
+    BlockCacheEntry *entry = block_cache_lookup(blocknum);
+    if(entry)
+        block_cache_touch(entry);
+    else
+        entry = block_cache_insert(blocknum);
+
+    memset_workaround(entry->data, 0, g_block_cache.block_size_bytes);
+    entry->is_dirty = true;
+    return entry->data;
+}
+
+// copies one block to another through the cache, dst_blocknum is overwritten completely so it isn't read first
+// NOTE dst_blocknum is marked dirty
+void block_cache_copy(u32 src_blocknum, u32 dst_blocknum)
+{
+    u8 *src = block_cache_get(src_blocknum);
+    BlockCacheEntry *dst = block_cache_lookup(dst_blocknum);
+    if(dst)
+        block_cache_touch(dst);
+    else
+        dst = block_cache_insert(dst_blocknum); // this evicts the least recently used entry, which isn't src since it was just used
+
+    memmove_workaround(dst->data, src, g_block_cache.block_size_bytes);
+    dst->is_dirty = true;
+}
+
+// for callers that modified the data returned by block_cache_get() in place
+void block_cache_mark_dirty(u32 blocknum)
+{
+    BlockCacheEntry *entry = block_cache_lookup(blocknum);
+    ASSERT(entry);
+    entry->is_dirty = true;
+}
+
+bool block_cache_entry_less(BlockCacheEntry *a, BlockCacheEntry *b)
+{
+    return a->blocknum < b->blocknum;
+}
+
+// writes every dirty block to the disk, runs of adjacent blocks are written with one command each
+void block_cache_sync()
+{
+    BlockCacheEntry **dirty = g_block_cache.flush_list;
+    u32 dirty_count = 0;
+    for(u32 i = 0; i < g_block_cache.block_count; ++i) {
+        BlockCacheEntry *entry = &g_block_cache.entries[i];
+        if(entry->is_valid && entry->is_dirty)
+            dirty[dirty_count++] = entry;
+    }
+    sort(dirty, dirty_count, block_cache_entry_less);
+
+    u32 i = 0;
+    while(i < dirty_count) {
+        u32 run_blocknum = dirty[i]->blocknum;
+        u32 run_count = 0;
+        while(i + run_count < dirty_count && run_count < g_block_cache.max_run_blocks && dirty[i + run_count]->blocknum == run_blocknum + run_count) {
+            g_block_cache.flush_segments[run_count] = {dirty[i + run_count]->data, g_block_cache.block_size_bytes};
+            ++run_count;
+        }
+
+        write_sectors_gather(g_block_cache.flush_segments, run_count, block_cache_blocknum_to_lba(run_blocknum));
+        ++g_block_cache_write_commands;
+        g_block_cache_writebacks += run_count;
+        for(u32 j = i; j < i + run_count; ++j)
+            dirty[j]->is_dirty = false;
+        i += run_count;
+    }
+}
+
+void block_cache_print_stats()
+{
+    dbg_str("block cache hits: "); dbg_uint(g_block_cache_hits);
+    dbg_str(" misses: "); dbg_uint(g_block_cache_misses);
+    dbg_str(" writebacks: "); dbg_uint(g_block_cache_writebacks);
+    dbg_str(" read commands: "); dbg_uint(g_block_cache_read_commands);
+    dbg_str(" write commands: "); dbg_uint(g_block_cache_write_commands);
+    dbg_str(" prefetched: "); dbg_uint(g_block_cache_prefetched);
+    dbg_str("\n");
+}
+
+void init_block_cache(u64 partition_start_lba, u32 block_size_bytes)
+{
+    ASSERT(block_size_bytes % 512 == 0);
+    g_block_cache.partition_start_lba = partition_start_lba;
+    g_block_cache.block_size_bytes = block_size_bytes;
+    g_block_cache.block_size_sectors = block_size_bytes / 512;
+    g_block_cache.max_run_blocks = BLOCK_CACHE_MAX_RUN_SECTORS / g_block_cache.block_size_sectors;
+    ASSERT(g_block_cache.max_run_blocks > 0);
+    g_block_cache.block_count = BLOCK_CACHE_SIZE_BYTES / block_size_bytes;
+
+    g_block_cache.flush_list = (BlockCacheEntry **)kmalloc(g_block_cache.block_count * sizeof(BlockCacheEntry *), alignof(BlockCacheEntry *));
+    g_block_cache.flush_segments = (IOSegment *)kmalloc(g_block_cache.max_run_blocks * sizeof(IOSegment), alignof(IOSegment));
+    g_block_cache.read_segments = (IOSegment *)kmalloc(g_block_cache.max_run_blocks * sizeof(IOSegment), alignof(IOSegment));
+
+    g_block_cache.entries = (BlockCacheEntry *)kmalloc(g_block_cache.block_count * sizeof(BlockCacheEntry), alignof(BlockCacheEntry));
+    u8 *data = (u8 *)kmalloc((u64)g_block_cache.block_count * block_size_bytes, 4096);
+    for(u32 i = 0; i < BLOCK_CACHE_HASH_BUCKET_COUNT; ++i)
+        g_block_cache.buckets[i] = nullptr;
+
+    // every entry starts out invalid on the LRU list, so they get used up before anything is evicted
+    for(u32 i = 0; i < g_block_cache.block_count; ++i) {
+        BlockCacheEntry *entry = &g_block_cache.entries[i];
+        *entry = BlockCacheEntry{};
+        entry->data = data + (u64)i * block_size_bytes;
+        block_cache_lru_push_front(entry);
+    }
+}
@@ -396,12 +396,52 @@ void general_protection_fault_handler([[maybe_unused]] InterruptStackFrame *stac
     UNREACHABLE();
 }
 
+void acquire_fs_lock();
+void release_fs_lock();
+extern bool g_in_syscall_context;
+
+// the only page faults that are handled are first touches of demand paged memory, memory mapped files (see
+// Process::map_file()) and executable images (see exec_cache.cpp), and first writes to the copy on write pages of a
+// forked process (see VObject::clone_copy_on_write()), the page is filled in or copied and the faulting instruction
+// is restarted
+// NOTE all interrupts use the same IST stack, so a page fault inside a syscall would overwrite the syscall's part of
+//      the stack, syscalls must call populate_user_buffer() on user buffers instead of faulting
 EXCEPTION_HANDLER_ENTRY_WITH_CODE(0xe, page_fault);
 void page_fault_handler([[maybe_unused]] InterruptStackFrame *stack_frame, [[maybe_unused]] RegisterState *regs, [[maybe_unused]] u64 vector)
 {
     dbg_str("in page_fault()\n");
-    vga_print("in page_fault()\n");
-    UNREACHABLE();
+    vaddr fault_addr = read_cr2();
+    vaddr page_addr = round_down_align(fault_addr, 4096);
+    bool is_not_present = (stack_frame->error_code & 1) == 0;
+    bool is_write = (stack_frame->error_code & 2) != 0;
+
+    Process *proc = current_process();
+    VObject *vobj = nullptr;
+    if(proc && proc->m_vspace && !g_in_syscall_context)
+        vobj = proc->m_vspace->vobj_at(fault_addr);
+
+    u64 page_i = vobj ? (page_addr - vobj->mapped_addr(*proc->m_vspace)) / 4096 : 0;
+    if(vobj && !is_not_present && is_write && vobj->page_is_cow(page_i)) {
+        // copying doesn't touch the filesystem, so this doesn't need the fs lock
+        vobj->copy_page_on_write(page_i);
+        return;
+    }
+
+    if(!vobj || !is_not_present || !vobj->is_demand_paged()) {
+        dbg_str("page fault address: "); dbg_uint(fault_addr);
+        dbg_str(" error code: "); dbg_uint(stack_frame->error_code); dbg_str("\n");
+        vga_print("in page_fault()\n");
+        UNREACHABLE();
+    }
+
+    // the fault is handled like a syscall, so this process can be blocked while it waits for the fs lock or the disk,
+    // and it ends with fs_sync() like one too, so the inodes it touched aren't counted as part of the next syscall
+    g_in_syscall_context = true;
+    acquire_fs_lock();
+    proc->m_vspace->populate_pages(page_addr, 4096, is_write);
+    fs_sync();
+    release_fs_lock();
+    g_in_syscall_context = false;
 }
 
 EXCEPTION_HANDLER_ENTRY_NO_CODE(0x10, x87_exception_pending);
@@ -465,6 +505,47 @@ void unused_exception_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
     //UNREACHABLE();
 }
 
+// processes can be blocked in the middle of a syscall while they wait for disk I/O (see IDEDevice::wait_for_request())
+// the ext2 code is not reentrant, so this makes sure only one process at a time runs a syscall that uses the filesystem
+struct FSLock
+{
+    bool is_locked = false;
+    pid_t owner = 0;
+};
+FSLock g_fs_lock;
+
+void acquire_fs_lock()
+{
+    Process *proc = current_process();
+    while(g_fs_lock.is_locked) {
+        ASSERT(g_fs_lock.owner != proc->pid);
+        ASSERT(can_block_current_process());
+        block_current_process_on_io((u64)&g_fs_lock);
+    }
+    g_fs_lock.is_locked = true;
+    g_fs_lock.owner = proc->pid;
+}
+
+void release_fs_lock()
+{
+    ASSERT(g_fs_lock.is_locked);
+    g_fs_lock.is_locked = false;
+    g_fs_lock.owner = 0;
+    unblock_processes_on_io((u64)&g_fs_lock);
+}
+
+// allocates any untouched demand paged pages of a user buffer before the kernel accesses it, and copies any copy on
+// write pages in it if the kernel is going to write to it (see page_fault_handler())
+void populate_user_buffer(void *buf, u64 size, bool is_write)
+{
+    bool has_fs_lock = g_fs_lock.is_locked && g_fs_lock.owner == current_process()->pid;
+    if(!has_fs_lock)
+        acquire_fs_lock();
+    current_process()->m_vspace->populate_pages((vaddr)buf, size, is_write);
+    if(!has_fs_lock)
+        release_fs_lock();
+}
+
 void _yield([[maybe_unused]] InterruptStackFrame *stack_frame,
             [[maybe_unused]] RegisterState *regs,
             bool called_by_timer)
@@ -478,10 +559,19 @@ void _yield([[maybe_unused]] InterruptStackFrame *stack_frame,
     UNREACHABLE();
 }
 
+// NOTE a process that holds the fs lock is never killed by another process, since releasing the lock underneath a
+//      blocked filesystem syscall would leave the filesystem half modified, the exiting parent waits for the lock
+//      instead (see Process::exit_uses_fs())
 void kill_process(Process *proc)
 {
     dbg_str("in kill_process()\n");
+    bool holds_fs_lock = g_fs_lock.is_locked && g_fs_lock.owner == proc->pid;
+    ASSERT(!holds_fs_lock || proc == current_process());
     proc->exit();
+    if(holds_fs_lock) {
+        fs_sync();
+        release_fs_lock();
+    }
     g_scheduler.remove_from_queue(proc);
     unlink_proc_siblings(proc);
     proc->~Process();
@@ -655,6 +745,41 @@ char *kmalloc_and_normalize_path(const char *pwd, const char *path)
     return path_buf;
 }
 
+bool syscall_uses_fs(u64 syscall_num)
+{
+    switch(syscall_num)
+    {
+        case SYSCALL_EXEC:
+        case SYSCALL_SET_PWD:
+        case SYSCALL_STAT:
+        case SYSCALL_LIST_DIR_BUF_SIZE:
+        case SYSCALL_LIST_DIR:
+        case SYSCALL_FS_READ:
+        case SYSCALL_FS_CREATE_FILE:
+        case SYSCALL_FS_CREATE_DIR:
+        case SYSCALL_FS_RM_FILE:
+        case SYSCALL_FS_RM_DIR:
+        case SYSCALL_FS_MV:
+        case SYSCALL_FS_WRITE:
+        case SYSCALL_FS_TRUNC:
+        case SYSCALL_FS_IS_SAME_PATH:
+        case SYSCALL_FS_IS_DIR_PATH:
+        case SYSCALL_FS_OPEN:
+        case SYSCALL_FS_CLOSE:
+        case SYSCALL_FS_READ_FD:
+        case SYSCALL_FS_WRITE_FD:
+        case SYSCALL_FS_SEEK:
+        case SYSCALL_FS_FSTAT:
+        case SYSCALL_FS_COPY_FD:
+        case SYSCALL_FS_MMAP:
+        case SYSCALL_FS_MSYNC:
+        case SYSCALL_FS_MUNMAP:
+            return true;
+        default:
+            return false;
+    }
+}
+
 // TODO move to own file
 extern CircularBuffer<KeyEvent, 256> g_key_events;
 void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
@@ -672,6 +797,11 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
 
     dbg_str("IN SYSCALL FOR PROCESS: "); dbg_str(current_process()->name); dbg_str("\n");
 
+    bool holds_fs_lock = syscall_uses_fs(syscall_num) ||
+                         (syscall_num == SYSCALL_EXIT && current_process()->exit_uses_fs());
+    if(holds_fs_lock)
+        acquire_fs_lock();
+
     switch(syscall_num)
     {
         case SYSCALL_YIELD:
@@ -738,6 +868,8 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
                 }
 
                 if(flags & EXEC_IS_BLOCKING) {
+                    fs_sync();
+                    release_fs_lock();
                     _yield(stack_frame, regs, false);
                     __builtin_unreachable();
                     UNREACHABLE();
@@ -745,6 +877,26 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             }
         } break;
 
+        case SYSCALL_FORK:
+        {
+            dbg_str("SYSCALL FORK\n");
+            Process *proc = current_process();
+            if(proc->is_kernel_process) {
+                regs->rax = (u64)-1;
+                break;
+            }
+
+            // the child resumes from the same point as the parent, with rax = 0
+            proc->save_register_state(stack_frame, regs);
+            Process *new_proc = (Process *)kmalloc(sizeof(Process), alignof(Process));
+            new ((void *)new_proc) Process(proc, proc->saved_state);
+            g_scheduler.add_to_queue(new_proc);
+
+            new_proc->parent = proc;
+            proc->add_child(new_proc);
+            regs->rax = new_proc->pid;
+        } break;
+
         case SYSCALL_PRINT:
         {
             dbg_str("SYSCALL PRINT\n");
@@ -791,6 +943,7 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             dbg_str("SYSCALL POLL KEYBOARD\n");
             // TODO make sure event is a valid pointer since it comes from userspace
             PollKeyboardResult *res = (PollKeyboardResult *)arg1;
+            populate_user_buffer(res, sizeof(PollKeyboardResult), true);
 
             auto pop_res = g_key_events.pop_start();
             if(pop_res.has_obj) {
@@ -816,6 +969,7 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             dbg_str("SYSCALL TTY INFO\n");
             // TODO this is a user pointer and may be invalid
             TTYInfo *info = (TTYInfo *)arg1;
+            populate_user_buffer(info, sizeof(TTYInfo), true);
             info->cmdline_size = g_tty.CMD_LEN;
             info->scrollback_buffer_size = g_tty.SCROLLBACK_BUFFER_SIZE;
         } break;
@@ -874,6 +1028,7 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
 
             int pwd_len = current_process()->pwd_length();
             const char *pwd = current_process()->get_pwd();
+            populate_user_buffer(dest, min(len, pwd_len), true);
             memmove_workaround(dest, (char *)pwd, min(len, pwd_len));
         } break;
 
@@ -913,6 +1068,7 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
 
             char *path_buf = kmalloc_and_normalize_path(current_process()->get_pwd(), path);
 
+            populate_user_buffer(result, sizeof(FileStatResult), true);
             *result = fs_stat(path_buf);
 
             kfree((vaddr)path_buf);
@@ -952,6 +1108,8 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             char *buf = (char *)arg2;
             int buf_size = (int)arg3;
             char **buf_one_past_end = (char **)arg4;
+            populate_user_buffer(buf, buf_size, true);
+            populate_user_buffer(buf_one_past_end, sizeof(char *), true);
 
             char *path_buf = kmalloc_and_normalize_path(current_process()->get_pwd(), path);
 
@@ -995,6 +1153,7 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             }
 
             if(!error) {
+                populate_user_buffer(buf, size, true);
                 regs->rax = fs_read(path_buf, (u8 *)buf, offset, size);
             }
 
@@ -1023,6 +1182,7 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             }
 
             if(!error) {
+                populate_user_buffer(buf, size, false);
                 regs->rax = fs_write(path_buf, (u8 *)buf, offset, size);
             }
 
@@ -1211,6 +1371,189 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
             kfree((vaddr)path_buf);
         }break;
 
+        case SYSCALL_FS_OPEN: {
+            dbg_str("SYSCALL FS OPEN\n");
+            // TODO user pointer could fault
+            const char *path = (char *)arg1;
+            u64 flags = arg2;
+
+            char *path_buf = kmalloc_and_normalize_path(current_process()->get_pwd(), path);
+
+            regs->rax = (u64)-1;
+            bool error = false;
+
+            auto stat = fs_stat(path_buf);
+            if(!stat.found_file) {
+                if(flags & OPEN_CREATE)
+                    error = fs_create(path_buf, FS_TYPE_REG_FILE) != FS_STATUS_OK;
+                else
+                    error = true;
+            }
+
+            FileOpenResult open_res = {};
+            if(!error) {
+                open_res = fs_open(path_buf);
+                error = open_res.status != FS_STATUS_OK;
+            }
+            if(!error && (flags & OPEN_TRUNCATE))
+                error = fs_truncate_inode(open_res.inode_num, 0) != FS_STATUS_OK;
+
+            int fd = -1;
+            if(!error) {
+                fd = current_process()->alloc_fd();
+                error = fd < 0;
+            }
+
+            if(!error) {
+                OpenFile *file = current_process()->get_open_file(fd);
+                file->inode_num = open_res.inode_num;
+                file->generation = open_res.generation;
+                file->offset = (flags & OPEN_APPEND) ? fs_stat_inode(open_res.inode_num).size : 0;
+                regs->rax = (u64)fd;
+            }
+
+            kfree((vaddr)path_buf);
+        }break;
+
+        case SYSCALL_FS_CLOSE: {
+            dbg_str("SYSCALL FS CLOSE\n");
+            int fd = (int)arg1;
+
+            OpenFile *file = current_process()->get_open_file(fd);
+            if(file) {
+                if(fs_open_file_is_valid(file->inode_num, file->generation))
+                    fs_release_prealloc(file->inode_num);
+                file->is_open = false;
+                regs->rax = SYS_SUCCESS;
+            } else {
+                regs->rax = SYS_BAD_FD;
+            }
+        }break;
+
+        case SYSCALL_FS_READ_FD: {
+            dbg_str("SYSCALL FS READ FD\n");
+            // TODO user pointer could fault
+            int fd = (int)arg1;
+            u8 *buf = (u8 *)arg2;
+            u64 size = arg3;
+
+            OpenFile *file = current_process()->get_open_file(fd);
+            if(!file || !fs_open_file_is_valid(file->inode_num, file->generation)) {
+                regs->rax = (u64)-1;
+            } else {
+                populate_user_buffer(buf, size, true);
+                u64 nread = fs_read_inode(file->inode_num, buf, file->offset, size, &file->readahead);
+                file->offset += nread;
+                regs->rax = nread;
+            }
+        }break;
+
+        case SYSCALL_FS_WRITE_FD: {
+            dbg_str("SYSCALL FS WRITE FD\n");
+            // TODO user pointer could fault
+            int fd = (int)arg1;
+            u8 *buf = (u8 *)arg2;
+            u64 size = arg3;
+
+            OpenFile *file = current_process()->get_open_file(fd);
+            if(file)
+                populate_user_buffer(buf, size, false);
+            if(!file || !fs_open_file_is_valid(file->inode_num, file->generation)) {
+                regs->rax = (u64)-1;
+            } else if(fs_write_inode(file->inode_num, buf, file->offset, size) != FS_STATUS_OK) {
+                regs->rax = (u64)-1;
+            } else {
+                file->offset += size;
+                regs->rax = size;
+            }
+        }break;
+
+        case SYSCALL_FS_SEEK: {
+            dbg_str("SYSCALL FS SEEK\n");
+            int fd = (int)arg1;
+            s64 offset = (s64)arg2;
+            int whence = (int)arg3;
+
+            regs->rax = (u64)-1;
+            OpenFile *file = current_process()->get_open_file(fd);
+            if(file && fs_open_file_is_valid(file->inode_num, file->generation)) {
+                s64 base = 0;
+                if(whence == SEEK_CUR)
+                    base = file->offset;
+                else if(whence == SEEK_END)
+                    base = fs_stat_inode(file->inode_num).size;
+
+                s64 new_offset = base + offset;
+                bool is_valid_whence = whence == SEEK_SET || whence == SEEK_CUR || whence == SEEK_END;
+                if(is_valid_whence && new_offset >= 0) {
+                    file->offset = new_offset;
+                    regs->rax = (u64)new_offset;
+                }
+            }
+        }break;
+
+        case SYSCALL_FS_FSTAT: {
+            dbg_str("SYSCALL FS FSTAT\n");
+            // TODO user pointer could fault
+            int fd = (int)arg1;
+            FileStatResult *result = (FileStatResult *)arg2;
+
+            populate_user_buffer(result, sizeof(FileStatResult), true);
+            OpenFile *file = current_process()->get_open_file(fd);
+            if(!file || !fs_open_file_is_valid(file->inode_num, file->generation))
+                *result = {};
+            else
+                *result = fs_stat_inode(file->inode_num);
+        }break;
+
+        case SYSCALL_FS_COPY_FD: {
+            dbg_str("SYSCALL FS COPY FD\n");
+            int src_fd = (int)arg1;
+            int dst_fd = (int)arg2;
+            u64 size = arg3;
+
+            OpenFile *src = current_process()->get_open_file(src_fd);
+            OpenFile *dst = current_process()->get_open_file(dst_fd);
+            if(!src || !fs_open_file_is_valid(src->inode_num, src->generation)
+            || !dst || !fs_open_file_is_valid(dst->inode_num, dst->generation)) {
+                regs->rax = (u64)-1;
+            } else {
+                auto result = fs_copy_inode(src->inode_num, src->offset, dst->inode_num, dst->offset, size);
+                src->offset += result.bytes_copied;
+                dst->offset += result.bytes_copied;
+                // like a short write, only report the error if nothing was copied
+                if(result.status != FS_STATUS_OK && result.bytes_copied == 0)
+                    regs->rax = (u64)-1;
+                else
+                    regs->rax = result.bytes_copied;
+            }
+        }break;
+
+        case SYSCALL_FS_MMAP: {
+            dbg_str("SYSCALL FS MMAP\n");
+            int fd = (int)arg1;
+            u64 offset = arg2;
+            u64 size = arg3;
+
+            OpenFile *file = current_process()->get_open_file(fd);
+            if(!file || !fs_open_file_is_valid(file->inode_num, file->generation) || size == 0 || !is_aligned(offset, 4096))
+                regs->rax = 0;
+            else
+                regs->rax = current_process()->map_file(file->inode_num, file->generation, offset, size);
+        }break;
+
+        case SYSCALL_FS_MSYNC: {
+            dbg_str("SYSCALL FS MSYNC\n");
+            vaddr addr = (vaddr)arg1;
+            regs->rax = current_process()->sync_file_mapping(addr) ? SYS_SUCCESS : SYS_BAD_ADDR;
+        }break;
+
+        case SYSCALL_FS_MUNMAP: {
+            dbg_str("SYSCALL FS MUNMAP\n");
+            vaddr addr = (vaddr)arg1;
+            regs->rax = current_process()->unmap_file_mapping(addr) ? SYS_SUCCESS : SYS_BAD_ADDR;
+        }break;
+
         default:
         {
             dbg_str("invalid syscall_num: "); dbg_uint(syscall_num); dbg_str("\n");
@@ -1218,6 +1561,10 @@ void syscall_handler([[maybe_unused]] InterruptStackFrame *stack_frame,
         } break;
     }
 
+    if(holds_fs_lock) {
+        fs_sync();
+        release_fs_lock();
+    }
     g_in_syscall_context = false;
 }
 
@@ -1298,6 +1645,10 @@ void generic_interrupt_handler([[maybe_unused]] InterruptStackFrame *stack_frame
             case 1: {
                 g_ps2_keyboard.handle_irq();
             } break;
+            case IDE_PRIMARY_IRQ:
+            case IDE_SECONDARY_IRQ: {
+                ide_handle_irq(irq);
+            } break;
             default: {
                 UNREACHABLE(); // TODO unimplemented dynamic dispatch for PIC interrupts
             } break;
@@ -0,0 +1,204 @@
+#pragma once
+#include "kernel/types.h"
+#include "kernel/debug.cpp"
+#include "kernel/kmalloc.h"
+#include "include/stdlib_workaround.h"
+
+// caches directory entry lookups as (parent inode, name) -> (inode, file type), so lookup_path() doesn't have to
+// read and scan the directory blocks of every path component
+//
+// names that don't exist are cached too (negative entries, inode_num == 0), so repeated lookups of missing
+// files are also fast. any function that adds or removes a directory entry must call dentry_cache_invalidate()
+//
+// NOTE like the block cache, this relies on filesystem code being serialized by the fs lock
+
+const u32 DENTRY_CACHE_ENTRY_COUNT = 1024;
+const u32 DENTRY_CACHE_HASH_BUCKET_COUNT = 512; // must be a power of 2
+const u32 DENTRY_CACHE_MAX_NAME_LENGTH = 64; // longer names are not cached, they are rare enough to always go to the disk
+
+struct DentryCacheEntry
+{
+    u32 parent_inode_num = 0;
+    u32 inode_num = 0; // 0 if this is a negative entry
+    u8 file_type = 0;
+    u8 name_length = 0;
+    bool is_valid = false;
+    char name[DENTRY_CACHE_MAX_NAME_LENGTH];
+
+    DentryCacheEntry *hash_next = nullptr;
+    DentryCacheEntry *lru_prev = nullptr; // towards the most recently used entry
+    DentryCacheEntry *lru_next = nullptr; // towards the least recently used entry
+};
+
+struct DentryCache
+{
+    DentryCacheEntry *entries = nullptr;
+    DentryCacheEntry *buckets[DENTRY_CACHE_HASH_BUCKET_COUNT];
+    DentryCacheEntry *lru_head = nullptr; // most recently used
+    DentryCacheEntry *lru_tail = nullptr; // least recently used
+};
+DentryCache g_dentry_cache;
+
+u64 g_dentry_cache_hits = 0;
+u64 g_dentry_cache_misses = 0;
+
+u32 dentry_cache_hash(u32 parent_inode_num, const char *name, u64 name_len)
+{
+    // FNV-1a
+    u32 hash = 2166136261u ^ parent_inode_num;
+    for(u64 i = 0; i < name_len; ++i) {
+        hash ^= (u8)name[i];
+        hash *= 16777619u;
+    }
+    return hash & (DENTRY_CACHE_HASH_BUCKET_COUNT - 1);
+}
+
+bool dentry_cache_entry_matches(DentryCacheEntry *entry, u32 parent_inode_num, const char *name, u64 name_len)
+{
+    return entry->parent_inode_num == parent_inode_num && entry->name_length == name_len && strncmp_workaround(entry->name, name, name_len) == 0;
+}
+
+void dentry_cache_lru_remove(DentryCacheEntry *entry)
+{
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        g_dentry_cache.lru_head = entry->lru_next;
+
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        g_dentry_cache.lru_tail = entry->lru_prev;
+
+    entry->lru_prev = nullptr;
+    entry->lru_next = nullptr;
+}
+
+void dentry_cache_lru_push_front(DentryCacheEntry *entry)
+{
+    entry->lru_prev = nullptr;
+    entry->lru_next = g_dentry_cache.lru_head;
+    if(g_dentry_cache.lru_head)
+        g_dentry_cache.lru_head->lru_prev = entry;
+    g_dentry_cache.lru_head = entry;
+    if(!g_dentry_cache.lru_tail)
+        g_dentry_cache.lru_tail = entry;
+}
+
+void dentry_cache_lru_push_back(DentryCacheEntry *entry)
+{
+    entry->lru_next = nullptr;
+    entry->lru_prev = g_dentry_cache.lru_tail;
+    if(g_dentry_cache.lru_tail)
+        g_dentry_cache.lru_tail->lru_next = entry;
+    g_dentry_cache.lru_tail = entry;
+    if(!g_dentry_cache.lru_head)
+        g_dentry_cache.lru_head = entry;
+}
+
+// NOTE removed entries go to the back of the LRU list, so they are re-used before any valid entries get evicted
+void dentry_cache_remove(DentryCacheEntry *entry)
+{
+    ASSERT(entry->is_valid);
+    DentryCacheEntry **slot = &g_dentry_cache.buckets[dentry_cache_hash(entry->parent_inode_num, entry->name, entry->name_length)];
+    while(*slot && *slot != entry)
+        slot = &(*slot)->hash_next;
+    ASSERT(*slot == entry);
+    *slot = entry->hash_next;
+    entry->hash_next = nullptr;
+    entry->is_valid = false;
+
+    dentry_cache_lru_remove(entry);
+    dentry_cache_lru_push_back(entry);
+}
+
+DentryCacheEntry *dentry_cache_lookup(u32 parent_inode_num, const char *name, u64 name_len)
+{
+    if(name_len > DENTRY_CACHE_MAX_NAME_LENGTH)
+        return nullptr;
+
+    DentryCacheEntry *entry = g_dentry_cache.buckets[dentry_cache_hash(parent_inode_num, name, name_len)];
+    while(entry && !dentry_cache_entry_matches(entry, parent_inode_num, name, name_len))
+        entry = entry->hash_next;
+
+    if(!entry) {
+        ++g_dentry_cache_misses;
+        return nullptr;
+    }
+
+    ++g_dentry_cache_hits;
+    if(g_dentry_cache.lru_head != entry) {
+        dentry_cache_lru_remove(entry);
+        dentry_cache_lru_push_front(entry);
+    }
+    return entry;
+}
+
+// pass inode_num 0 to add a negative entry
+void dentry_cache_insert(u32 parent_inode_num, const char *name, u64 name_len, u32 inode_num, u8 file_type)
+{
+    if(name_len > DENTRY_CACHE_MAX_NAME_LENGTH)
+        return;
+
+    DentryCacheEntry *entry = g_dentry_cache.lru_tail;
+    ASSERT(entry);
+    if(entry->is_valid)
+        dentry_cache_remove(entry);
+
+    entry->parent_inode_num = parent_inode_num;
+    entry->inode_num = inode_num;
+    entry->file_type = file_type;
+    entry->name_length = name_len;
+    memmove_workaround(entry->name, (void *)name, name_len);
+    entry->is_valid = true;
+
+    u32 bucket = dentry_cache_hash(parent_inode_num, name, name_len);
+    entry->hash_next = g_dentry_cache.buckets[bucket];
+    g_dentry_cache.buckets[bucket] = entry;
+
+    dentry_cache_lru_remove(entry);
+    dentry_cache_lru_push_front(entry);
+}
+
+void dentry_cache_invalidate(u32 parent_inode_num, const char *name, u64 name_len)
+{
+    if(name_len > DENTRY_CACHE_MAX_NAME_LENGTH)
+        return;
+
+    DentryCacheEntry *entry = g_dentry_cache.buckets[dentry_cache_hash(parent_inode_num, name, name_len)];
+    while(entry && !dentry_cache_entry_matches(entry, parent_inode_num, name, name_len))
+        entry = entry->hash_next;
+    if(entry)
+        dentry_cache_remove(entry);
+}
+
+// removes every entry looked up inside the directory dir_inode_num, this must be done when the directory's
+// inode is freed, since the inode number can be re-used by a different directory
+void dentry_cache_invalidate_dir(u32 dir_inode_num)
+{
+    for(u32 i = 0; i < DENTRY_CACHE_ENTRY_COUNT; ++i) {
+        DentryCacheEntry *entry = &g_dentry_cache.entries[i];
+        if(entry->is_valid && entry->parent_inode_num == dir_inode_num)
+            dentry_cache_remove(entry);
+    }
+}
+
+void dentry_cache_print_stats()
+{
+    dbg_str("dentry cache hits: "); dbg_uint(g_dentry_cache_hits);
+    dbg_str(" misses: "); dbg_uint(g_dentry_cache_misses);
+    dbg_str("\n");
+}
+
+void init_dentry_cache()
+{
+    g_dentry_cache.entries = (DentryCacheEntry *)kmalloc(DENTRY_CACHE_ENTRY_COUNT * sizeof(DentryCacheEntry), alignof(DentryCacheEntry));
+    for(u32 i = 0; i < DENTRY_CACHE_HASH_BUCKET_COUNT; ++i)
+        g_dentry_cache.buckets[i] = nullptr;
+
+    for(u32 i = 0; i < DENTRY_CACHE_ENTRY_COUNT; ++i) {
+        DentryCacheEntry *entry = &g_dentry_cache.entries[i];
+        *entry = DentryCacheEntry{};
+        dentry_cache_lru_push_front(entry);
+    }
+}
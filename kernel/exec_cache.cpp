@@ -0,0 +1,327 @@
+#pragma once
+#include "kernel/types.h"
+#include "kernel/debug.cpp"
+#include "kernel/vector.h"
+#include "kernel/vspace.h"
+#include "kernel/physical_allocator.h"
+#include "kernel/readahead.h"
+#include "kernel/ext2.cpp"
+#include "external/elf_abi.h"
+#include "include/math.h"
+
+// caches the loaded images of executables by inode, so exec doesn't have to read the ELF file and lay out its'
+// segments every time a program is started
+//
+// the pages of an image are laid out the way the program expects them in memory, each process gets its' own VObject
+// that shares the read-only pages with the image and has its' own copies of the pages that are part of a writable
+// segment (see exec_image_instantiate())
+//
+// images are demand paged: code pages are only read from the file the first time any process executes them, and
+// bss pages are only allocated (zeroed) when a process first touches them, so starting a large program only reads
+// its' headers, read-only data and initialized data (see VObject::fill_exec_page())
+//
+// NOTE pages are reference counted, so pages that are still mapped in a process stay around after their image is
+//      evicted. ext2 calls exec_cache_invalidate() whenever a file's contents change
+// NOTE like the block cache, this relies on filesystem code being serialized by the fs lock
+
+const u32 EXEC_CACHE_ENTRY_COUNT = 16;
+
+enum ExecPageKind
+{
+    EXEC_PAGE_READ_ONLY, // read when the image is loaded, shared with every process
+    EXEC_PAGE_CODE, // read the first time any process executes it, shared with every process
+    EXEC_PAGE_DATA, // read when the image is loaded, every process gets its' own copy
+    EXEC_PAGE_BSS, // not in the file, every process gets its' own zeroed page the first time it touches it
+};
+
+// the part of a PT_LOAD segment that is in the file
+struct ExecSegment
+{
+    u64 vaddr = 0;
+    u64 file_offset = 0;
+    u64 file_size = 0;
+};
+
+struct ExecImage
+{
+    u32 inode_num = 0; // 0 once the image doesn't read from the file anymore (see exec_cache_invalidate())
+    u32 generation = 0;
+    u64 entry = 0; // offset of the entry point from the start of the image
+    Vector<ExecSegment> segments = {};
+    Vector<paddr> pages = {}; // 0 for code pages that haven't been read yet and for bss pages
+    Vector<u8> page_kinds = {};
+    FileReadahead readahead = {};
+    u32 ref_count = 0; // number of VObjects made from this image
+    u64 last_used = 0;
+};
+
+struct ExecCache
+{
+    ExecImage *entries[EXEC_CACHE_ENTRY_COUNT] = {};
+    Vector<ExecImage *> evicted = {}; // images that are still used by processes, so their code can still be read in
+    u64 use_counter = 0;
+};
+ExecCache g_exec_cache;
+
+u64 g_exec_cache_hits = 0;
+u64 g_exec_cache_misses = 0;
+u64 g_exec_cache_pages_read = 0;
+
+void exec_image_free(ExecImage *img)
+{
+    ASSERT(img->ref_count == 0);
+    // drops the image's references, pages that are still mapped in a process are freed when it exits
+    for(u32 i = 0; i < img->pages.length; ++i)
+        if(img->pages[i])
+            free_phys_page(img->pages[i]);
+    img->~ExecImage();
+    kfree((vaddr)img);
+}
+
+// reads the parts of the segments that overlap the page into it
+void exec_image_read_page(ExecImage *img, u64 index)
+{
+    ASSERT(img->inode_num != 0);
+    ASSERT(img->pages[index] == 0);
+    paddr page = alloc_phys_page(); // zeroed, so anything not covered by a segment is already zeroed
+    u64 page_start = index * 4096;
+    u64 page_end = page_start + 4096;
+    for(u32 i = 0; i < img->segments.length; ++i) {
+        ExecSegment& seg = img->segments[i];
+        u64 start = max(page_start, seg.vaddr);
+        u64 end = min(page_end, seg.vaddr + seg.file_size);
+        if(start >= end)
+            continue;
+        u64 nread = fs_read_inode(img->inode_num, (u8 *)page + (start - page_start),
+                                  seg.file_offset + (start - seg.vaddr), end - start, &img->readahead);
+        ASSERT(nread == end - start);
+    }
+    img->pages[index] = page;
+    ++g_exec_cache_pages_read;
+}
+
+// reads the program headers and the pages that aren't demand paged
+void exec_image_load(ExecImage *img, u32 inode_num, u32 generation)
+{
+    img->inode_num = inode_num;
+    img->generation = generation;
+
+    Elf64_Ehdr elf_hdr;
+    u64 nread = fs_read_inode(inode_num, (u8 *)&elf_hdr, 0, sizeof(elf_hdr));
+    ASSERT(nread == sizeof(elf_hdr));
+    ASSERT(IS_ELF(elf_hdr));
+
+    u64 phdrs_size = (u64)elf_hdr.e_phentsize * elf_hdr.e_phnum;
+    u8 *phdrs = (u8 *)kmalloc(phdrs_size, 64);
+    nread = fs_read_inode(inode_num, phdrs, elf_hdr.e_phoff, phdrs_size);
+    ASSERT(nread == phdrs_size);
+
+    // NOTE the image is mapped at a different address in every process without being relocated, so programs must be
+    //      position independent
+    u64 img_size = 0;
+    for(int i = 0; i < elf_hdr.e_phnum; ++i) {
+        auto phdr = (Elf64_Phdr *)(phdrs + elf_hdr.e_phentsize * i);
+        if(phdr->p_type == PT_DYNAMIC) {
+            u8 *dyn_buffer = (u8 *)kmalloc(phdr->p_filesz, 64);
+            nread = fs_read_inode(inode_num, dyn_buffer, phdr->p_offset, phdr->p_filesz);
+            ASSERT(nread == phdr->p_filesz);
+            Elf64_Dyn *dyn = (Elf64_Dyn *)dyn_buffer;
+            while(1) {
+                ASSERT(!(dyn->d_tag == DT_REL || dyn->d_tag == DT_RELA || dyn->d_tag == DT_RELR));
+                if(dyn->d_tag == DT_NULL)
+                    break;
+                dyn++;
+            }
+            kfree((vaddr)dyn_buffer);
+        }
+        if(phdr->p_type == PT_LOAD && phdr->p_memsz > 0) {
+            img_size = max(img_size, phdr->p_vaddr + phdr->p_memsz);
+            if(phdr->p_filesz > 0)
+                img->segments.append({phdr->p_vaddr, phdr->p_offset, phdr->p_filesz});
+        }
+    }
+
+    // a page is code only if every segment that overlaps it is executable and read-only, so a page shared between
+    // code and data is read in with the data. pages that no segment overlaps are treated like the bss, so they are
+    // only allocated if they're touched
+    u64 page_count = round_up_divide(img_size, 4096);
+    img->pages.expand_capacity(page_count);
+    img->page_kinds.expand_capacity(page_count);
+    for(u64 page_i = 0; page_i < page_count; ++page_i) {
+        u64 page_start = page_i * 4096;
+        u64 page_end = page_start + 4096;
+        bool is_writable = false;
+        bool has_file_data = false;
+        bool has_code = false;
+        bool has_other = false;
+        for(int i = 0; i < elf_hdr.e_phnum; ++i) {
+            auto phdr = (Elf64_Phdr *)(phdrs + elf_hdr.e_phentsize * i);
+            if(phdr->p_type != PT_LOAD || page_end <= phdr->p_vaddr || page_start >= phdr->p_vaddr + phdr->p_memsz)
+                continue;
+            if(phdr->p_flags & PF_W)
+                is_writable = true;
+            if(page_start < phdr->p_vaddr + phdr->p_filesz)
+                has_file_data = true;
+            if((phdr->p_flags & PF_X) && !(phdr->p_flags & PF_W))
+                has_code = true;
+            else
+                has_other = true;
+        }
+
+        u8 kind = EXEC_PAGE_BSS;
+        if(is_writable)
+            kind = has_file_data ? EXEC_PAGE_DATA : EXEC_PAGE_BSS;
+        else if(has_other)
+            kind = EXEC_PAGE_READ_ONLY;
+        else if(has_code)
+            kind = EXEC_PAGE_CODE;
+        img->pages.append(0);
+        img->page_kinds.append(kind);
+    }
+
+    for(u64 page_i = 0; page_i < page_count; ++page_i) {
+        u8 kind = img->page_kinds[page_i];
+        if(kind == EXEC_PAGE_READ_ONLY || kind == EXEC_PAGE_DATA)
+            exec_image_read_page(img, page_i);
+    }
+
+    img->entry = elf_hdr.e_entry;
+    kfree((vaddr)phdrs);
+}
+
+// returns the image of the executable, loading it if it isn't cached
+ExecImage *exec_cache_get(u32 inode_num, u32 generation)
+{
+    // evicted images are freed here instead of when their last VObject is destroyed, since processes can exit
+    // without holding the fs lock
+    for(u32 i = 0; i < g_exec_cache.evicted.length;) {
+        ExecImage *img = g_exec_cache.evicted[i];
+        if(img->ref_count == 0) {
+            exec_image_free(img);
+            g_exec_cache.evicted.unstable_remove(i);
+        } else {
+            ++i;
+        }
+    }
+
+    u32 lru_i = 0;
+    for(u32 i = 0; i < EXEC_CACHE_ENTRY_COUNT; ++i) {
+        ExecImage *img = g_exec_cache.entries[i];
+        if(img && img->inode_num == inode_num && img->generation == generation) {
+            ++g_exec_cache_hits;
+            img->last_used = ++g_exec_cache.use_counter;
+            return img;
+        }
+        ExecImage *lru = g_exec_cache.entries[lru_i];
+        if(lru && (!img || img->last_used < lru->last_used))
+            lru_i = i;
+    }
+
+    ++g_exec_cache_misses;
+    ExecImage *lru = g_exec_cache.entries[lru_i];
+    if(lru) {
+        if(lru->ref_count == 0)
+            exec_image_free(lru);
+        else
+            g_exec_cache.evicted.append(lru);
+    }
+
+    ExecImage *img = (ExecImage *)kmalloc(sizeof(ExecImage), alignof(ExecImage));
+    new ((void *)img) ExecImage();
+    exec_image_load(img, inode_num, generation);
+    img->last_used = ++g_exec_cache.use_counter;
+    g_exec_cache.entries[lru_i] = img;
+    return img;
+}
+
+// makes the VObject for one process, the read-only pages are shared with the image and mapped read-only by
+// VObject::map(), the data pages are copied, and code pages that haven't been read yet and bss pages are left
+// unmapped until they're touched
+VObject *exec_image_instantiate(ExecImage *img)
+{
+    VObject *vobj = (VObject *)kmalloc(sizeof(VObject), alignof(VObject));
+    new ((void *)vobj) VObject();
+    vobj->alignment = 4096;
+    vobj->exec_image = img;
+    ++img->ref_count;
+    vobj->underlying_pages.expand_capacity(img->pages.length);
+    vobj->page_is_read_only.expand_capacity(img->pages.length);
+    for(u32 i = 0; i < img->pages.length; ++i) {
+        u8 kind = img->page_kinds[i];
+        paddr page = img->pages[i];
+        if(kind == EXEC_PAGE_DATA) {
+            paddr copy = alloc_phys_page_unzeroed();
+            memmove_workaround((void *)copy, (void *)page, 4096);
+            page = copy;
+        } else if(page) {
+            ref_phys_page(page);
+        }
+        vobj->underlying_pages.append(page);
+        vobj->page_is_read_only.append(kind == EXEC_PAGE_READ_ONLY || kind == EXEC_PAGE_CODE);
+    }
+    return vobj;
+}
+
+// returns the page that a VObject made from the image should use for a page it touched for the first time, the
+// VObject owns a reference to it
+// NOTE the fs lock must be held, since this may read from the file
+paddr exec_image_fill_page(ExecImage *img, u64 index)
+{
+    u8 kind = img->page_kinds[index];
+    ASSERT(kind == EXEC_PAGE_CODE || kind == EXEC_PAGE_BSS);
+    if(kind == EXEC_PAGE_BSS)
+        return alloc_phys_page();
+
+    if(!img->pages[index])
+        exec_image_read_page(img, index);
+    ref_phys_page(img->pages[index]);
+    return img->pages[index];
+}
+
+// called by VObject's destructor, which may run without the fs lock (see exec_cache_get())
+void exec_image_release(ExecImage *img)
+{
+    ASSERT(img->ref_count > 0);
+    --img->ref_count;
+}
+
+// reads every code page that hasn't been read yet, so the image doesn't depend on the file anymore
+void exec_image_detach_from_file(ExecImage *img)
+{
+    for(u64 i = 0; i < img->pages.length; ++i)
+        if(img->page_kinds[i] == EXEC_PAGE_CODE && !img->pages[i])
+            exec_image_read_page(img, i);
+    img->inode_num = 0;
+}
+
+// called by ext2 before the contents of the file change or it's deleted
+// images that are still used by processes read the rest of their code first, so those processes keep running the
+// version of the program they started with
+void exec_cache_invalidate(u32 inode_num)
+{
+    for(u32 i = 0; i < EXEC_CACHE_ENTRY_COUNT; ++i) {
+        ExecImage *img = g_exec_cache.entries[i];
+        if(!img || img->inode_num != inode_num)
+            continue;
+        g_exec_cache.entries[i] = nullptr;
+        if(img->ref_count == 0) {
+            exec_image_free(img);
+        } else {
+            exec_image_detach_from_file(img);
+            g_exec_cache.evicted.append(img);
+        }
+    }
+    for(u32 i = 0; i < g_exec_cache.evicted.length; ++i) {
+        ExecImage *img = g_exec_cache.evicted[i];
+        if(img->inode_num == inode_num && img->ref_count > 0)
+            exec_image_detach_from_file(img);
+    }
+}
+
+void exec_cache_print_stats()
+{
+    dbg_str("exec cache hits: "); dbg_uint(g_exec_cache_hits);
+    dbg_str(" misses: "); dbg_uint(g_exec_cache_misses);
+    dbg_str(" pages read: "); dbg_uint(g_exec_cache_pages_read);
+    dbg_str("\n");
+}
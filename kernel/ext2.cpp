@@ -2,12 +2,19 @@
 #include "kernel/types.h"
 #include "kernel/debug.cpp"
 #include "kernel/ata.cpp"
+#include "kernel/block_cache.cpp"
+#include "kernel/dentry_cache.cpp"
+#include "kernel/readahead.h"
 #include "include/math.h"
 #include "kernel/kmalloc.h"
 #include "include/stdlib_workaround.h"
 #include "include/math.h"
 #include "include/filesystem_defs.h"
 
+// loaded executables are cached by inode (see exec_cache.cpp), the cached image must be dropped before the file's
+// contents change
+void exec_cache_invalidate(u32 inode_num);
+
 // https://www.nongnu.org/ext2-doc/ext2.html#s-block-group-nr
 
 // https://wiki.osdev.org/MBR_(x86)
@@ -60,6 +67,10 @@ const u32 EXT2_FEATURE_RO_COMPAT_BTREE_DIR = 0x04; // binary tree sorted directo
 
 const u32 EXT2_ROOT_DIR_INODE = 2; // inode index of the root directory
 
+// superblock flags, these say how the directory index hashes treat chars
+const u32 EXT2_FLAGS_SIGNED_HASH = 0x1;
+const u32 EXT2_FLAGS_UNSIGNED_HASH = 0x2;
+
 struct __attribute__((__packed__)) SuperBlock
 {
     u32 total_inode_count;
@@ -119,9 +130,18 @@ struct __attribute__((__packed__)) SuperBlock
     // other options
     u32 default_mount_options;
     u32 first_meta_block_group;
-    u8 _reserved[760];
+    u32 mkfs_time;
+    u32 journal_blocks[17];
+    u32 _blocks_count_hi; // 64 bit support, unused by ext2
+    u32 _reserved_blocks_count_hi;
+    u32 _free_blocks_count_hi;
+    u16 min_extra_inode_size;
+    u16 want_extra_inode_size;
+    u32 flags; // EXT2_FLAGS_*
+    u8 _reserved[668];
 };
 static_assert(sizeof(SuperBlock) == 1024, "Superblock must be 1024 (size of smallest block)");
+static_assert(__builtin_offsetof(SuperBlock, flags) == 0x160, "SuperBlock flags must match the on-disk layout");
 
 struct __attribute__((__packed__)) BlockGroupDescriptor
 {
@@ -139,6 +159,8 @@ static_assert(sizeof(BlockGroupDescriptor) == 32, "BlockGroupDescriptor must be
 const u16 EXT2_INODE_TYPE_REG_FILE = 0x8000;
 const u16 EXT2_INODE_TYPE_DIR      = 0x4000;
 
+const u32 EXT2_INODE_FLAG_INDEX = 0x1000; // directory uses a hashed index
+
 const u16 EXT2_INODE_USER_READ     = 0x0100;
 const u16 EXT2_INODE_USER_WRITE    = 0x0080;
 const u16 EXT2_INODE_USER_EXEC     = 0x0040;
@@ -202,6 +224,51 @@ struct __attribute__((__packed__)) DirectoryEntry
 };
 static_assert(sizeof(DirectoryEntry) == 8, "INode must be 8 bytes");
 
+// hashed directory index (htree), used by directories with EXT2_INODE_FLAG_INDEX set
+//
+// block 0 of an indexed directory is the index root: the "." and ".." entries, with ".." spanning the rest of the
+// block so code that scans directory entries linearly skips over the index. the index is a sorted array of
+// (hash, block) entries, each pointing to the block that holds the names hashing to >= hash. the hash of the first
+// entry is implied to be 0, it's space holds the count and limit of the array instead.
+// with indirect_levels == 1 the root points to index nodes, which point to the leaves. index nodes start with an
+// unused directory entry spanning the whole block, leaves are regular directory blocks.
+// NOTE the blocks in the index are block indexes within the directory, not block numbers on the disk
+const u8 EXT2_DX_HASH_LEGACY = 0;
+const u8 EXT2_DX_HASH_HALF_MD4 = 1;
+const u8 EXT2_DX_HASH_TEA = 2;
+const u8 EXT2_DX_HASH_LEGACY_UNSIGNED = 3;
+const u8 EXT2_DX_HASH_HALF_MD4_UNSIGNED = 4;
+const u8 EXT2_DX_HASH_TEA_UNSIGNED = 5;
+const u8 EXT2_DX_MAX_INDIRECT_LEVELS = 1;
+
+const u64 EXT2_DX_ROOT_INFO_OFFSET = 24; // right after the "." and ".." entries
+const u64 EXT2_DX_ROOT_ENTRIES_OFFSET = 32;
+const u64 EXT2_DX_NODE_ENTRIES_OFFSET = 8; // right after the unused entry
+
+struct __attribute__((__packed__)) DxRootInfo
+{
+    u32 reserved_zero;
+    u8 hash_version; // EXT2_DX_HASH_*, the signed versions are switched to unsigned by EXT2_FLAGS_UNSIGNED_HASH
+    u8 info_length; // always 8
+    u8 indirect_levels;
+    u8 unused_flags;
+};
+static_assert(sizeof(DxRootInfo) == 8, "DxRootInfo must be 8 bytes");
+
+struct __attribute__((__packed__)) DxEntry
+{
+    u32 hash; // the low bit is set if the previous block holds names with the same hash (a hash collision)
+    u32 block;
+};
+static_assert(sizeof(DxEntry) == 8, "DxEntry must be 8 bytes");
+
+// overlaps the hash of the first DxEntry in an index block
+struct __attribute__((__packed__)) DxCountLimit
+{
+    u16 limit;
+    u16 count;
+};
+
 // TODO make WriteBack types like
 // template<typename T>
 // struct WriteBackBlocks
@@ -219,12 +286,23 @@ static_assert(sizeof(DirectoryEntry) == 8, "INode must be 8 bytes");
 //     T *sectors;
 // };
 
+struct BlockRun
+{
+    u32 start = 0;
+    u32 count = 0;
+};
+
 // forward declares
 u32 alloc_block();
+BlockRun alloc_block_run(u32, u32);
+BlockRun prealloc_block_run(u32, u32);
+void take_prealloc_block(u32);
+void release_prealloc_blocks(u32, u32);
 void free_block(u32);
 u32 alloc_inode();
 u64 dir_entry_true_size(u32);
 void writeback_inode_data_blocks(INode *, u8 *, u64, u64);
+void init_inode_cache();
 
 // TODO rename bg to 'group'
 // TODO rename BlockGroupDescriptor to GroupDescriptor
@@ -247,9 +325,62 @@ u32 g_superblock_size_sectors = 0;
 u8 *g_block_bitmaps = 0;
 u8 *g_inode_bitmaps = 0;
 
-// TODO switch this to an array of WriteBack types instead of a flat kmalloc array?
-INode *g_inode_table = 0;
-u32 g_inode_table_blocks_per_group = 0;
+// the block bitmaps with the preallocated blocks (see INodeCacheEntry) also marked as used, allocations search these,
+// while g_block_bitmaps and the free block counts only change when a block is really allocated, since they are what
+// is written to the disk
+u8 *g_block_search_bitmaps = 0;
+u32 *g_prealloc_block_counts = 0; // one per group
+u32 g_prealloc_block_count = 0;
+
+// allocation metadata is only modified in memory, and written back in one batch by writeback_dirty_metadata()
+// at the end of each fs operation
+bool *g_block_bitmap_dirty = 0; // one per group
+bool *g_inode_bitmap_dirty = 0; // one per group
+bool *g_group_desc_block_dirty = 0; // one per block of the group descriptor table
+bool g_superblock_dirty = false;
+
+// per group index of the first bit that might be unset, every bit before it is known to be set, so allocations
+// don't have to rescan the full part of the bitmap
+u32 *g_block_alloc_hint = 0;
+u32 *g_inode_alloc_hint = 0;
+
+// inodes are loaded lazily from the inode tables by get_inode(), see the inode cache below
+const u32 INODE_CACHE_ENTRY_COUNT = 1024;
+const u32 INODE_CACHE_HASH_BUCKET_COUNT = 512; // must be a power of 2
+struct INodeCacheEntry
+{
+    INode inode;
+    u32 inode_num = 0;
+    bool is_valid = false;
+    bool is_dirty = false;
+    u64 last_used_op = 0;
+
+    // blocks that are set aside for the inode, but not given to it yet, so that appending to a file keeps its'
+    // blocks contiguous even if other files are allocating at the same time
+    // NOTE the window is only kept in memory (see g_block_search_bitmaps), a block is only marked as used in the
+    //      block bitmap when the inode takes it
+    u32 prealloc_start = 0;
+    u32 prealloc_count = 0;
+
+    INodeCacheEntry *hash_next = nullptr;
+    INodeCacheEntry *lru_prev = nullptr; // towards the most recently used entry
+    INodeCacheEntry *lru_next = nullptr; // towards the least recently used entry
+};
+struct INodeCache
+{
+    INodeCacheEntry *entries = nullptr;
+    INodeCacheEntry *buckets[INODE_CACHE_HASH_BUCKET_COUNT];
+    INodeCacheEntry *lru_head = nullptr; // most recently used
+    INodeCacheEntry *lru_tail = nullptr; // least recently used
+
+    // incremented by inode_cache_sync(), entries used during the current fs operation can't be evicted since
+    // the caller may still be holding the INode * returned by get_inode()
+    u64 curr_op = 1;
+};
+INodeCache g_inode_cache;
+static_assert(__builtin_offsetof(INodeCacheEntry, inode) == 0, "INode * from get_inode() must be castable to its' cache entry");
+u64 g_inode_cache_hits = 0;
+u64 g_inode_cache_misses = 0;
 
 MBRSector g_mbr;
 MBREntry g_ext2_partition;
@@ -269,28 +400,29 @@ u64 blocknum_to_lba(u32 blocknum)
     return lba;
 }
 // NOTE: block_index is based off start of the partition, not start of the drive
-// TODO these args are backwards compared to read_sectors_pio()
+// NOTE: these go through the block cache, so writes only reach the disk on eviction or block_cache_sync()
+// TODO these args are backwards compared to read_sectors()
 void read_blocks(u8 *buffer, u32 blocknum, u16 block_count)
 {
-    u64 lba = blocknum_to_lba(blocknum);
-    u16 sector_count = block_count * g_block_size_sectors;
-    ASSERT(sector_count > block_count); // TODO check overflow properly with GCC built ins
-    read_sectors_pio(buffer, sector_count, lba);
+    block_cache_read(buffer, blocknum, block_count);
 }
 
-// TODO these args are backwards compared to write_sectors_pio()
+// TODO these args are backwards compared to write_sectors()
 void write_blocks(u8 *buffer, u32 blocknum, u16 block_count)
 {
-    // TODO duplicated code with read_blocks
-    u64 lba = blocknum_to_lba(blocknum);
-    u16 sector_count = block_count * g_block_size_sectors;
-    ASSERT(sector_count > block_count); // TODO check overflow properly with GCC built ins
-    write_sectors_pio(buffer, sector_count, lba);
+    block_cache_write(buffer, blocknum, block_count);
+}
+
+// reads a list of blocks that don't have to be contiguous on the disk or in memory
+// NOTE this sorts ios by block number
+void read_block_list(BlockIO *ios, u64 count)
+{
+    block_cache_read_list(ios, count);
 }
 
 void init_ext2()
 {
-    read_sectors_pio((u8 *)&g_mbr, 1, 0);
+    read_sectors((u8 *)&g_mbr, 1, 0);
     ASSERT(g_mbr.magic_num == MBR_MAGIC_NUM);
     g_ext2_partition = g_mbr.partitions[0];
 
@@ -298,7 +430,7 @@ void init_ext2()
     ASSERT(superblock_size_bytes % 512 == 0);
     g_superblock_size_sectors = superblock_size_bytes / 512;
     g_superblock_start_lba = g_ext2_partition.start_lba + 2; // Superblock starts 1024 bytes (2 sectors) past the start of the partition
-    read_sectors_pio((u8 *)&g_superblock, g_superblock_size_sectors, g_superblock_start_lba);
+    read_sectors((u8 *)&g_superblock, g_superblock_size_sectors, g_superblock_start_lba);
 
     ASSERT(g_superblock.magic_num == EXT2_MAGIC_NUM);
     ASSERT(g_superblock.major_revision == 1); // rest of code is written on the assumption this is ext2 revision 1
@@ -309,6 +441,8 @@ void init_ext2()
     g_block_size_bytes = 1024 << g_superblock.log_block_size;
     g_block_size_sectors = g_block_size_bytes / 512;
     g_superblock_start_block = g_superblock.first_data_block;
+    init_block_cache(g_ext2_partition.start_lba, g_block_size_bytes);
+    init_dentry_cache();
 
     g_group_desc_table_blocknum = g_superblock_start_block + 1; // block group descriptor starts one block after the super block
     g_group_count = round_up_divide(g_superblock.total_block_count, g_superblock.blocks_per_group);
@@ -323,6 +457,21 @@ void init_ext2()
         u32 block_bitmap_blocknum = g_group_desc_table_block[i].block_bitmap;
         read_blocks(curr_block_bitmap, block_bitmap_blocknum, 1);
     }
+    g_block_search_bitmaps = (u8 *)kmalloc(g_block_size_bytes * g_group_count, 4096);
+    memmove_workaround(g_block_search_bitmaps, g_block_bitmaps, g_block_size_bytes * g_group_count);
+    g_prealloc_block_counts = (u32 *)kmalloc(g_group_count * sizeof(u32), alignof(u32));
+    memset_workaround(g_prealloc_block_counts, 0, g_group_count * sizeof(u32));
+
+    g_block_bitmap_dirty = (bool *)kmalloc(g_group_count * sizeof(bool), alignof(bool));
+    g_inode_bitmap_dirty = (bool *)kmalloc(g_group_count * sizeof(bool), alignof(bool));
+    g_group_desc_block_dirty = (bool *)kmalloc(g_group_desc_block_count * sizeof(bool), alignof(bool));
+    memset_workaround(g_block_bitmap_dirty, 0, g_group_count * sizeof(bool));
+    memset_workaround(g_inode_bitmap_dirty, 0, g_group_count * sizeof(bool));
+    memset_workaround(g_group_desc_block_dirty, 0, g_group_desc_block_count * sizeof(bool));
+    g_block_alloc_hint = (u32 *)kmalloc(g_group_count * sizeof(u32), alignof(u32));
+    g_inode_alloc_hint = (u32 *)kmalloc(g_group_count * sizeof(u32), alignof(u32));
+    memset_workaround(g_block_alloc_hint, 0, g_group_count * sizeof(u32));
+    memset_workaround(g_inode_alloc_hint, 0, g_group_count * sizeof(u32));
 
     g_inode_bitmaps = (u8 *)kmalloc(g_block_size_bytes * g_group_count, 4096);
     for(u32 i = 0; i < g_group_count; ++i) {
@@ -331,18 +480,7 @@ void init_ext2()
         read_blocks(curr_inode_bitmap, inode_bitmap_blocknum, 1);
     }
 
-    // TODO inode table uses huge amount of memory, that scales linearly with the number of inodes on the drive
-    //      (which I assume scales linearly with the size of the drive), this large inode table already takes up
-    //      8MB for a 128MB drive, so larger drives cannot be used with this inode caching scheme
-    g_inode_table_blocks_per_group = round_up_divide(g_superblock.inodes_per_group * g_superblock.inode_size, g_block_size_bytes);
-    u32 inode_table_size_bytes = g_inode_table_blocks_per_group * g_group_count * g_block_size_bytes;
-    g_inode_table = (INode *)kmalloc(inode_table_size_bytes, 4096);
-    for(u32 group = 0; group < g_group_count; ++group) {
-        u32 blocknum = g_group_desc_table_block[group].inode_table;
-
-        u8 *ptr = (u8 *)g_inode_table + (group * g_inode_table_blocks_per_group * g_block_size_bytes);
-        read_blocks(ptr, blocknum, g_inode_table_blocks_per_group);
-    }
+    init_inode_cache();
 
     g_block_ptrs_per_indirect_block = g_block_size_bytes / sizeof(u32); // TODO make a typedef for blocknum type
     g_block_ptrs_per_double_indirect_block = g_block_ptrs_per_indirect_block * g_block_ptrs_per_indirect_block;
@@ -373,15 +511,165 @@ GroupAndIndex inode_num_to_group_and_index(u32 inode_num)
     return { group, in_group_index };
 }
 
-INode *get_inode(u32 inode_num)
+u32 inode_table_blocknum(u32 inode_num)
+{
+    auto res = inode_num_to_group_and_index(inode_num);
+    u64 inodes_per_block = g_block_size_bytes / sizeof(INode);
+    return g_group_desc_table_block[res.group].inode_table + res.in_group_index / inodes_per_block;
+}
+
+u32 inode_table_block_offset(u32 inode_num)
 {
     auto res = inode_num_to_group_and_index(inode_num);
-    u32 group = res.group;
-    u32 in_group_index = res.in_group_index;
+    u64 inodes_per_block = g_block_size_bytes / sizeof(INode);
+    return (res.in_group_index % inodes_per_block) * sizeof(INode);
+}
+
+void inode_cache_lru_remove(INodeCacheEntry *entry)
+{
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        g_inode_cache.lru_head = entry->lru_next;
+
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        g_inode_cache.lru_tail = entry->lru_prev;
+
+    entry->lru_prev = nullptr;
+    entry->lru_next = nullptr;
+}
+
+void inode_cache_lru_push_front(INodeCacheEntry *entry)
+{
+    entry->lru_prev = nullptr;
+    entry->lru_next = g_inode_cache.lru_head;
+    if(g_inode_cache.lru_head)
+        g_inode_cache.lru_head->lru_prev = entry;
+    g_inode_cache.lru_head = entry;
+    if(!g_inode_cache.lru_tail)
+        g_inode_cache.lru_tail = entry;
+}
+
+void inode_cache_hash_remove(INodeCacheEntry *entry)
+{
+    INodeCacheEntry **slot = &g_inode_cache.buckets[entry->inode_num & (INODE_CACHE_HASH_BUCKET_COUNT - 1)];
+    while(*slot && *slot != entry)
+        slot = &(*slot)->hash_next;
+    ASSERT(*slot == entry);
+    *slot = entry->hash_next;
+    entry->hash_next = nullptr;
+}
+
+// copies a dirty inode into its' inode table block, the block cache takes care of getting it to the disk
+void inode_cache_writeback_entry(INodeCacheEntry *entry)
+{
+    if(!entry->is_dirty)
+        return;
+
+    u32 blocknum = inode_table_blocknum(entry->inode_num);
+    u8 *block = block_cache_get(blocknum);
+    memmove_workaround(block + inode_table_block_offset(entry->inode_num), &entry->inode, sizeof(INode));
+    block_cache_mark_dirty(blocknum);
+    entry->is_dirty = false;
+}
+
+INodeCacheEntry *inode_cache_lookup(u32 inode_num)
+{
+    INodeCacheEntry *entry = g_inode_cache.buckets[inode_num & (INODE_CACHE_HASH_BUCKET_COUNT - 1)];
+    while(entry && entry->inode_num != inode_num)
+        entry = entry->hash_next;
+    return entry;
+}
+
+INodeCacheEntry *inode_cache_entry(INode *inode)
+{
+    // NOTE inode is the first member, so this is always aligned
+    return (INodeCacheEntry *)((u64)inode - __builtin_offsetof(INodeCacheEntry, inode));
+}
+
+void inode_discard_prealloc(INodeCacheEntry *entry)
+{
+    if(entry->prealloc_count > 0)
+        release_prealloc_blocks(entry->prealloc_start, entry->prealloc_count);
+    entry->prealloc_start = 0;
+    entry->prealloc_count = 0;
+}
+
+// gives unused preallocated blocks back, for when the disk is running out of space
+void inode_cache_discard_all_prealloc()
+{
+    for(u32 i = 0; i < INODE_CACHE_ENTRY_COUNT; ++i)
+        inode_discard_prealloc(&g_inode_cache.entries[i]);
+}
+
+// free blocks that aren't in a preallocation window
+u32 available_block_count()
+{
+    return g_superblock.free_block_count - g_prealloc_block_count;
+}
 
-    INode *group_table = (INode *)((u8 *)g_inode_table + (group * g_inode_table_blocks_per_group * g_block_size_bytes));
-    INode *found_inode = group_table + in_group_index;
-    return found_inode;
+// NOTE the returned pointer stays valid until the end of the current fs operation (the next inode_cache_sync())
+INode *get_inode(u32 inode_num)
+{
+    ASSERT(inode_num != 0);
+    INodeCacheEntry *entry = inode_cache_lookup(inode_num);
+    if(entry) {
+        ++g_inode_cache_hits;
+        inode_cache_lru_remove(entry);
+    } else {
+        ++g_inode_cache_misses;
+
+        // entries are moved to the front whenever they are used, so if the tail was used in the current
+        // operation, every entry was, and there is nothing that can be safely evicted
+        entry = g_inode_cache.lru_tail;
+        ASSERT(entry);
+        ASSERT(entry->last_used_op != g_inode_cache.curr_op);
+        if(entry->is_valid) {
+            inode_discard_prealloc(entry);
+            inode_cache_writeback_entry(entry);
+            inode_cache_hash_remove(entry);
+        }
+        inode_cache_lru_remove(entry);
+
+        u8 *block = block_cache_get(inode_table_blocknum(inode_num));
+        memmove_workaround(&entry->inode, block + inode_table_block_offset(inode_num), sizeof(INode));
+        entry->inode_num = inode_num;
+        entry->is_valid = true;
+        entry->is_dirty = false;
+        u32 bucket = inode_num & (INODE_CACHE_HASH_BUCKET_COUNT - 1);
+        entry->hash_next = g_inode_cache.buckets[bucket];
+        g_inode_cache.buckets[bucket] = entry;
+    }
+
+    entry->last_used_op = g_inode_cache.curr_op;
+    inode_cache_lru_push_front(entry);
+    return &entry->inode;
+}
+
+// called at the end of every fs operation, once nothing is holding on to INode pointers anymore
+void inode_cache_sync()
+{
+    for(u32 i = 0; i < INODE_CACHE_ENTRY_COUNT; ++i) {
+        INodeCacheEntry *entry = &g_inode_cache.entries[i];
+        if(entry->is_valid)
+            inode_cache_writeback_entry(entry);
+    }
+    ++g_inode_cache.curr_op;
+}
+
+void init_inode_cache()
+{
+    g_inode_cache.entries = (INodeCacheEntry *)kmalloc(INODE_CACHE_ENTRY_COUNT * sizeof(INodeCacheEntry), alignof(INodeCacheEntry));
+    for(u32 i = 0; i < INODE_CACHE_HASH_BUCKET_COUNT; ++i)
+        g_inode_cache.buckets[i] = nullptr;
+
+    for(u32 i = 0; i < INODE_CACHE_ENTRY_COUNT; ++i) {
+        INodeCacheEntry *entry = &g_inode_cache.entries[i];
+        *entry = INodeCacheEntry{};
+        inode_cache_lru_push_front(entry);
+    }
 }
 
 u64 inode_size(INode *inode)
@@ -607,11 +895,73 @@ void triple_indirect_blocks_indexes(u64 i, u64& l3_i, u64& l2_i, u64& l1_i)
     l1_i = remainder % g_block_ptrs_per_indirect_block;
 }
 
-inline void ensure_slot(u32& blocknum_slot, u32 *buffer)
+u32 inode_blocknum_at_index(INode *inode, u64 index)
+{
+    if(index < g_direct_index_highest)
+        return inode->blocks[index];
+
+    u64 l3_i, l2_i, l1_i;
+    u32 l1_blocknum;
+    if(index < g_indirect_index_highest) {
+        indirect_blocks_indexes(index, l1_i);
+        l1_blocknum = inode->indirect_block;
+    } else if(index < g_double_indirect_index_highest) {
+        double_indirect_blocks_indexes(index, l2_i, l1_i);
+        l1_blocknum = ((u32 *)block_cache_get(inode->double_indirect_block))[l2_i];
+    } else {
+        triple_indirect_blocks_indexes(index, l3_i, l2_i, l1_i);
+        u32 l2_blocknum = ((u32 *)block_cache_get(inode->triple_indirect_block))[l3_i];
+        l1_blocknum = ((u32 *)block_cache_get(l2_blocknum))[l2_i];
+    }
+    return ((u32 *)block_cache_get(l1_blocknum))[l1_i];
+}
+
+const u32 EXT2_PREALLOC_BLOCK_COUNT = 16;
+
+// hands out blocks for one __inode_ensure_blocks_impl() call, each block is placed right after the previous one
+// when possible, so files (including their indirect blocks) end up as a few long contiguous runs
+struct INodeBlockAllocation
+{
+    INodeCacheEntry *entry = nullptr;
+    u32 goal = 0; // the block right after the one that was allocated last
+    u64 remaining = 0; // blocks the caller still needs, used to size the run that is allocated
+};
+
+u32 inode_alloc_block(INodeBlockAllocation& alloc)
+{
+    INodeCacheEntry *entry = alloc.entry;
+    if(entry->prealloc_count > 0 && entry->prealloc_start != alloc.goal)
+        inode_discard_prealloc(entry); // the window isn't contiguous with the file anymore, so it's no use
+
+    if(entry->prealloc_count == 0) {
+        u64 want = max(alloc.remaining, (u64)1);
+        if(entry->inode.mode & EXT2_INODE_TYPE_REG_FILE)
+            want = max(want, (u64)EXT2_PREALLOC_BLOCK_COUNT); // only regular files are expected to keep growing
+        want = min(want, (u64)g_superblock.blocks_per_group);
+
+        BlockRun run = prealloc_block_run(alloc.goal, want);
+        entry->prealloc_start = run.start;
+        entry->prealloc_count = run.count;
+    }
+
+    u32 blocknum = entry->prealloc_start;
+    take_prealloc_block(blocknum);
+    entry->prealloc_start++;
+    entry->prealloc_count--;
+    if(entry->prealloc_count == 0)
+        entry->prealloc_start = 0;
+
+    alloc.goal = blocknum + 1;
+    if(alloc.remaining > 0)
+        alloc.remaining--;
+    return blocknum;
+}
+
+inline void ensure_slot(u32& blocknum_slot, u32 *buffer, INodeBlockAllocation& alloc)
 {
     if(blocknum_slot == 0) {
         memset_workaround(buffer, 0, g_block_size_bytes);
-        blocknum_slot = alloc_block();
+        blocknum_slot = inode_alloc_block(alloc);
     } else {
         read_blocks((u8 *)buffer, blocknum_slot, 1);
     }
@@ -621,10 +971,21 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
     u64 i = block_index;
     u64 end = i + blockcount;
 
+    // new blocks go right after the last block of the file, or at the start of the inode's group for empty files
+    INodeBlockAllocation alloc;
+    alloc.entry = inode_cache_entry(inode);
+    alloc.remaining = blockcount;
+    if(block_index > 0) {
+        alloc.goal = inode_blocknum_at_index(inode, block_index - 1) + 1;
+    } else {
+        auto res = inode_num_to_group_and_index(alloc.entry->inode_num);
+        alloc.goal = res.group * g_superblock.blocks_per_group;
+    }
+
 // ----------------------------------------------------------------------------
 
     for(; i < end && i < EXT2_INODE_DIRECT_BLOCK_COUNT; ++i) {
-        inode->blocks[i] = alloc_block();
+        inode->blocks[i] = inode_alloc_block(alloc);
     }
     if(i >= end)
         return;
@@ -640,7 +1001,7 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
 
     l1_buffer = (u32 *)kmalloc(blocksize, 4096);
     l1_blocknum = inode->indirect_block;
-    ensure_slot(l1_blocknum, l1_buffer);
+    ensure_slot(l1_blocknum, l1_buffer, alloc);
     inode->indirect_block = l1_blocknum;
 
     indirect_blocks_indexes(i, l1_i);
@@ -648,7 +1009,7 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
         i < end && i < g_indirect_index_highest && l1_i < ptrcount;
         ++l1_i)
     {
-        l1_buffer[l1_i] = alloc_block();
+        l1_buffer[l1_i] = inode_alloc_block(alloc);
         ++i;
     }
 
@@ -660,7 +1021,7 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
 
     l2_buffer = (u32 *)kmalloc(blocksize, 4096);
     l2_blocknum = inode->double_indirect_block;
-    ensure_slot(l2_blocknum, l2_buffer);
+    ensure_slot(l2_blocknum, l2_buffer, alloc);
     inode->double_indirect_block = l2_blocknum;
 
     double_indirect_blocks_indexes(i, l2_i, l1_i);
@@ -668,17 +1029,18 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
         i < end && i < g_double_indirect_index_highest && l2_i < ptrcount;
         ++l2_i)
     {
-        ensure_slot(l2_buffer[l2_i], l1_buffer);
+        ensure_slot(l2_buffer[l2_i], l1_buffer, alloc);
 
         for(;
             i < end && i < g_double_indirect_index_highest && l1_i < ptrcount;
             ++l1_i)
         {
-            l1_buffer[l1_i] = alloc_block();
+            l1_buffer[l1_i] = inode_alloc_block(alloc);
             ++i;
         }
 
         write_blocks((u8 *)l1_buffer, l2_buffer[l2_i], 1);
+        l1_i = 0;
     }
 
     write_blocks((u8 *)l2_buffer, inode->double_indirect_block, 1);
@@ -689,7 +1051,7 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
 
     l3_buffer = (u32 *)kmalloc(blocksize, 4096);
     l3_blocknum = inode->triple_indirect_block;
-    ensure_slot(l3_blocknum, l3_buffer);
+    ensure_slot(l3_blocknum, l3_buffer, alloc);
     inode->triple_indirect_block = l3_blocknum;
 
     triple_indirect_blocks_indexes(i, l3_i, l2_i, l1_i);
@@ -697,26 +1059,28 @@ void __inode_ensure_blocks_impl(INode *inode, u64 block_index, u64 blockcount)
         i < end && i < g_triple_indirect_index_highest && l3_i < ptrcount;
         ++l3_i)
     {
-        ensure_slot(l3_buffer[l3_i], l2_buffer);
+        ensure_slot(l3_buffer[l3_i], l2_buffer, alloc);
 
         for(;
             i < end && i < g_triple_indirect_index_highest && l2_i < ptrcount;
             ++l2_i)
         {
-            ensure_slot(l2_buffer[l2_i], l1_buffer);
+            ensure_slot(l2_buffer[l2_i], l1_buffer, alloc);
 
             for(;
                 i < end && i < g_triple_indirect_index_highest && l1_i < ptrcount;
                 ++l1_i)
             {
-                l1_buffer[l1_i] = alloc_block();
+                l1_buffer[l1_i] = inode_alloc_block(alloc);
                 ++i;
             }
 
             write_blocks((u8 *)l1_buffer, l2_buffer[l2_i], 1);
+            l1_i = 0;
         }
 
         write_blocks((u8 *)l2_buffer, l3_buffer[l3_i], 1);
+        l2_i = 0;
     }
 
     write_blocks((u8 *)l3_buffer, inode->triple_indirect_block, 1);
@@ -806,6 +1170,7 @@ void __inode_discard_blocks_from_end_impl(INode *inode, u64 block_index, u64 blo
         }
 
         free_if_zero(l1_buffer, l2_buffer[l2_i]);
+        l1_i = 0;
     }
 
     free_if_zero(l2_buffer, l2_blocknum);
@@ -845,9 +1210,11 @@ void __inode_discard_blocks_from_end_impl(INode *inode, u64 block_index, u64 blo
             }
 
             free_if_zero(l1_buffer, l2_buffer[l2_i]);
+            l1_i = 0;
         }
 
         free_if_zero(l2_buffer, l3_buffer[l3_i]);
+        l2_i = 0;
     }
 
     free_if_zero(l3_buffer, l3_blocknum);
@@ -888,6 +1255,7 @@ u32 inode_next_block(INode *inode)
 
 void __inode_discard_blocks_from_end(INode *inode, u64 discard_count)
 {
+    inode_discard_prealloc(inode_cache_entry(inode));
     u32 reserved = inode_reserved_blocks(inode);
     ASSERT(discard_count <= reserved);
     u32 start_index = reserved - discard_count;
@@ -897,6 +1265,8 @@ void __inode_discard_blocks_from_end(INode *inode, u64 discard_count)
     inode->reserved_512_blocks -= g_block_size_sectors * discard_count;
 }
 
+// the block numbers are collected first and then read with block_cache_read_list(), so runs of contiguous
+// blocks are read from the disk with a single command
 void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64 block_index)
 {
     u32 lastblock = block_index + blockcount;
@@ -904,6 +1274,9 @@ void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64
     u32 used_blocks = inode_used_blocks(inode);
     ASSERT(lastblock <= used_blocks);
 
+    BlockIO *ios = (BlockIO *)kmalloc(blockcount * sizeof(BlockIO), alignof(BlockIO));
+    u64 io_count = 0;
+
     u8 *ptr = block_buffer;
     u8 *end = ptr + g_block_size_bytes * blockcount;
     u64 i = block_index;
@@ -912,11 +1285,14 @@ void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64
         ++i)
     {
         u32 blocknum = inode->blocks[i];
-        read_blocks(ptr, blocknum, 1);
+        ios[io_count++] = {blocknum, ptr};
         ptr += g_block_size_bytes;
     }
-    if(ptr >= end)
+    if(ptr >= end) {
+        read_block_list(ios, io_count);
+        kfree((vaddr)ios);
         return;
+    }
 
 // ----------------------------------------------------------------------------
     u32 *l3_buffer, *l2_buffer, *l1_buffer;
@@ -934,7 +1310,7 @@ void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64
         ++l1_i)
     {
         u32 blocknum = l1_buffer[l1_i];
-        read_blocks(ptr, blocknum, 1);
+        ios[io_count++] = {blocknum, ptr};
         ptr += blocksize;
         ++i;
     }
@@ -958,10 +1334,11 @@ void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64
             ++l1_i)
         {
             u32 blocknum = l1_buffer[l1_i];
-            read_blocks(ptr, blocknum, 1);
+            ios[io_count++] = {blocknum, ptr};
             ptr += blocksize;
             ++i;
         }
+        l1_i = 0;
     }
     if(ptr >= end)
         goto free_l2;
@@ -990,11 +1367,13 @@ void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64
                 ++l1_i)
             {
                 u32 blocknum = l1_buffer[l1_i];
-                read_blocks(ptr, blocknum, 1);
+                ios[io_count++] = {blocknum, ptr};
                 ptr += blocksize;
                 ++i;
             }
+            l1_i = 0;
         }
+        l2_i = 0;
     }
 // ----------------------------------------------------------------------------
 
@@ -1004,6 +1383,9 @@ void inode_read_data_blocks(INode *inode, u8 *block_buffer, u64 blockcount, u64
     free_l1:
     kfree((vaddr)l1_buffer);
 // ----------------------------------------------------------------------------
+    ASSERT(io_count == blockcount);
+    read_block_list(ios, io_count);
+    kfree((vaddr)ios);
 }
 
 void __inode_init_dir(INode *inode, u32 inode_num, u32 parent_inode_num)
@@ -1060,33 +1442,28 @@ bool dir_entry_name_match(DirectoryEntry *entry, const char *name, u64 name_len)
 }
 // ---------------------------------------------------------------------------------------------------------
 
-// NOTE this is based on the assumption that an empty directory contains '.' and '..' entries, and nothing else.
-//      this assumption holds up in practice, but I haven't confirmed if it is guaranteed in all cases
+// a directory is empty if it has no entries other than "." and "..", but it may still have more than one block,
+// e.g. an indexed directory keeps its' (empty) leaves
 bool is_dir_empty(INode *dir)
 {
     ASSERT(dir->mode & EXT2_INODE_TYPE_DIR);
-    if(inode_used_blocks(dir) != 1)
-        return false;
-
     u32 blockcount = inode_used_blocks(dir);
     u64 block_buffer_size = blockcount * g_block_size_bytes;
-    u8 *block_buffer = (u8 *)kmalloc(blockcount * g_block_size_bytes, 4096);
+    u8 *block_buffer = (u8 *)kmalloc(block_buffer_size, 4096);
     inode_read_data_blocks(dir, block_buffer, blockcount, 0);
 
+    bool is_empty = true;
     u8 *ptr = block_buffer;
-    u8 *block_buffer_end = ptr + block_buffer_size;
-
-    auto entry = (DirectoryEntry *)ptr;
-    if(!dir_entry_name_match(entry, ".", 1, true))
-        return false;
-
-    ptr += entry->length;
-    entry = (DirectoryEntry *)ptr;
-    if(!dir_entry_name_match(entry, "..", 2, true))
-        return false;
+    while(is_empty && ptr < block_buffer + block_buffer_size) {
+        auto entry = (DirectoryEntry *)ptr;
+        bool is_dot_entry = dir_entry_name_match(entry, ".", 1, true) || dir_entry_name_match(entry, "..", 2, true);
+        if(entry->inode_num != 0 && !is_dot_entry)
+            is_empty = false;
+        ptr += entry->length;
+    }
 
-    ptr += entry->length;
-    return ptr == block_buffer_end;
+    kfree((vaddr)block_buffer);
+    return is_empty;
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -1104,22 +1481,51 @@ void writeback_block_bitmap(u32 group_i)
     write_blocks(block_buffer, blocknum, 1);
 }
 
-// TODO the group descriptor table in memory spans several blocks
-//      this writes back all blocks instead of just the modified block (or sector)
-void writeback_group_desc([[maybe_unused]] u32 group_i)
+void writeback_group_desc_block(u32 desc_block_i)
 {
-    u8 *block_buffer = (u8 *)g_group_desc_table_block;
-    write_blocks(block_buffer, g_group_desc_table_blocknum, g_group_desc_block_count);
+    u8 *block_buffer = (u8 *)g_group_desc_table_block + desc_block_i * g_block_size_bytes;
+    write_blocks(block_buffer, g_group_desc_table_blocknum + desc_block_i, 1);
 }
 
+// NOTE the superblock is written directly, the block containing it never goes through read_blocks() so it can't be stale in the block cache
 void writeback_superblock()
 {
     u8 *ptr = (u8 *)&g_superblock;
-    write_sectors_pio(ptr, g_superblock_size_sectors, g_superblock_start_lba);
+    write_sectors(ptr, g_superblock_size_sectors, g_superblock_start_lba);
+}
+
+void mark_group_desc_dirty(u32 group_i)
+{
+    u32 desc_per_block = g_block_size_bytes / sizeof(BlockGroupDescriptor);
+    g_group_desc_block_dirty[group_i / desc_per_block] = true;
+}
+
+void writeback_dirty_metadata()
+{
+    for(u32 i = 0; i < g_group_count; ++i) {
+        if(g_block_bitmap_dirty[i]) {
+            writeback_block_bitmap(i);
+            g_block_bitmap_dirty[i] = false;
+        }
+        if(g_inode_bitmap_dirty[i]) {
+            writeback_inode_bitmap(i);
+            g_inode_bitmap_dirty[i] = false;
+        }
+    }
+    for(u32 i = 0; i < g_group_desc_block_count; ++i) {
+        if(g_group_desc_block_dirty[i]) {
+            writeback_group_desc_block(i);
+            g_group_desc_block_dirty[i] = false;
+        }
+    }
+    if(g_superblock_dirty) {
+        writeback_superblock();
+        g_superblock_dirty = false;
+    }
 }
 
-// TODO performance can be improved by sorting the written blocknums before writing to see if 
-//      any of them are contiguous
+// NOTE the blocks only go to the block cache here, block_cache_sync() sorts the dirty blocks and writes
+//      contiguous runs to the disk with a single command
 void writeback_inode_data_blocks(INode *inode, u8 *buffer, u64 block_index, u64 blockcount)
 {
     u32 lastblock = block_index + blockcount;
@@ -1180,6 +1586,7 @@ void writeback_inode_data_blocks(INode *inode, u8 *buffer, u64 block_index, u64
             ptr += blocksize;
             ++i;
         }
+        l1_i = 0;
     }
     if(ptr >= end)
         goto free_l2;
@@ -1209,7 +1616,9 @@ void writeback_inode_data_blocks(INode *inode, u8 *buffer, u64 block_index, u64
                 ptr += blocksize;
                 ++i;
             }
+            l1_i = 0;
         }
+        l2_i = 0;
     }
 // ----------------------------------------------------------------------------
 
@@ -1220,61 +1629,113 @@ void writeback_inode_data_blocks(INode *inode, u8 *buffer, u64 block_index, u64
     kfree((vaddr)l1_buffer);
 }
 
+// NOTE this only marks the inode dirty, so several updates to the same inode in one fs operation are only
+//      copied into the inode table once, by inode_cache_sync()
 void writeback_inode(u32 inode_num)
 {
-    auto res = inode_num_to_group_and_index(inode_num);
-    u32 group = res.group;
-    u32 in_group_index = res.in_group_index;
-
-    u32 group_block = g_group_desc_table_block[group].inode_table;
-    u64 group_lba = blocknum_to_lba(group_block);
-    u64 inodes_per_sector = 512 / sizeof(INode);
-    u64 lba = group_lba + in_group_index / inodes_per_sector;
-
-    u8 *sector = ((u8 *)g_inode_table) + group * g_inode_table_blocks_per_group * g_block_size_bytes + (in_group_index / inodes_per_sector) * 512;
-    write_sectors_pio(sector, 1, lba);
+    INodeCacheEntry *entry = inode_cache_lookup(inode_num);
+    ASSERT(entry); // the inode must have been modified through get_inode() in the current operation
+    entry->is_dirty = true;
 }
 // ---------------------------------------------------------------------------------------------------------
 // TODO make alloc_block and free_block count based?
 
+// NOTE bitmaps are scanned a u64 word at a time, the kernel is built without SSE so wider vector scans aren't an option
+typedef u64 __attribute__((__may_alias__, __aligned__(1))) BitmapWord;
+
+bool bitmap_test(u8 *bitmap, u64 index)
+{
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+// returns the index of the first bit in [start, bitcount) that is set (or unset if want_set is false),
+// or bitcount if there isn't one
+u64 bitmap_find_bit(u8 *bitmap, u64 bitcount, u64 start, bool want_set)
+{
+    u64 invert = want_set ? 0 : ~0ull;
+    u64 i = start;
+
+    // partial first word
+    u64 word_i = i / 64;
+    if(i % 64 && (word_i + 1) * 64 <= bitcount) {
+        u64 word = (((BitmapWord *)bitmap)[word_i] ^ invert) & (~0ull << (i % 64));
+        if(word)
+            return word_i * 64 + __builtin_ctzll(word);
+        i = (word_i + 1) * 64;
+    }
+
+    for(; i + 64 <= bitcount; i += 64) {
+        u64 word = ((BitmapWord *)bitmap)[i / 64] ^ invert;
+        if(word)
+            return i + __builtin_ctzll(word);
+    }
+
+    // NOTE this is also reached for the whole bitmap if it is smaller than one word
+    for(; i < bitcount; ++i) {
+        if(bitmap_test(bitmap, i) == want_set)
+            return i;
+    }
+    return bitcount;
+}
+
+struct BitmapFindResult
+{
+    bool found = false;
+    u64 index = 0;
+};
+// finds the first run of run_length unset bits that starts at or after start
+BitmapFindResult bitmap_find_zero_run(u8 *bitmap, u64 bitcount, u64 start, u64 run_length)
+{
+    ASSERT(run_length > 0);
+    u64 i = start;
+    while(i < bitcount) {
+        u64 run_start = bitmap_find_bit(bitmap, bitcount, i, false);
+        if(run_start + run_length > bitcount)
+            return {};
+
+        // only look as far as the run needs to go
+        u64 run_end = bitmap_find_bit(bitmap, run_start + run_length, run_start, true);
+        if(run_end == run_start + run_length)
+            return {true, run_start};
+
+        i = run_end + 1; // run_end is a set bit, so no run can include it
+    }
+    return {};
+}
+
+void bitmap_set_range(u8 *bitmap, u64 start, u64 count)
+{
+    for(u64 i = start; i < start + count; ++i) {
+        u8 *byte = bitmap + i / 8;
+        ASSERT((*byte & (1 << (i % 8))) == 0);
+        *byte |= (1 << (i % 8));
+    }
+}
+
+void bitmap_unset(u8 *bitmap, u64 index)
+{
+    u64 byte_i = index / 8;
+    u64 bit_i = index % 8;
+    
+    u8 *byte = bitmap + byte_i;
+    ASSERT(*byte & (1 << bit_i));
+    *byte &= ~(1 << bit_i);
+}
+
 struct BitmapFindZeroResult
 {
     bool found_zero = false;
     u64 byte_i;
     u64 bit_i;
 };
-// TODO scan as u64 or higher for performance
-BitmapFindZeroResult bitmap_find_zero_and_set(u8 *bitmap, u64 bitcount)
+BitmapFindZeroResult bitmap_find_zero_and_set(u8 *bitmap, u64 bitcount, u64 start = 0)
 {
-    bool found_zero = false;
-    u8 *ptr = bitmap;
-    u64 bytecount = bitcount / 8; // NOTE this ignores the last byte if bitcount is not a multiple of 8
-    u64 bits_overflow = bitcount % 8;
-    u64 byte_i = 0;
-    u64 bit_i = 0;
-    for(; byte_i < bytecount; ++byte_i) {
-        u8 byte = ~(ptr[byte_i]);
-        if(byte) {
-            found_zero = true;
-            bit_i = __builtin_ffs(byte) -1;
-            break;
-        }
-    }
-
-    if(!found_zero && bits_overflow) {
-        u8 byte = ~(ptr[byte_i]);
-        bit_i = __builtin_ffs(byte);
-        if(bit_i == 0 || bit_i > bits_overflow)
-            return {false, 0, 0};
-        else
-            bit_i--;
-    }
-
-    u8 *byte = ptr + byte_i;
-    ASSERT((*byte & (1 << bit_i)) == 0);
-    *byte |= (1 << bit_i);
+    auto res = bitmap_find_zero_run(bitmap, bitcount, start, 1);
+    if(!res.found)
+        return {false, 0, 0};
 
-    return {true, byte_i, bit_i};
+    bitmap_set_range(bitmap, res.index, 1);
+    return {true, res.index / 8, res.index % 8};
 }
 
 u32 alloc_inode()
@@ -1288,7 +1749,7 @@ u32 alloc_inode()
             continue;
 
         u8 *ptr = base_ptr + group_i * g_block_size_bytes;
-        res = bitmap_find_zero_and_set(ptr, g_superblock.inodes_per_group);
+        res = bitmap_find_zero_and_set(ptr, g_superblock.inodes_per_group, g_inode_alloc_hint[group_i]);
 
         if(res.found_zero)
             break;
@@ -1298,6 +1759,7 @@ u32 alloc_inode()
     u64 byte_i = res.byte_i;
     u64 bit_i = res.bit_i;
 
+    g_inode_alloc_hint[group_i] = byte_i * 8 + bit_i + 1;
     u32 inode_index = group_i * g_superblock.inodes_per_group + byte_i * 8 + bit_i;
     u32 inode_num = inode_index + 1;
 
@@ -1308,65 +1770,139 @@ u32 alloc_inode()
     //      inode bitmap
     //      group descriptor
     //      superblock
-    writeback_inode_bitmap(group_i);
-    writeback_group_desc(group_i);
-    writeback_superblock();
+    g_inode_bitmap_dirty[group_i] = true;
+    mark_group_desc_dirty(group_i);
+    g_superblock_dirty = true;
 
     return inode_num;
 }
 
-u32 alloc_block()
+// sets the blocks aside in the search bitmap only, see take_prealloc_block()
+void __mark_blocks_preallocated(u32 group_i, u32 in_group_index, u32 count)
 {
-    u8 *base_ptr = g_block_bitmaps;
+    u8 *bitmap = g_block_search_bitmaps + group_i * g_block_size_bytes;
+    bitmap_set_range(bitmap, in_group_index, count);
+    if(g_block_alloc_hint[group_i] == in_group_index)
+        g_block_alloc_hint[group_i] = in_group_index + count;
 
-    u64 group_i = 0;
-    BitmapFindZeroResult res = {};
-    for(group_i = 0; group_i < g_group_count; ++group_i) {
-        if(g_group_desc_table_block[group_i].free_block_count == 0)
+    ASSERT(g_group_desc_table_block[group_i].free_block_count - g_prealloc_block_counts[group_i] >= count);
+    g_prealloc_block_counts[group_i] += count;
+    g_prealloc_block_count += count;
+}
+
+// marks preallocated blocks as used in the block bitmap that is written to the disk
+void __mark_blocks_used(u32 group_i, u32 in_group_index, u32 count)
+{
+    u8 *bitmap = g_block_bitmaps + group_i * g_block_size_bytes;
+    bitmap_set_range(bitmap, in_group_index, count);
+
+    ASSERT(g_prealloc_block_counts[group_i] >= count);
+    g_prealloc_block_counts[group_i] -= count;
+    g_prealloc_block_count -= count;
+    ASSERT(g_group_desc_table_block[group_i].free_block_count >= count);
+    g_group_desc_table_block[group_i].free_block_count -= count;
+    g_superblock.free_block_count -= count;
+
+    // modified:
+    //      block bitmap
+    //      group descriptor
+    //      superblock
+    g_block_bitmap_dirty[group_i] = true;
+    mark_group_desc_dirty(group_i);
+    g_superblock_dirty = true;
+}
+
+// sets aside a run of up to max_count contiguous blocks, as close to goal as possible, the blocks are only marked as
+// used when they are taken with take_prealloc_block(), or given back with release_prealloc_blocks()
+// NOTE tries, in order: a full run at or after goal in goal's group, a full run anywhere else (starting with
+//      the groups after goal's group), and then however many contiguous blocks follow the first free block
+BlockRun prealloc_block_run(u32 goal, u32 max_count)
+{
+    ASSERT(max_count > 0 && max_count <= g_superblock.blocks_per_group);
+    u32 bits_per_group = g_superblock.blocks_per_group;
+    if(goal >= g_superblock.total_block_count)
+        goal = 0;
+    u32 goal_group = goal / bits_per_group;
+    u32 goal_index = goal % bits_per_group;
+
+    for(u32 k = 0; k <= g_group_count; ++k) {
+        // the goal group is checked twice, first from the goal, and at the end from the start of the group
+        u32 group_i = (goal_group + k) % g_group_count;
+        if(g_group_desc_table_block[group_i].free_block_count - g_prealloc_block_counts[group_i] < max_count)
             continue;
 
-        u8 *ptr = base_ptr + group_i * g_block_size_bytes;
-        res = bitmap_find_zero_and_set(ptr, g_superblock.blocks_per_group);
+        u32 start = g_block_alloc_hint[group_i];
+        if(k == 0)
+            start = max(start, goal_index);
 
-        if(res.found_zero)
-            break;
+        u8 *bitmap = g_block_search_bitmaps + group_i * g_block_size_bytes;
+        auto res = bitmap_find_zero_run(bitmap, bits_per_group, start, max_count);
+        if(res.found) {
+            __mark_blocks_preallocated(group_i, res.index, max_count);
+            return {group_i * bits_per_group + (u32)res.index, max_count};
+        }
     }
-    ASSERT(res.found_zero);
 
-    u64 byte_i = res.byte_i;
-    u64 bit_i = res.bit_i;
+    // no full run anywhere, so take a shorter one
+    for(u32 k = 0; k < g_group_count; ++k) {
+        u32 group_i = (goal_group + k) % g_group_count;
+        if(g_group_desc_table_block[group_i].free_block_count == g_prealloc_block_counts[group_i])
+            continue;
 
-    u32 blocknum = group_i * g_superblock.blocks_per_group + byte_i * 8 + bit_i;
+        u8 *bitmap = g_block_search_bitmaps + group_i * g_block_size_bytes;
+        u64 run_start = bitmap_find_bit(bitmap, bits_per_group, g_block_alloc_hint[group_i], false);
+        if(run_start == bits_per_group)
+            continue;
+        u64 run_end = bitmap_find_bit(bitmap, min((u64)bits_per_group, run_start + max_count), run_start, true);
 
-    g_group_desc_table_block[group_i].free_block_count--;
-    g_superblock.free_block_count--;
+        u32 count = run_end - run_start;
+        __mark_blocks_preallocated(group_i, run_start, count);
+        return {group_i * bits_per_group + (u32)run_start, count};
+    }
 
-    // modified:
-    //      block bitmap
-    //      group descriptor
-    //      superblock
-    writeback_block_bitmap(group_i);
-    writeback_group_desc(group_i);
-    writeback_superblock();
+    UNREACHABLE(); // callers check the free block count before allocating
+    return {};
+}
 
-    return blocknum;
+void take_prealloc_block(u32 blocknum)
+{
+    __mark_blocks_used(blocknum / g_superblock.blocks_per_group, blocknum % g_superblock.blocks_per_group, 1);
 }
 
-void bitmap_unset(u8 *bitmap, u64 index)
+void release_prealloc_blocks(u32 start, u32 count)
 {
-    u64 byte_i = index / 8;
-    u64 bit_i = index % 8;
-    
-    u8 *byte = bitmap + byte_i;
-    ASSERT(*byte & (1 << bit_i));
-    *byte &= ~(1 << bit_i);
+    u32 group_i = start / g_superblock.blocks_per_group;
+    u32 in_group_index = start % g_superblock.blocks_per_group;
+    u8 *bitmap = g_block_search_bitmaps + group_i * g_block_size_bytes;
+    for(u32 i = 0; i < count; ++i)
+        bitmap_unset(bitmap, in_group_index + i);
+    g_block_alloc_hint[group_i] = min(g_block_alloc_hint[group_i], in_group_index);
+
+    ASSERT(g_prealloc_block_counts[group_i] >= count);
+    g_prealloc_block_counts[group_i] -= count;
+    g_prealloc_block_count -= count;
+}
+
+// allocates a run of up to max_count contiguous blocks, see prealloc_block_run()
+BlockRun alloc_block_run(u32 goal, u32 max_count)
+{
+    BlockRun run = prealloc_block_run(goal, max_count);
+    __mark_blocks_used(run.start / g_superblock.blocks_per_group, run.start % g_superblock.blocks_per_group, run.count);
+    return run;
+}
+
+u32 alloc_block()
+{
+    return alloc_block_run(0, 1).start;
 }
 
 void free_block(u32 blocknum)
 {
     u32 group_i = blocknum / g_superblock.blocks_per_group;
-    u8 *bitmap = g_block_bitmaps + group_i * g_block_size_bytes;
-    bitmap_unset(bitmap, blocknum);
+    u32 in_group_index = blocknum % g_superblock.blocks_per_group;
+    bitmap_unset(g_block_bitmaps + group_i * g_block_size_bytes, in_group_index);
+    bitmap_unset(g_block_search_bitmaps + group_i * g_block_size_bytes, in_group_index);
+    g_block_alloc_hint[group_i] = min(g_block_alloc_hint[group_i], in_group_index);
 
     g_group_desc_table_block[group_i].free_block_count++;
     g_superblock.free_block_count++;
@@ -1375,9 +1911,9 @@ void free_block(u32 blocknum)
     //      block bitmap
     //      group descriptor
     //      superblock
-    writeback_block_bitmap(group_i);
-    writeback_group_desc(group_i);
-    writeback_superblock();
+    g_block_bitmap_dirty[group_i] = true;
+    mark_group_desc_dirty(group_i);
+    g_superblock_dirty = true;
 }
 
 void __free_inode(u32 inode_num)
@@ -1386,7 +1922,9 @@ void __free_inode(u32 inode_num)
     
     u32 group_i = inode_index / g_superblock.inodes_per_group;
     u8 *bitmap = g_inode_bitmaps + group_i * g_block_size_bytes;
-    bitmap_unset(bitmap, inode_index);
+    u32 in_group_index = inode_index % g_superblock.inodes_per_group;
+    bitmap_unset(bitmap, in_group_index);
+    g_inode_alloc_hint[group_i] = min(g_inode_alloc_hint[group_i], in_group_index);
 
     g_group_desc_table_block[group_i].free_inode_count++;
     g_superblock.free_inode_count++;
@@ -1395,45 +1933,787 @@ void __free_inode(u32 inode_num)
     //      inode bitmap
     //      group descriptor
     //      superblock
-    writeback_inode_bitmap(group_i);
-    writeback_group_desc(group_i);
-    writeback_superblock();
+    g_inode_bitmap_dirty[group_i] = true;
+    mark_group_desc_dirty(group_i);
+    g_superblock_dirty = true;
 }
 // ---------------------------------------------------------------------------------------------------------
 
-struct PathLookupResult
+// called at the end of every fs operation, metadata and inodes go into the block cache first, then the block cache goes to the disk
+void fs_sync()
 {
-    bool found_inode = false;
-    u32 inode_num = 0;
-};
+    writeback_dirty_metadata();
+    inode_cache_sync();
+    block_cache_sync();
+}
+// ---------------------------------------------------------------------------------------------------------
 
-// TODO implement a hash table lookup that caches path -> inode mappings
-// TODO this currently goes through the whole loop even for redundant parts of the
-//      path (e.g. a/b/././././c or a/b/,,/c), these redundant iterations can be
-//      skipped by normalizing the path string first
-PathLookupResult lookup_path(const char *path, u64 path_len)
+// ---------------------------------------------------------------------------------------------------------
+// directory entries, these work on both indexed and unindexed directories
+
+// a copy of one directory block, for operations that modify several blocks of a directory together
+u8 *dir_read_block(INode *dir, u32 block_index)
 {
-    ASSERT(path);
-    ASSERT(*path);
-    bool is_abs_path = *path == '/';
+    u8 *block = (u8 *)kmalloc(g_block_size_bytes, 4096);
+    read_blocks(block, inode_blocknum_at_index(dir, block_index), 1);
+    return block;
+}
 
-    const char *part_start = path;
-    for(; *part_start && *part_start == '/'; ++part_start) {} // skip redundant '/' in paths, e.g. /a///b
-    const char *part_end = part_start +1;
+void dir_write_block(INode *dir, u32 block_index, u8 *block)
+{
+    write_blocks(block, inode_blocknum_at_index(dir, block_index), 1);
+}
 
-    u32 curr_inode_num = 0;
-    if(is_abs_path)
-        curr_inode_num = EXT2_ROOT_DIR_INODE;
-    else
-        UNREACHABLE(); // relative paths should be handled before fs functions are called
+// returns the index of the new block
+u32 dir_append_block(INode *dir, u32 dir_inode_num)
+{
+    __inode_ensure_blocks(dir, 1);
+    u32 block_index = inode_used_blocks(dir);
+    __inode_set_size(dir, inode_size(dir) + g_block_size_bytes);
+    writeback_inode(dir_inode_num);
+    return block_index;
+}
 
-    const char *str_end = path + path_len;
-    while(*part_start && part_start != str_end) {
-        INode *curr_dir = get_inode(curr_inode_num);
-        u32 blockcount = inode_used_blocks(curr_dir);
-        u8 *block_buffer = (u8 *)kmalloc(blockcount * g_block_size_bytes, 4096);
-        inode_read_data_blocks(curr_dir, block_buffer, blockcount, 0);
+// returns the offset of the entry called name in the block, or -1 if it isn't there
+// NOTE if is_dir is true, the entry must be a directory
+s64 dir_block_find_entry(u8 *block, const char *name, u64 name_len, bool is_dir = false)
+{
+    u64 offset = 0;
+    while(offset < g_block_size_bytes) {
+        auto entry = (DirectoryEntry *)(block + offset);
+        ASSERT(entry->length > 0);
+        if(entry->inode_num != 0 && dir_entry_name_match(entry, name, name_len, is_dir))
+            return offset;
+        offset += entry->length;
+    }
+    return -1;
+}
+
+// returns false if the block doesn't have enough free space for the entry
+bool dir_block_add_entry(u8 *block, const char *name, u64 name_len, u32 inode_num, u8 file_type)
+{
+    u64 needed = dir_entry_true_size(name_len);
+    u64 offset = 0;
+    while(offset < g_block_size_bytes) {
+        auto entry = (DirectoryEntry *)(block + offset);
+        u64 used = (entry->inode_num != 0) ? dir_entry_true_size(entry->name_length) : 0;
+        if(entry->length >= used + needed) {
+            u64 new_len = entry->length - used;
+            if(used > 0)
+                entry->length = used;
+
+            u8 *new_ptr = block + offset + used;
+            memset_workaround(new_ptr, 0, new_len);
+            auto new_entry = (DirectoryEntry *)new_ptr;
+            new_entry->inode_num = inode_num;
+            new_entry->length = new_len;
+            new_entry->name_length = name_len;
+            new_entry->file_type = file_type;
+            memmove_workaround(new_entry->name, (void *)name, name_len);
+            return true;
+        }
+        offset += entry->length;
+    }
+    return false;
+}
+
+// the previous entry takes over the removed entry's space, or if it's the first entry in the block, it is marked unused
+void dir_block_remove_entry(u8 *block, u64 offset)
+{
+    auto entry = (DirectoryEntry *)(block + offset);
+    if(offset == 0) {
+        entry->inode_num = 0;
+        return;
+    }
+
+    u64 prev_offset = 0;
+    auto prev = (DirectoryEntry *)block;
+    while(prev_offset + prev->length < offset) {
+        prev_offset += prev->length;
+        prev = (DirectoryEntry *)(block + prev_offset);
+    }
+    ASSERT(prev_offset + prev->length == offset);
+    prev->length += entry->length;
+}
+
+// drops one reference to an inode whose directory entry was removed, freeing it if it was the last one
+void __inode_unlink(u32 inode_num)
+{
+    INode *inode = get_inode(inode_num);
+    inode->hardlink_count--;
+    if(inode->hardlink_count == 0) {
+        // this must be done while the blocks are still there, since running copies of the program may read them
+        exec_cache_invalidate(inode_num);
+        u32 reserved = inode_reserved_blocks(inode);
+        __inode_discard_blocks_from_end(inode, reserved);
+        __free_inode(inode_num);
+        dentry_cache_invalidate_dir(inode_num);
+    }
+    writeback_inode(inode_num);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// directory index hashes, these must match the reference implementation (linux fs/ext4/hash.c) exactly, since
+// the hashes are stored on the disk
+
+const u32 EXT2_DX_HASH_EOF = 0x7fffffff;
+
+u32 dx_rotate_left(u32 val, u32 shift)
+{
+    return (val << shift) | (val >> (32 - shift));
+}
+
+u32 dx_char(const char *str, u64 i, bool is_unsigned)
+{
+    return is_unsigned ? (u32)(u8)str[i] : (u32)(s32)(s8)str[i];
+}
+
+u32 dx_legacy_hash(const char *name, u64 name_len, bool is_unsigned)
+{
+    u32 hash0 = 0x12a3fe2d;
+    u32 hash1 = 0x37abe8f9;
+    for(u64 i = 0; i < name_len; ++i) {
+        u32 hash = hash1 + (hash0 ^ (dx_char(name, i, is_unsigned) * 7152373));
+        if(hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// packs up to word_count * 4 chars of str into words, padding with a value based on len
+void dx_str_to_words(const char *str, s64 len, u32 *words, s32 word_count, bool is_unsigned)
+{
+    u32 pad = (u32)len | ((u32)len << 8);
+    pad |= pad << 16;
+
+    u32 val = pad;
+    if(len > word_count * 4)
+        len = word_count * 4;
+    for(s64 i = 0; i < len; ++i) {
+        val = dx_char(str, i, is_unsigned) + (val << 8);
+        if((i % 4) == 3) {
+            *words++ = val;
+            val = pad;
+            word_count--;
+        }
+    }
+    if(--word_count >= 0)
+        *words++ = val;
+    while(--word_count >= 0)
+        *words++ = pad;
+}
+
+void dx_half_md4_transform(u32 buf[4], const u32 in[8])
+{
+    u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    const u32 K1 = 0;
+    const u32 K2 = 013240474631;
+    const u32 K3 = 015666365641;
+    auto F = [](u32 x, u32 y, u32 z) { return z ^ (x & (y ^ z)); };
+    auto G = [](u32 x, u32 y, u32 z) { return (x & y) + ((x ^ y) & z); };
+    auto H = [](u32 x, u32 y, u32 z) { return x ^ y ^ z; };
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = dx_rotate_left(a, s))
+    DX_ROUND(F, a, b, c, d, in[0] + K1,  3);
+    DX_ROUND(F, d, a, b, c, in[1] + K1,  7);
+    DX_ROUND(F, c, d, a, b, in[2] + K1, 11);
+    DX_ROUND(F, b, c, d, a, in[3] + K1, 19);
+    DX_ROUND(F, a, b, c, d, in[4] + K1,  3);
+    DX_ROUND(F, d, a, b, c, in[5] + K1,  7);
+    DX_ROUND(F, c, d, a, b, in[6] + K1, 11);
+    DX_ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    DX_ROUND(G, a, b, c, d, in[1] + K2,  3);
+    DX_ROUND(G, d, a, b, c, in[3] + K2,  5);
+    DX_ROUND(G, c, d, a, b, in[5] + K2,  9);
+    DX_ROUND(G, b, c, d, a, in[7] + K2, 13);
+    DX_ROUND(G, a, b, c, d, in[0] + K2,  3);
+    DX_ROUND(G, d, a, b, c, in[2] + K2,  5);
+    DX_ROUND(G, c, d, a, b, in[4] + K2,  9);
+    DX_ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    DX_ROUND(H, a, b, c, d, in[3] + K3,  3);
+    DX_ROUND(H, d, a, b, c, in[7] + K3,  9);
+    DX_ROUND(H, c, d, a, b, in[2] + K3, 11);
+    DX_ROUND(H, b, c, d, a, in[6] + K3, 15);
+    DX_ROUND(H, a, b, c, d, in[1] + K3,  3);
+    DX_ROUND(H, d, a, b, c, in[5] + K3,  9);
+    DX_ROUND(H, c, d, a, b, in[0] + K3, 11);
+    DX_ROUND(H, b, c, d, a, in[4] + K3, 15);
+#undef DX_ROUND
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+void dx_tea_transform(u32 buf[4], const u32 in[4])
+{
+    u32 sum = 0;
+    u32 b0 = buf[0], b1 = buf[1];
+    u32 a = in[0], b = in[1], c = in[2], d = in[3];
+    for(int n = 0; n < 16; ++n) {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// NOTE the low bit of the hash is always 0, since the index uses it to mark hash collisions
+u32 dx_hash(const char *name, u64 name_len, u8 hash_version)
+{
+    u32 buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    for(int i = 0; i < 16; ++i) {
+        if(g_superblock.hash_seed[i]) {
+            memmove_workaround(buf, g_superblock.hash_seed, sizeof(buf));
+            break;
+        }
+    }
+
+    u32 in[8];
+    u32 hash = 0;
+    bool is_unsigned = hash_version >= EXT2_DX_HASH_LEGACY_UNSIGNED;
+    switch(hash_version) {
+        case EXT2_DX_HASH_LEGACY:
+        case EXT2_DX_HASH_LEGACY_UNSIGNED: {
+            hash = dx_legacy_hash(name, name_len, is_unsigned);
+        } break;
+        case EXT2_DX_HASH_HALF_MD4:
+        case EXT2_DX_HASH_HALF_MD4_UNSIGNED: {
+            for(s64 len = name_len; len > 0; len -= 32, name += 32) {
+                dx_str_to_words(name, len, in, 8, is_unsigned);
+                dx_half_md4_transform(buf, in);
+            }
+            hash = buf[1];
+        } break;
+        case EXT2_DX_HASH_TEA:
+        case EXT2_DX_HASH_TEA_UNSIGNED: {
+            for(s64 len = name_len; len > 0; len -= 16, name += 16) {
+                dx_str_to_words(name, len, in, 4, is_unsigned);
+                dx_tea_transform(buf, in);
+            }
+            hash = buf[0];
+        } break;
+        default: {
+            UNREACHABLE();
+        } break;
+    }
+
+    hash &= ~1u;
+    if(hash == (EXT2_DX_HASH_EOF << 1))
+        hash = (EXT2_DX_HASH_EOF - 1) << 1;
+    return hash;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// directory index, see the comment above DxRootInfo for the layout
+
+struct DxFrame
+{
+    u32 block_index = 0; // block index of this index block in the directory
+    u8 *block = nullptr;
+    DxEntry *entries = nullptr;
+    u32 at = 0; // the entry that leads to the next level
+};
+
+// the index blocks from the root down to the leaf that a hash belongs in
+struct DxPath
+{
+    u32 hash = 0;
+    u8 hash_version = 0;
+    u32 level_count = 0;
+    DxFrame frames[EXT2_DX_MAX_INDIRECT_LEVELS + 1];
+};
+
+bool dx_is_indexed(INode *dir)
+{
+    return (g_superblock.compatible_features & EXT2_FEATURE_COMPAT_DIR_INDEX) && (dir->flags & EXT2_INODE_FLAG_INDEX);
+}
+
+DxCountLimit *dx_count_limit(DxEntry *entries)
+{
+    return (DxCountLimit *)entries;
+}
+
+u32 dx_root_limit()
+{
+    return (g_block_size_bytes - EXT2_DX_ROOT_ENTRIES_OFFSET) / sizeof(DxEntry);
+}
+
+u32 dx_node_limit()
+{
+    return (g_block_size_bytes - EXT2_DX_NODE_ENTRIES_OFFSET) / sizeof(DxEntry);
+}
+
+DxRootInfo *dx_root_info(u8 *root)
+{
+    return (DxRootInfo *)(root + EXT2_DX_ROOT_INFO_OFFSET);
+}
+
+u8 dx_hash_version(u8 root_hash_version)
+{
+    if(root_hash_version <= EXT2_DX_HASH_TEA && (g_superblock.flags & EXT2_FLAGS_UNSIGNED_HASH))
+        return root_hash_version + EXT2_DX_HASH_LEGACY_UNSIGNED;
+    return root_hash_version;
+}
+
+// new indexes use the filesystem's default hash
+u8 dx_default_root_hash_version()
+{
+    u8 hash_version = g_superblock.def_hash_version;
+    return (hash_version <= EXT2_DX_HASH_TEA) ? hash_version : EXT2_DX_HASH_HALF_MD4;
+}
+
+u32 dx_leaf(DxPath *path)
+{
+    DxFrame& frame = path->frames[path->level_count - 1];
+    return frame.entries[frame.at].block;
+}
+
+void dx_free_path(DxPath *path)
+{
+    for(u32 i = 0; i < path->level_count; ++i)
+        kfree((vaddr)path->frames[i].block);
+    path->level_count = 0;
+}
+
+bool dx_entries_valid(INode *dir, DxEntry *entries, u32 limit)
+{
+    DxCountLimit *count_limit = dx_count_limit(entries);
+    if(count_limit->limit != limit || count_limit->count == 0 || count_limit->count > limit)
+        return false;
+
+    u32 blockcount = inode_used_blocks(dir);
+    for(u32 i = 0; i < count_limit->count; ++i) {
+        if(entries[i].block == 0 || entries[i].block >= blockcount)
+            return false;
+    }
+    return true;
+}
+
+// returns the last entry with a hash <= hash
+u32 dx_search(DxEntry *entries, u32 hash)
+{
+    u32 low = 1; // the first entry has an implied hash of 0
+    u32 high = dx_count_limit(entries)->count;
+    while(low < high) {
+        u32 mid = (low + high) / 2;
+        if(entries[mid].hash > hash)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return low - 1;
+}
+
+// walks the index from the root to the leaf that name belongs in
+// returns false if the index is damaged or uses a format that isn't supported, in which case the index is
+// disabled, and the directory is used as an unindexed one from then on (like linux does)
+bool dx_probe(INode *dir, u32 dir_inode_num, const char *name, u64 name_len, DxPath *path)
+{
+    path->level_count = 0;
+    u8 *block = dir_read_block(dir, 0);
+    DxRootInfo *info = dx_root_info(block);
+    DxEntry *entries = (DxEntry *)(block + EXT2_DX_ROOT_ENTRIES_OFFSET);
+    path->hash_version = dx_hash_version(info->hash_version);
+    u32 level_count = info->indirect_levels + 1;
+
+    bool is_valid = info->reserved_zero == 0 && info->info_length == sizeof(DxRootInfo)
+                 && info->indirect_levels <= EXT2_DX_MAX_INDIRECT_LEVELS
+                 && path->hash_version <= EXT2_DX_HASH_TEA_UNSIGNED
+                 && dx_entries_valid(dir, entries, dx_root_limit());
+    if(!is_valid)
+        kfree((vaddr)block);
+
+    if(is_valid) {
+        path->hash = dx_hash(name, name_len, path->hash_version);
+        u32 block_index = 0;
+        for(u32 level = 0; level < level_count; ++level) {
+            path->frames[level] = {block_index, block, entries, dx_search(entries, path->hash)};
+            path->level_count = level + 1;
+            if(level + 1 == level_count)
+                break;
+
+            block_index = entries[path->frames[level].at].block;
+            block = dir_read_block(dir, block_index);
+            entries = (DxEntry *)(block + EXT2_DX_NODE_ENTRIES_OFFSET);
+            if(!dx_entries_valid(dir, entries, dx_node_limit())) {
+                kfree((vaddr)block);
+                dx_free_path(path);
+                is_valid = false;
+                break;
+            }
+        }
+    }
+
+    if(!is_valid) {
+        dbg_str("disabling damaged directory index of inode "); dbg_uint(dir_inode_num); dbg_str("\n");
+        dir->flags &= ~EXT2_INODE_FLAG_INDEX;
+        writeback_inode(dir_inode_num);
+    }
+    return is_valid;
+}
+
+// moves path to the next leaf if it may hold more names with path->hash, which happens when the names with one
+// hash were split across leaves. returns false if there is no such leaf
+bool dx_next_leaf(INode *dir, DxPath *path)
+{
+    s32 level = path->level_count - 1;
+    while(level >= 0 && path->frames[level].at + 1 >= dx_count_limit(path->frames[level].entries)->count)
+        --level;
+    if(level < 0)
+        return false;
+
+    DxFrame& frame = path->frames[level];
+    if((frame.entries[frame.at + 1].hash & ~1u) != path->hash)
+        return false;
+    ++frame.at;
+
+    // the levels below start over at their first entry
+    for(u32 i = level + 1; i < path->level_count; ++i) {
+        DxFrame& parent = path->frames[i - 1];
+        DxFrame& child = path->frames[i];
+        kfree((vaddr)child.block);
+        child.block_index = parent.entries[parent.at].block;
+        child.block = dir_read_block(dir, child.block_index);
+        child.entries = (DxEntry *)(child.block + EXT2_DX_NODE_ENTRIES_OFFSET);
+        child.at = 0;
+    }
+    return true;
+}
+
+void dx_write_path(INode *dir, DxPath *path)
+{
+    for(u32 i = 0; i < path->level_count; ++i)
+        dir_write_block(dir, path->frames[i].block_index, path->frames[i].block);
+}
+
+// inserts an entry right after frame->at
+void dx_insert_entry(DxFrame *frame, u32 hash, u32 block_index)
+{
+    DxCountLimit *count_limit = dx_count_limit(frame->entries);
+    ASSERT(count_limit->count < count_limit->limit);
+    DxEntry *pos = frame->entries + frame->at + 1;
+    u32 moved_count = count_limit->count - (frame->at + 1);
+    memmove_workaround(pos + 1, pos, moved_count * sizeof(DxEntry));
+    pos->hash = hash;
+    pos->block = block_index;
+    count_limit->count++;
+}
+
+u8 *dx_new_node_block()
+{
+    u8 *block = (u8 *)kmalloc(g_block_size_bytes, 4096);
+    memset_workaround(block, 0, g_block_size_bytes);
+    auto unused = (DirectoryEntry *)block;
+    unused->length = g_block_size_bytes;
+    return block;
+}
+
+// makes sure the deepest index block in path has room for one more entry, either by adding a level to the index
+// or by splitting the index node
+u16 dx_make_room(INode *dir, u32 dir_inode_num, DxPath *path)
+{
+    DxFrame *frame = &path->frames[path->level_count - 1];
+    DxCountLimit *count_limit = dx_count_limit(frame->entries);
+    if(count_limit->count < count_limit->limit)
+        return FS_STATUS_OK;
+
+    if(path->level_count == 1) {
+        // the root is full, so its' entries move to a new index node below it
+        u32 node_index = dir_append_block(dir, dir_inode_num);
+        u8 *node = dx_new_node_block();
+        auto node_entries = (DxEntry *)(node + EXT2_DX_NODE_ENTRIES_OFFSET);
+        memmove_workaround(node_entries, frame->entries, count_limit->count * sizeof(DxEntry));
+        dx_count_limit(node_entries)->limit = dx_node_limit();
+
+        count_limit->count = 1;
+        frame->entries[0].block = node_index;
+        dx_root_info(frame->block)->indirect_levels = 1;
+
+        path->frames[1] = {node_index, node, node_entries, frame->at};
+        path->level_count = 2;
+        frame->at = 0;
+        ASSERT(dx_count_limit(node_entries)->count < dx_node_limit()); // a node holds more entries than the root
+        return FS_STATUS_OK;
+    }
+
+    // the index node is split in two, which needs room in the root
+    DxFrame *root = &path->frames[0];
+    if(dx_count_limit(root->entries)->count >= dx_count_limit(root->entries)->limit)
+        return FS_STATUS_OUT_OF_SPACE; // the index can't get any bigger
+
+    u32 node_index = dir_append_block(dir, dir_inode_num);
+    u8 *node = dx_new_node_block();
+    auto node_entries = (DxEntry *)(node + EXT2_DX_NODE_ENTRIES_OFFSET);
+    u32 count = count_limit->count;
+    u32 half = count / 2;
+    u32 split_hash = frame->entries[half].hash;
+    memmove_workaround(node_entries, frame->entries + half, (count - half) * sizeof(DxEntry));
+    dx_count_limit(node_entries)->limit = dx_node_limit();
+    dx_count_limit(node_entries)->count = count - half;
+    count_limit->count = half;
+    dx_insert_entry(root, split_hash, node_index);
+
+    // path continues through whichever half has the entry it was following
+    if(frame->at >= half) {
+        dir_write_block(dir, frame->block_index, frame->block);
+        kfree((vaddr)frame->block);
+        *frame = {node_index, node, node_entries, frame->at - half};
+        root->at++;
+    } else {
+        dir_write_block(dir, node_index, node);
+        kfree((vaddr)node);
+    }
+    return FS_STATUS_OK;
+}
+
+struct DxLeafEntry
+{
+    u32 hash = 0;
+    u16 offset = 0;
+    u16 size = 0;
+};
+
+bool dx_leaf_entry_less(const DxLeafEntry& a, const DxLeafEntry& b)
+{
+    return a.hash < b.hash;
+}
+
+// rewrites block with the entries of src that are in leaf_entries, packed at the start of the block
+void dx_pack_leaf(u8 *block, u8 *src, DxLeafEntry *leaf_entries, u32 count)
+{
+    memset_workaround(block, 0, g_block_size_bytes);
+    u64 offset = 0;
+    DirectoryEntry *entry = (DirectoryEntry *)block; // an empty entry with length 0 if there are no entries
+    for(u32 i = 0; i < count; ++i) {
+        memmove_workaround(block + offset, src + leaf_entries[i].offset, leaf_entries[i].size);
+        entry = (DirectoryEntry *)(block + offset);
+        entry->length = leaf_entries[i].size;
+        offset += leaf_entries[i].size;
+    }
+    entry->length += g_block_size_bytes - offset; // the last entry (or the empty one) spans the rest of the block
+}
+
+// moves the upper half of the names in leaf (by hash) to new_leaf, returns the hash new_leaf starts at
+u32 dx_split_leaf(u8 *leaf, u8 *new_leaf, u8 hash_version)
+{
+    u32 count = 0;
+    for(u64 offset = 0; offset < g_block_size_bytes; offset += ((DirectoryEntry *)(leaf + offset))->length)
+        count += ((DirectoryEntry *)(leaf + offset))->inode_num != 0;
+    ASSERT(count >= 2); // the leaf is full, and a single entry can't fill a block
+
+    auto leaf_entries = (DxLeafEntry *)kmalloc(count * sizeof(DxLeafEntry), alignof(DxLeafEntry));
+    u32 i = 0;
+    u64 total_size = 0;
+    for(u64 offset = 0; offset < g_block_size_bytes; offset += ((DirectoryEntry *)(leaf + offset))->length) {
+        auto entry = (DirectoryEntry *)(leaf + offset);
+        if(entry->inode_num == 0)
+            continue;
+        u16 size = dir_entry_true_size(entry->name_length);
+        leaf_entries[i++] = {dx_hash(entry->name, entry->name_length, hash_version), (u16)offset, size};
+        total_size += size;
+    }
+    sort(leaf_entries, count, dx_leaf_entry_less);
+
+    u32 split = 0;
+    u64 lower_size = 0;
+    while(split < count && lower_size + leaf_entries[split].size <= total_size / 2)
+        lower_size += leaf_entries[split++].size;
+    split = max(split, 1u);
+    split = min(split, count - 1);
+
+    // names with the same hash on both sides of the split are marked as a collision, so lookups check both leaves
+    u32 split_hash = leaf_entries[split].hash;
+    if(leaf_entries[split - 1].hash == split_hash)
+        split_hash |= 1;
+
+    u8 *src = (u8 *)kmalloc(g_block_size_bytes, 4096);
+    memmove_workaround(src, leaf, g_block_size_bytes);
+    dx_pack_leaf(leaf, src, leaf_entries, split);
+    dx_pack_leaf(new_leaf, src, leaf_entries + split, count - split);
+    kfree((vaddr)src);
+    kfree((vaddr)leaf_entries);
+    return split_hash;
+}
+
+// NOTE the caller must make sure name isn't in the directory yet
+u16 dx_add_entry(INode *dir, u32 dir_inode_num, const char *name, u64 name_len, u32 inode_num, u8 file_type)
+{
+    DxPath path;
+    bool is_valid = dx_probe(dir, dir_inode_num, name, name_len, &path);
+    ASSERT(is_valid); // the caller already looked name up through the index
+
+    u32 leaf_index = dx_leaf(&path);
+    u8 *leaf = dir_read_block(dir, leaf_index);
+    u16 status = FS_STATUS_OK;
+    if(dir_block_add_entry(leaf, name, name_len, inode_num, file_type)) {
+        dir_write_block(dir, leaf_index, leaf);
+    } else {
+        // the leaf is full, so it is split in two, which can take a new leaf and a new index node
+        if(available_block_count() < 4)
+            inode_cache_discard_all_prealloc();
+        if(available_block_count() < 4)
+            status = FS_STATUS_OUT_OF_SPACE;
+        if(status == FS_STATUS_OK)
+            status = dx_make_room(dir, dir_inode_num, &path);
+
+        if(status == FS_STATUS_OK) {
+            u32 new_leaf_index = dir_append_block(dir, dir_inode_num);
+            u8 *new_leaf = (u8 *)kmalloc(g_block_size_bytes, 4096);
+            u32 split_hash = dx_split_leaf(leaf, new_leaf, path.hash_version);
+            dx_insert_entry(&path.frames[path.level_count - 1], split_hash, new_leaf_index);
+
+            u8 *target = (path.hash < split_hash) ? leaf : new_leaf;
+            bool is_added = dir_block_add_entry(target, name, name_len, inode_num, file_type);
+            ASSERT(is_added);
+
+            dir_write_block(dir, leaf_index, leaf);
+            dir_write_block(dir, new_leaf_index, new_leaf);
+            dx_write_path(dir, &path);
+            kfree((vaddr)new_leaf);
+        }
+    }
+
+    kfree((vaddr)leaf);
+    dx_free_path(&path);
+    return status;
+}
+
+// turns a directory that is outgrowing its' first block into an indexed one, the entries in block 0 move to a
+// new leaf and block 0 becomes the index root
+void dx_make_indexed(INode *dir, u32 dir_inode_num)
+{
+    ASSERT(inode_used_blocks(dir) == 1);
+    u8 *root = dir_read_block(dir, 0);
+    u8 *leaf = dx_new_node_block(); // an empty directory block
+
+    u32 dot_inode_num = 0;
+    u32 dotdot_inode_num = 0;
+    for(u64 offset = 0; offset < g_block_size_bytes; offset += ((DirectoryEntry *)(root + offset))->length) {
+        auto entry = (DirectoryEntry *)(root + offset);
+        if(entry->inode_num == 0)
+            continue;
+
+        if(dir_entry_name_match(entry, ".", 1, true)) {
+            dot_inode_num = entry->inode_num;
+        } else if(dir_entry_name_match(entry, "..", 2, true)) {
+            dotdot_inode_num = entry->inode_num;
+        } else {
+            bool is_added = dir_block_add_entry(leaf, entry->name, entry->name_length, entry->inode_num, entry->file_type);
+            ASSERT(is_added); // the entries fit in one block before, and now they don't share it with "." and ".."
+        }
+    }
+    ASSERT(dot_inode_num == dir_inode_num && dotdot_inode_num);
+
+    memset_workaround(root, 0, g_block_size_bytes);
+    auto dot = (DirectoryEntry *)root;
+    dot->inode_num = dot_inode_num;
+    dot->length = dir_entry_true_size(1);
+    dot->name_length = 1;
+    dot->file_type = EXT2_DIR_FTYPE_DIR;
+    dot->name[0] = '.';
+    auto dotdot = (DirectoryEntry *)(root + dot->length);
+    dotdot->inode_num = dotdot_inode_num;
+    dotdot->length = g_block_size_bytes - dot->length;
+    dotdot->name_length = 2;
+    dotdot->file_type = EXT2_DIR_FTYPE_DIR;
+    dotdot->name[0] = '.';
+    dotdot->name[1] = '.';
+
+    DxRootInfo *info = dx_root_info(root);
+    info->hash_version = dx_default_root_hash_version();
+    info->info_length = sizeof(DxRootInfo);
+    auto entries = (DxEntry *)(root + EXT2_DX_ROOT_ENTRIES_OFFSET);
+    dx_count_limit(entries)->limit = dx_root_limit();
+    dx_count_limit(entries)->count = 1;
+
+    u32 leaf_index = dir_append_block(dir, dir_inode_num);
+    entries[0].block = leaf_index;
+    dir_write_block(dir, 0, root);
+    dir_write_block(dir, leaf_index, leaf);
+    kfree((vaddr)root);
+    kfree((vaddr)leaf);
+
+    dir->flags |= EXT2_INODE_FLAG_INDEX;
+    writeback_inode(dir_inode_num);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+struct DirEntryLookupResult
+{
+    bool found = false;
+    u32 inode_num = 0;
+    u8 file_type = EXT2_DIR_FTYPE_UNKNOWN;
+};
+
+// indexed directories only read the index blocks and the leaf that name hashes to, others are scanned block by block
+DirEntryLookupResult dir_find_entry(INode *dir, u32 dir_inode_num, const char *name, u64 name_len)
+{
+    DirEntryLookupResult result = {};
+    DxPath path;
+    if(dx_is_indexed(dir) && dx_probe(dir, dir_inode_num, name, name_len, &path)) {
+        do {
+            u32 blocknum = inode_blocknum_at_index(dir, dx_leaf(&path));
+            u8 *leaf = block_cache_get(blocknum);
+            s64 offset = dir_block_find_entry(leaf, name, name_len);
+            if(offset >= 0) {
+                auto entry = (DirectoryEntry *)(leaf + offset);
+                result = {true, entry->inode_num, entry->file_type};
+            }
+        } while(!result.found && dx_next_leaf(dir, &path));
+        dx_free_path(&path);
+        return result;
+    }
+
+    u32 blockcount = inode_used_blocks(dir);
+    u8 *block_buffer = (u8 *)kmalloc(blockcount * g_block_size_bytes, 4096);
+    inode_read_data_blocks(dir, block_buffer, blockcount, 0);
+    for(u32 block_index = 0; block_index < blockcount && !result.found; ++block_index) {
+        u8 *block = block_buffer + block_index * g_block_size_bytes;
+        s64 offset = dir_block_find_entry(block, name, name_len);
+        if(offset >= 0) {
+            auto entry = (DirectoryEntry *)(block + offset);
+            result = {true, entry->inode_num, entry->file_type};
+        }
+    }
+    kfree((vaddr)block_buffer);
+    return result;
+}
+
+struct PathLookupResult
+{
+    bool found_inode = false;
+    u32 inode_num = 0;
+};
+
+// NOTE each path component is looked up in the dentry cache first, directory blocks are only read on a miss
+// TODO this currently goes through the whole loop even for redundant parts of the
+//      path (e.g. a/b/././././c or a/b/,,/c), these redundant iterations can be
+//      skipped by normalizing the path string first
+PathLookupResult lookup_path(const char *path, u64 path_len)
+{
+    ASSERT(path);
+    ASSERT(*path);
+    bool is_abs_path = *path == '/';
+
+    const char *part_start = path;
+    for(; *part_start && *part_start == '/'; ++part_start) {} // skip redundant '/' in paths, e.g. /a///b
+    const char *part_end = part_start +1;
+
+    u32 curr_inode_num = 0;
+    if(is_abs_path)
+        curr_inode_num = EXT2_ROOT_DIR_INODE;
+    else
+        UNREACHABLE(); // relative paths should be handled before fs functions are called
 
+    const char *str_end = path + path_len;
+    while(*part_start && part_start != str_end) {
         ASSERT(*part_start != '/'); // on loop entry, part_start is assumed to point to first non '/' character in the part
         part_end = part_start+1;
         for(; *part_end && *part_end != '/'; ++part_end) {}
@@ -1441,28 +2721,27 @@ PathLookupResult lookup_path(const char *path, u64 path_len)
         ASSERT(part_len < EXT2_DIR_MAX_NAME_LENGTH);
         bool is_dir = (*part_end == '/');
 
-        u8 *base_ptr = block_buffer;
-        u8 *ptr = base_ptr;
-        bool found_entry = false;
-        DirectoryEntry *entry = 0;
-        while(ptr < base_ptr + g_block_size_bytes) {
-            entry = (DirectoryEntry *)ptr;
-            ASSERT(entry->name_length < EXT2_DIR_MAX_NAME_LENGTH);
-
-            if(dir_entry_name_match(entry, part_start, part_len, is_dir)) {
-                found_entry = true;
-                break;
-            }
+        u32 found_inode_num = 0;
+        u8 found_file_type = EXT2_DIR_FTYPE_UNKNOWN;
+        DentryCacheEntry *cached = dentry_cache_lookup(curr_inode_num, part_start, part_len);
+        if(cached) {
+            found_inode_num = cached->inode_num;
+            found_file_type = cached->file_type;
+        } else {
+            // NOTE the type is checked below, so the cached entry is valid for both file and dir lookups
+            INode *curr_dir = get_inode(curr_inode_num);
+            auto entry_res = dir_find_entry(curr_dir, curr_inode_num, part_start, part_len);
+            found_inode_num = entry_res.inode_num;
+            found_file_type = entry_res.file_type;
 
-            ptr += entry->length;
+            dentry_cache_insert(curr_inode_num, part_start, part_len, found_inode_num, found_file_type);
         }
 
-        // TODO curr_inode_num is unecessary if entry ptr is pushed outside the outer while loop scope
-        curr_inode_num = entry->inode_num; // this must come before the kfree()
-        kfree((vaddr)block_buffer);
-
-        if(!found_entry)
+        if(found_inode_num == 0)
+            return {};
+        if(is_dir && found_file_type != EXT2_DIR_FTYPE_DIR)
             return {};
+        curr_inode_num = found_inode_num;
 
         part_start = part_end;
         for(; *part_start && *part_start == '/'; ++part_start) {} // skip redundant '/' in paths, e.g. /a///b
@@ -1509,6 +2788,9 @@ u16 fs_list_dir(const char *path, char *buf, int buf_size, char **buf_one_past_e
     while(entry_ptr < end) {
         auto entry = (DirectoryEntry *)entry_ptr;
         ASSERT(entry->name_length < EXT2_DIR_MAX_NAME_LENGTH);
+        entry_ptr += entry->length;
+        if(entry->inode_num == 0)
+            continue; // unused space, e.g. the index blocks of an indexed directory
 
         ASSERT(dest_ptr + entry->name_length +1 <= buf + buf_size);
         int i = 0;
@@ -1517,8 +2799,6 @@ u16 fs_list_dir(const char *path, char *buf, int buf_size, char **buf_one_past_e
         }
         dest_ptr[i] = 0;
         dest_ptr += i+1;
-
-        entry_ptr += entry->length;
     }
     *buf_one_past_end = dest_ptr;
 
@@ -1537,6 +2817,43 @@ FileSizeResult fs_file_size(const char *path)
     return {true, size};
 }
 
+// copies the part of block block_i that overlaps [offset, end) out of the block cache, buffer holds [offset, end)
+void inode_read_partial_block(INode *inode, u64 block_i, u8 *buffer, u64 offset, u64 end)
+{
+    u64 block_start = block_i * g_block_size_bytes;
+    u64 copy_start = max(offset, block_start);
+    u64 copy_end = min(end, block_start + g_block_size_bytes);
+    u8 *data = block_cache_get(inode_blocknum_at_index(inode, block_i));
+    memmove_workaround(buffer + (copy_start - offset), data + (copy_start - block_start), copy_end - copy_start);
+}
+
+// copies bytes bytes starting at offset out of the file, the range must be inside the file
+// NOTE the whole blocks in the range are read straight into buffer, only the partial blocks at the start and end
+//      are copied out of the block cache
+void inode_read(INode *inode, u8 *buffer, u64 offset, u64 bytes)
+{
+    ASSERT(offset + bytes <= inode_size(inode));
+    if(bytes == 0)
+        return;
+
+    u64 end = offset + bytes;
+    u64 one_past_end_block = round_up_divide(end, g_block_size_bytes);
+    u64 full_start_block = round_up_divide(offset, g_block_size_bytes);
+    u64 full_end_block = end / g_block_size_bytes;
+    if(full_start_block < full_end_block) {
+        u8 *full_start_ptr = buffer + (full_start_block * g_block_size_bytes - offset);
+        inode_read_data_blocks(inode, full_start_ptr, full_end_block - full_start_block, full_start_block);
+    } else {
+        full_start_block = one_past_end_block;
+        full_end_block = one_past_end_block;
+    }
+
+    for(u64 block_i = offset / g_block_size_bytes; block_i < full_start_block; ++block_i)
+        inode_read_partial_block(inode, block_i, buffer, offset, end);
+    for(u64 block_i = full_end_block; block_i < one_past_end_block; ++block_i)
+        inode_read_partial_block(inode, block_i, buffer, offset, end);
+}
+
 // TODO return nread
 u16 fs_read(const char *path, u8 *buffer, u64 offset, u64 size)
 {
@@ -1552,20 +2869,11 @@ u16 fs_read(const char *path, u8 *buffer, u64 offset, u64 size)
     }
     u64 offset_to_eof = filesize - offset;
     u64 bytes = min(size, offset_to_eof);
-    u32 blockcount = round_up_divide(bytes, g_block_size_bytes);
 
-    u32 startblock = offset / g_block_size_bytes;
-    u64 block_offset = offset % g_block_size_bytes;
-    ASSERT(block_offset + bytes <= blockcount * g_block_size_bytes);
-
-    // TODO try to do this with no copies (use VObject)
-    u8 *block_buffer = (u8 *)kmalloc(blockcount * g_block_size_bytes, 4096);
-    inode_read_data_blocks(inode, block_buffer, blockcount, startblock);
-    memmove_workaround(buffer, block_buffer + block_offset, bytes);
+    inode_read(inode, buffer, offset, bytes);
     int bytes_remaining = size - bytes; // NOTE bytes is guaranteed to be <= size
     ASSERT(bytes_remaining >= 0);
     memset_workaround(buffer + bytes, 0, bytes_remaining);
-    kfree((vaddr)block_buffer);
     return FS_STATUS_OK;
 }
 
@@ -1597,7 +2905,11 @@ inline NewINodeResult __new_inode(u32 parent_inode_num, bool is_dir)
 {
     u32 inode_num = alloc_inode();
     INode *inode = get_inode(inode_num);
+    // NOTE the generation is bumped every time an inode number is re-used, so open files can tell if the
+    //      file they refer to was deleted
+    u32 generation = inode->generation + 1;
     memset_workaround((u8 *)inode, 0, g_superblock.inode_size);
+    inode->generation = generation;
     inode->hardlink_count = 1;
     if(is_dir) {
         inode->mode = EXT2_INODE_TYPE_DIR | EXT2_INODE_ALL_PERMISSIONS;
@@ -1607,6 +2919,22 @@ inline NewINodeResult __new_inode(u32 parent_inode_num, bool is_dir)
     }
     return {inode_num, inode};
 }
+
+// returns the inode for a new directory entry, either a new one or inode_to_hardlink with one more reference
+u32 __inode_for_new_entry(u32 parent_inode_num, bool is_dir, u32 inode_to_hardlink)
+{
+    if(!inode_to_hardlink)
+        return __new_inode(parent_inode_num, is_dir).inode_num;
+
+    INode *inode = get_inode(inode_to_hardlink);
+    inode->hardlink_count++;
+    if(is_dir)
+        ASSERT(inode->mode & EXT2_INODE_TYPE_DIR);
+    else
+        ASSERT(inode->mode & EXT2_INODE_TYPE_REG_FILE);
+    return inode_to_hardlink;
+}
+
 // TODO the code to make a directory entry can be separated out for fs_mv
 u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
 {
@@ -1633,6 +2961,24 @@ u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
     }
     u32 parent_inode_num = lookupresult.inode_num;
     INode *parent = get_inode(parent_inode_num);
+    u16 direntry_type = is_dir ? EXT2_DIR_FTYPE_DIR : EXT2_DIR_FTYPE_REG_FILE;
+
+    if(dx_is_indexed(parent)) {
+        bool already_exists = dir_find_entry(parent, parent_inode_num, newname, newname_len).found;
+        // NOTE the lookup disables the index if it is damaged, the directory is then handled as an unindexed one below
+        if(already_exists)
+            return FS_STATUS_FILE_ALREADY_EXISTS;
+        if(dx_is_indexed(parent)) {
+            dentry_cache_invalidate(parent_inode_num, newname, newname_len);
+            u32 inode_num = __inode_for_new_entry(parent_inode_num, is_dir, inode_to_hardlink);
+            u16 status = dx_add_entry(parent, parent_inode_num, newname, newname_len, inode_num, direntry_type);
+            if(status == FS_STATUS_OK)
+                writeback_inode(inode_num);
+            else
+                __inode_unlink(inode_num); // undoes the new inode or the new hardlink
+            return status;
+        }
+    }
 
     u64 min_entry_size = dir_entry_true_size(newname_len);
 
@@ -1650,18 +2996,18 @@ u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
     u8 *block_buffer_end = base_ptr + block_buffer_size;
     u8 *ptr = base_ptr;
     u8 *found_slot_ptr = 0;
-    u64 unused_len = 0;
+    u64 found_slot_len = 0;
     while(ptr < block_buffer_end) {
         auto entry = (DirectoryEntry *)ptr;
         ASSERT(entry->name_length < EXT2_DIR_MAX_NAME_LENGTH);
 
-        if(dir_entry_name_match(entry, newname, newname_len)) {
+        if(entry->inode_num != 0 && dir_entry_name_match(entry, newname, newname_len)) {
             search_result = CASE_FILE_ALREADY_EXISTS;
             break;
         }
 
         u64 true_len = dir_entry_true_size(entry->name_length);
-        unused_len = entry->length - true_len;
+        u64 unused_len = entry->length - true_len;
         ASSERT(unused_len % 4 == 0);
         if(search_result != CASE_SLOT_FOUND && unused_len >= min_entry_size) {
             // NOTE this does not end the loop, since there could be an entry that
@@ -1670,6 +3016,7 @@ u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
             u64 old_len = entry->length;
             entry->length = true_len;
             found_slot_ptr = ptr + true_len;
+            found_slot_len = unused_len;
             ptr += old_len;
 
             search_result = CASE_SLOT_FOUND;
@@ -1678,30 +3025,20 @@ u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
         }
     }
 
-    u16 direntry_type = is_dir ? EXT2_DIR_FTYPE_DIR : EXT2_DIR_FTYPE_REG_FILE;
+    // the new name may have been cached as a negative entry
+    if(search_result != CASE_FILE_ALREADY_EXISTS)
+        dentry_cache_invalidate(parent_inode_num, newname, newname_len);
 
     u16 return_status;
     switch(search_result) {
         case(CASE_SLOT_FOUND): {
-            u32 inode_num = 0;
-            if(inode_to_hardlink) {
-                inode_num = inode_to_hardlink;
-                INode *i = get_inode(inode_num);
-                i->hardlink_count++;
-                if(is_dir)
-                    ASSERT(i->mode & EXT2_INODE_TYPE_DIR);
-                else 
-                    ASSERT(i->mode & EXT2_INODE_TYPE_REG_FILE);
-            } else {
-                auto inode_res = __new_inode(parent_inode_num, is_dir);
-                inode_num = inode_res.inode_num;
-            }
+            u32 inode_num = __inode_for_new_entry(parent_inode_num, is_dir, inode_to_hardlink);
 
             auto newentry = (DirectoryEntry *)found_slot_ptr;
 
-            memset_workaround(found_slot_ptr, 0, unused_len);
+            memset_workaround(found_slot_ptr, 0, found_slot_len);
             newentry->inode_num = inode_num;
-            newentry->length = unused_len;
+            newentry->length = found_slot_len;
             newentry->name_length = newname_len;
             newentry->file_type = direntry_type;
             memmove_workaround(newentry->name, (void *)newname, newname_len);
@@ -1718,20 +3055,29 @@ u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
         } break;
         case(CASE_SLOT_NOT_FOUND): {
             // TODO can attempt to shrink unused space in the directory and retry, before allocating a new block
-            u32 inode_num = 0;
-            if(inode_to_hardlink) {
-                inode_num = inode_to_hardlink;
-                INode *i = get_inode(inode_num);
-                i->hardlink_count++;
-                if(is_dir)
-                    ASSERT(i->mode & EXT2_INODE_TYPE_DIR);
-                else 
-                    ASSERT(i->mode & EXT2_INODE_TYPE_REG_FILE);
-            } else {
-                auto inode_res = __new_inode(parent_inode_num, is_dir);
-                inode_num = inode_res.inode_num;
+            bool should_index = blockcount == 1 && (g_superblock.compatible_features & EXT2_FEATURE_COMPAT_DIR_INDEX);
+            if(should_index) {
+                // the directory is outgrowing its' first block, so it gets indexed instead of getting an
+                // unindexed second block. this takes a block for the first leaf, and adding to it may split it
+                if(available_block_count() < 5)
+                    inode_cache_discard_all_prealloc();
+                if(available_block_count() < 5) {
+                    return_status = FS_STATUS_OUT_OF_SPACE;
+                    break;
+                }
+
+                dx_make_indexed(parent, parent_inode_num);
+                u32 inode_num = __inode_for_new_entry(parent_inode_num, is_dir, inode_to_hardlink);
+                return_status = dx_add_entry(parent, parent_inode_num, newname, newname_len, inode_num, direntry_type);
+                if(return_status == FS_STATUS_OK)
+                    writeback_inode(inode_num);
+                else
+                    __inode_unlink(inode_num);
+                break;
             }
 
+            u32 inode_num = __inode_for_new_entry(parent_inode_num, is_dir, inode_to_hardlink);
+
             u8 *buffer = (u8 *)kmalloc(g_block_size_bytes, 4096); // TODO this can re-use the existing block_buffer instead of kmallocing a new buffer
             auto newentry = (DirectoryEntry *)buffer;
 
@@ -1778,8 +3124,6 @@ u16 fs_create(const char *path, u16 type, u32 inode_to_hardlink = 0)
 //       all its' inode references in its' dir entries
 u16 fs_delete(const char *path, bool dir_should_be_empty = true)
 {
-    // TODO this should remove path from lookup table
-
     int path_len;
     int parent_path_len;
     path_lengths(path, &path_len, &parent_path_len);
@@ -1795,6 +3139,37 @@ u16 fs_delete(const char *path, bool dir_should_be_empty = true)
     }
     u32 parent_inode_num = lookupresult.inode_num;
     INode *parent = get_inode(parent_inode_num);
+
+    // entries of indexed directories are removed from their leaf in place, the leaf isn't freed even if it
+    // becomes empty since the index still points to it
+    DxPath dx_path;
+    if(dx_is_indexed(parent) && dx_probe(parent, parent_inode_num, delname, delname_len, &dx_path)) {
+        u16 status = FS_STATUS_FILE_NOT_FOUND;
+        bool found = false;
+        do {
+            u32 leaf_index = dx_leaf(&dx_path);
+            u8 *leaf = dir_read_block(parent, leaf_index);
+            s64 offset = dir_block_find_entry(leaf, delname, delname_len, is_dir);
+            if(offset >= 0) {
+                found = true;
+                auto entry = (DirectoryEntry *)(leaf + offset);
+                u32 inode_num = entry->inode_num;
+                if(entry->file_type == EXT2_DIR_FTYPE_DIR && dir_should_be_empty && !is_dir_empty(get_inode(inode_num))) {
+                    status = FS_STATUS_DIR_NOT_EMPTY;
+                } else {
+                    dir_block_remove_entry(leaf, offset);
+                    dir_write_block(parent, leaf_index, leaf);
+                    dentry_cache_invalidate(parent_inode_num, delname, delname_len);
+                    __inode_unlink(inode_num);
+                    status = FS_STATUS_OK;
+                }
+            }
+            kfree((vaddr)leaf);
+        } while(!found && dx_next_leaf(parent, &dx_path));
+
+        dx_free_path(&dx_path);
+        return status;
+    }
 // ----------------------------------------------------------
 
     u32 blockcount = inode_used_blocks(parent);
@@ -1818,7 +3193,7 @@ u16 fs_delete(const char *path, bool dir_should_be_empty = true)
         auto entry = (DirectoryEntry *)ptr;
         ASSERT(entry->name_length < EXT2_DIR_MAX_NAME_LENGTH);
 
-        if(dir_entry_name_match(entry, delname, delname_len, is_dir)) {
+        if(entry->inode_num != 0 && dir_entry_name_match(entry, delname, delname_len, is_dir)) {
             inode_num = entry->inode_num;
             inode = get_inode(inode_num);
 
@@ -1892,6 +3267,7 @@ u16 fs_delete(const char *path, bool dir_should_be_empty = true)
             u8 *writeback_buffer = block_buffer + startblock_index * g_block_size_bytes;
 
             writeback_inode_data_blocks(parent, writeback_buffer, startblock_index, writeback_count);
+            dentry_cache_invalidate(parent_inode_num, delname, delname_len);
 
             if(blocks_to_free > 0) {
                 // TODO make sure this handles the case of all blocks freed properly
@@ -1907,13 +3283,7 @@ u16 fs_delete(const char *path, bool dir_should_be_empty = true)
                 writeback_inode(parent_inode_num);
             }
 
-            inode->hardlink_count--;
-            if(inode->hardlink_count == 0) {
-                u32 reserved = inode_reserved_blocks(inode);
-                __inode_discard_blocks_from_end(inode, reserved);
-                __free_inode(inode_num);
-            }
-            writeback_inode(inode_num);
+            __inode_unlink(inode_num);
             return_status = FS_STATUS_OK;
         } break;
 
@@ -1935,65 +3305,185 @@ u16 fs_delete(const char *path, bool dir_should_be_empty = true)
     return return_status;
 }
 
-u16 fs_write(const char *path, u8 *buffer, u64 offset, u64 size)
+// fills in the part of block block_i that overlaps [start, end), [start, offset) is zeroed and [offset, end) comes from buffer
+void inode_write_partial_block(INode *inode, u64 block_i, u64 filesize, u64 start, u8 *buffer, u64 offset, u64 end)
 {
-    auto res = lookup_path(path);
-    if(!res.found_inode) {
-        return FS_STATUS_FILE_NOT_FOUND;
-    }
-    INode *inode = get_inode(res.inode_num);
+    u64 block_start = block_i * g_block_size_bytes;
+    u64 block_end = block_start + g_block_size_bytes;
+    u32 blocknum = inode_blocknum_at_index(inode, block_i);
+    // blocks past the old end of the file don't hold anything worth reading from the disk
+    u8 *data = (block_start < filesize) ? block_cache_get(blocknum) : block_cache_get_zeroed(blocknum);
+
+    u64 zero_start = max(start, block_start);
+    u64 zero_end = min(offset, block_end);
+    if(zero_start < zero_end)
+        memset_workaround(data + (zero_start - block_start), 0, zero_end - zero_start);
+
+    u64 copy_start = max(offset, block_start);
+    u64 copy_end = min(end, block_end);
+    if(copy_start < copy_end)
+        memmove_workaround(data + (copy_start - block_start), buffer + (copy_start - offset), copy_end - copy_start);
+
+    block_cache_mark_dirty(blocknum);
+}
+
+// makes sure the inode has enough blocks reserved to hold size bytes
+u16 __inode_ensure_blocks_for_size(INode *inode, u64 size)
+{
+    u64 needed = round_up_divide(size, g_block_size_bytes);
+    u64 reserved = inode_reserved_blocks(inode);
+    if(needed <= reserved)
+        return FS_STATUS_OK;
+
+    u64 must_alloc = needed - reserved;
+    if(must_alloc > available_block_count())
+        inode_cache_discard_all_prealloc();
+    if(must_alloc > available_block_count())
+        return FS_STATUS_OUT_OF_SPACE;
+    __inode_ensure_blocks(inode, must_alloc);
+    return FS_STATUS_OK;
+}
+
+u16 fs_write_inode(u32 inode_num, u8 *buffer, u64 offset, u64 size)
+{
+    INode *inode = get_inode(inode_num);
+    exec_cache_invalidate(inode_num);
 
     u64 filesize = inode_size(inode);
     u64 start = min(filesize, offset);
     u64 end = offset + size;
-    u64 zero_count = offset - start;
 
     u64 startblock = start / g_block_size_bytes;
     u64 one_past_end_block = round_up_divide(end, g_block_size_bytes);
-    u64 blockcount = one_past_end_block - startblock;
 
-    u64 reserved = inode_reserved_blocks(inode);
-    if(one_past_end_block > reserved) {
-        u64 must_alloc = one_past_end_block - reserved;
-        if(must_alloc > g_superblock.free_block_count) {
-            return FS_STATUS_OUT_OF_SPACE;
-        }
-        __inode_ensure_blocks(inode, must_alloc);
-    }
+    if(__inode_ensure_blocks_for_size(inode, end) != FS_STATUS_OK)
+        return FS_STATUS_OUT_OF_SPACE;
 
-    u8 *block_buffer = (u8 *)kmalloc(blockcount * g_block_size_bytes, 4096);
-    if(startblock < inode_used_blocks(inode)) {
-        u64 readend = min(end, filesize);
-        u32 readend_block = round_up_divide(readend, g_block_size_bytes);
-        u32 readblocks = readend_block - startblock;
-        inode_read_data_blocks(inode, block_buffer, readblocks, startblock);
+    // the blocks that buffer covers completely go straight from buffer to the block cache, only the partial blocks at
+    // the start and end (and the zeroed gap between the old end of the file and offset) are modified in place
+    u64 full_start_block = round_up_divide(offset, g_block_size_bytes);
+    u64 full_end_block = end / g_block_size_bytes;
+    if(full_start_block < full_end_block) {
+        u8 *full_start_ptr = buffer + (full_start_block * g_block_size_bytes - offset);
+        writeback_inode_data_blocks(inode, full_start_ptr, full_start_block, full_end_block - full_start_block);
+    } else {
+        full_start_block = one_past_end_block;
+        full_end_block = one_past_end_block;
     }
 
-    u64 in_block_start = start - startblock * g_block_size_bytes;
-    u8 *ptr = block_buffer + in_block_start;
-    memset_workaround(ptr, 0, zero_count);
-
-// TODO do this without copy
-    ptr += zero_count;
-    memmove_workaround(ptr, buffer, size);
-
-    writeback_inode_data_blocks(inode, block_buffer, startblock, blockcount);
+    for(u64 block_i = startblock; block_i < full_start_block; ++block_i)
+        inode_write_partial_block(inode, block_i, filesize, start, buffer, offset, end);
+    for(u64 block_i = full_end_block; block_i < one_past_end_block; ++block_i)
+        inode_write_partial_block(inode, block_i, filesize, start, buffer, offset, end);
 
     u64 new_size = max(filesize, end);
     __inode_set_size(inode, new_size);
 
-    writeback_inode(res.inode_num);
-    kfree((vaddr)block_buffer);
+    writeback_inode(inode_num);
     return FS_STATUS_OK;
 }
 
-u16 fs_truncate(const char *path, u64 newsize)
+const u64 COPY_CHUNK_BYTES = (u64)DMA_MAX_SECTORS_PER_COMMAND * 512; // the most one disk command can transfer
+
+struct FileCopyResult
+{
+    u16 status = FS_STATUS_OK;
+    u64 bytes_copied = 0;
+};
+
+// copies up to size bytes from one file to another, like fs_read_inode() followed by fs_write_inode() but without a
+// buffer, returns 0 bytes copied at the end of the source file
+// NOTE when both offsets are block aligned, whole blocks are copied from one cache entry to the other, so the data
+//      is copied once, the source blocks are read COPY_CHUNK_BYTES at a time and the destination blocks are only
+//      written when the cache is flushed, both in large sorted runs. anything else goes through a kernel buffer
+FileCopyResult fs_copy_inode(u32 src_inode_num, u64 src_offset, u32 dst_inode_num, u64 dst_offset, u64 size)
+{
+    INode *src = get_inode(src_inode_num);
+    INode *dst = get_inode(dst_inode_num);
+    u64 src_size = inode_size(src);
+    if(src_offset >= src_size)
+        return {FS_STATUS_OK, 0};
+    u64 bytes = min(size, src_size - src_offset);
+
+    // the copy goes front to back a chunk at a time, so with overlapping ranges in the same file, a later chunk could
+    // read what an earlier one already overwrote
+    if(src_inode_num == dst_inode_num && src_offset < dst_offset + bytes && dst_offset < src_offset + bytes)
+        return {FS_STATUS_BAD_ARG, 0};
+
+    // NOTE the destination range must not start past the end of the file, since the gap would have to be zeroed
+    bool is_block_copy = src_inode_num != dst_inode_num && src_offset % g_block_size_bytes == 0
+                      && dst_offset % g_block_size_bytes == 0 && dst_offset <= inode_size(dst);
+    u64 block_copy_count = is_block_copy ? bytes / g_block_size_bytes : 0;
+    if(block_copy_count > 0) {
+        u64 block_copy_end = dst_offset + block_copy_count * g_block_size_bytes;
+        if(__inode_ensure_blocks_for_size(dst, block_copy_end) != FS_STATUS_OK)
+            return {FS_STATUS_OUT_OF_SPACE, 0};
+        exec_cache_invalidate(dst_inode_num);
+
+        u64 src_block = src_offset / g_block_size_bytes;
+        u64 dst_block = dst_offset / g_block_size_bytes;
+        u64 chunk_blocks = COPY_CHUNK_BYTES / g_block_size_bytes;
+        u32 *blocknums = (u32 *)kmalloc(min(chunk_blocks, block_copy_count) * sizeof(u32), alignof(u32));
+        for(u64 done = 0; done < block_copy_count; done += chunk_blocks) {
+            u64 count = min(chunk_blocks, block_copy_count - done);
+            for(u64 i = 0; i < count; ++i)
+                blocknums[i] = inode_blocknum_at_index(src, src_block + done + i);
+            block_cache_prefetch_list(blocknums, count);
+
+            for(u64 i = 0; i < count; ++i) {
+                u32 src_blocknum = inode_blocknum_at_index(src, src_block + done + i);
+                u32 dst_blocknum = inode_blocknum_at_index(dst, dst_block + done + i);
+                block_cache_copy(src_blocknum, dst_blocknum);
+            }
+        }
+        kfree((vaddr)blocknums);
+
+        __inode_set_size(dst, max(inode_size(dst), block_copy_end));
+        writeback_inode(dst_inode_num);
+    }
+
+    u64 copied = block_copy_count * g_block_size_bytes;
+    if(copied == bytes)
+        return {FS_STATUS_OK, bytes};
+
+    u64 chunk_size = min(bytes - copied, COPY_CHUNK_BYTES);
+    u8 *buffer = (u8 *)kmalloc(chunk_size, 4096);
+    u16 status = FS_STATUS_OK;
+    while(copied < bytes && status == FS_STATUS_OK) {
+        u64 count = min(chunk_size, bytes - copied);
+        inode_read(src, buffer, src_offset + copied, count);
+        status = fs_write_inode(dst_inode_num, buffer, dst_offset + copied, count);
+        if(status == FS_STATUS_OK)
+            copied += count;
+    }
+    kfree((vaddr)buffer);
+    return {status, copied};
+}
+
+// gives back the preallocation window of a file that isn't expected to grow anymore, so the blocks are available to
+// other files right away instead of when the inode is evicted from the cache
+void fs_release_prealloc(u32 inode_num)
+{
+    INodeCacheEntry *entry = inode_cache_lookup(inode_num);
+    if(entry)
+        inode_discard_prealloc(entry);
+}
+
+// NOTE unlike a write through an open file, this is the end of writing the file
+u16 fs_write(const char *path, u8 *buffer, u64 offset, u64 size)
 {
     auto res = lookup_path(path);
     if(!res.found_inode) {
         return FS_STATUS_FILE_NOT_FOUND;
     }
-    INode *inode = get_inode(res.inode_num);
+    u16 status = fs_write_inode(res.inode_num, buffer, offset, size);
+    fs_release_prealloc(res.inode_num);
+    return status;
+}
+
+u16 fs_truncate_inode(u32 inode_num, u64 newsize)
+{
+    INode *inode = get_inode(inode_num);
     // TODO this can be checked without looking up the inode (this data is in the direntry)
     if((inode->mode & EXT2_INODE_TYPE_REG_FILE) == 0) {
         return FS_STATUS_WRONG_FILE_TYPE;
@@ -2003,6 +3493,7 @@ u16 fs_truncate(const char *path, u64 newsize)
     if(filesize < newsize) // TODO should this fill the remaining space with zeroes?
         return FS_STATUS_BAD_ARG;
     
+    exec_cache_invalidate(inode_num);
     u64 new_blockcount = round_up_divide(newsize, g_block_size_bytes);
     u64 reserved = inode_reserved_blocks(inode);
     if(reserved > new_blockcount) {
@@ -2011,18 +3502,22 @@ u16 fs_truncate(const char *path, u64 newsize)
     }
 
     __inode_set_size(inode, newsize);
-    writeback_inode(res.inode_num);
+    writeback_inode(inode_num);
     return FS_STATUS_OK;
 }
 
-// TODO this makes fs_file_size() redundant
-FileStatResult fs_stat(const char *path)
+u16 fs_truncate(const char *path, u64 newsize)
 {
     auto res = lookup_path(path);
-    if(!res.found_inode)
-        return {};
+    if(!res.found_inode) {
+        return FS_STATUS_FILE_NOT_FOUND;
+    }
+    return fs_truncate_inode(res.inode_num, newsize);
+}
 
-    INode *inode = get_inode(res.inode_num);
+FileStatResult fs_stat_inode(u32 inode_num)
+{
+    INode *inode = get_inode(inode_num);
     u64 size = inode_size(inode);
 
     bool is_dir = inode->mode & EXT2_INODE_TYPE_DIR;
@@ -2034,6 +3529,105 @@ FileStatResult fs_stat(const char *path)
     };
 }
 
+// TODO this makes fs_file_size() redundant
+FileStatResult fs_stat(const char *path)
+{
+    auto res = lookup_path(path);
+    if(!res.found_inode)
+        return {};
+    return fs_stat_inode(res.inode_num);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// open files refer to their inode directly, so the path only has to be looked up once, in fs_open()
+// NOTE nothing stops an open file from being deleted, so every operation on an open file first checks that
+//      the inode is still allocated and that it's generation hasn't changed since the file was opened
+
+struct FileOpenResult
+{
+    u16 status = FS_STATUS_OK;
+    u32 inode_num = 0;
+    u32 generation = 0;
+};
+
+FileOpenResult fs_open(const char *path)
+{
+    auto res = lookup_path(path);
+    if(!res.found_inode)
+        return {.status = FS_STATUS_FILE_NOT_FOUND};
+
+    INode *inode = get_inode(res.inode_num);
+    if((inode->mode & EXT2_INODE_TYPE_REG_FILE) == 0)
+        return {.status = FS_STATUS_WRONG_FILE_TYPE};
+
+    return {FS_STATUS_OK, res.inode_num, inode->generation};
+}
+
+bool fs_open_file_is_valid(u32 inode_num, u32 generation)
+{
+    INode *inode = get_inode(inode_num);
+    return inode->hardlink_count > 0 && inode->generation == generation;
+}
+
+const u64 READAHEAD_MIN_BYTES = 16*KB;
+const u64 READAHEAD_MAX_BYTES = 256*KB;
+const u32 READAHEAD_MAX_BLOCKS = READAHEAD_MAX_BYTES / 1024; // with 1KB blocks, the smallest block size
+
+// when an open file is read sequentially, the blocks that come next are read into the block cache along with the
+// ones being read, with one disk command. the window doubles on every sequential read that gets past the blocks
+// that were read ahead, so reading a file front to back in small chunks costs one command per READAHEAD_MAX_BYTES
+// instead of one per chunk
+// NOTE this is synchronous, the drive only takes one request at a time, and the caller needs the first blocks of
+//      the window right away anyway
+// TODO start reading the next window asynchronously once the reader gets to the middle of the current one
+void inode_readahead(INode *inode, FileReadahead *ra, u64 offset, u64 bytes)
+{
+    u64 first_block = offset / g_block_size_bytes;
+    u64 last_block = (offset + bytes - 1) / g_block_size_bytes;
+    bool is_sequential = first_block == ra->next_block;
+    ra->next_block = (offset + bytes) / g_block_size_bytes;
+    if(!is_sequential) {
+        ra->window = 0;
+        ra->end_block = 0;
+        return;
+    }
+    // large reads already go to the disk in large commands
+    u32 max_blocks = READAHEAD_MAX_BYTES / g_block_size_bytes;
+    if(last_block - first_block + 1 >= max_blocks)
+        return;
+    if(last_block < ra->end_block)
+        return;
+
+    u32 min_blocks = max(READAHEAD_MIN_BYTES / g_block_size_bytes, (u64)1);
+    ra->window = (ra->window == 0) ? min_blocks : min(ra->window * 2, max_blocks);
+    u64 start_block = max(first_block, ra->end_block);
+    u64 end_block = max(last_block + 1, start_block + ra->window);
+    end_block = min(end_block, (u64)inode_used_blocks(inode));
+    ra->end_block = end_block;
+
+    u32 blocknums[READAHEAD_MAX_BLOCKS];
+    u64 count = end_block - start_block;
+    for(u64 i = 0; i < count; ++i)
+        blocknums[i] = inode_blocknum_at_index(inode, start_block + i);
+    block_cache_prefetch_list(blocknums, count);
+}
+
+// reads up to size bytes, returns the number of bytes read, which is 0 at the end of the file
+// pass the open file's readahead state to read ahead when the file is read sequentially
+u64 fs_read_inode(u32 inode_num, u8 *buffer, u64 offset, u64 size, FileReadahead *ra = nullptr)
+{
+    INode *inode = get_inode(inode_num);
+    u64 filesize = inode_size(inode);
+    if(offset >= filesize)
+        return 0;
+
+    u64 bytes = min(size, filesize - offset);
+    if(ra)
+        inode_readahead(inode, ra, offset, bytes);
+    inode_read(inode, buffer, offset, bytes);
+    return bytes;
+}
+
 u16 fs_mv(const char *src_path, const char *dst_path)
 {
     ASSERT(*src_path == '/');
@@ -2048,6 +3642,7 @@ u16 fs_mv(const char *src_path, const char *dst_path)
     if((type == FS_TYPE_REG_FILE) && (dst_path[dst_len-1] == '/'))
         return FS_STATUS_BAD_ARG;
 
+    // NOTE the dentry cache is kept up to date by fs_create() and fs_delete()
     fs_create(dst_path, type, res.inode_num);
     int result = fs_delete(src_path, false); // since there are 2 hardlinks to the inode, this should not delete the underlying inode
     dbg_uint(result);
@@ -16,6 +16,7 @@
 #include "kernel/physical_allocator.cpp"
 #include "kernel/vspace.cpp"
 #include "kernel/kmalloc.cpp"
+#include "kernel/pci.cpp"
 #include "kernel/ata.cpp"
 #include "kernel/ext2.cpp"
 #include "include/syscall.h"
@@ -185,6 +186,7 @@ PRange init_pmap(const PRange& aligned_usable_range, PML4T& pml4t)
         pde.bitfield.present = 1;
         pde.bitfield.writable = 1;
         pde.bitfield.page_size = 1;
+        pde.bitfield.global = 1; // ignored until init_tlb() enables global pages
         pde.set_phys_addr(page_addr);
         page_addr += 2*MB;
     }
@@ -618,6 +620,10 @@ extern "C" void kernel_main()
     PRange used_by_pmap = init_pmap(aligned_usable_range, *kernel_pml4t());
     aligned_usable_range = aligned_usable_range.subtract({used_by_pmap});
 
+    dbg_str("init tlb\n");
+    vga_print("init tlb\n");
+    init_tlb();
+
     dbg_str("init phys_pages_arr\n");
     vga_print("init phys_pages_arr\n");
     g_phys_page_allocator.init(aligned_usable_range);
@@ -767,13 +773,34 @@ extern "C" void kernel_main()
     vga_print("init ide devices\n");
     init_ide_devices();
     //u8 buffer[1024];
-    //read_sectors_pio(buffer, 2, 1);
+    //read_sectors(buffer, 2, 1);
 
     //u8 buffer2[1024];
     //for(int i = 0; i < 1024; ++i) {
     //    buffer2[i] = 0xcc;
     //}
-    //write_sectors_pio(buffer2, 2, 256);
+    //write_sectors(buffer2, 2, 256);
+// ----------------------------------------------------------------------------------------------
+// ATA DMA vs PIO throughput benchmark
+/*
+    {
+        const u16 bench_sectors = 4096; // 2MB per pass
+        const int bench_passes = 16;
+        u8 *bench_buf = (u8 *)kmalloc(bench_sectors * 512, 4096);
+        for(int mode = 0; mode < 2; ++mode) {
+            g_ata_dma_enabled = (mode == 0);
+            u64 start = rdtsc();
+            for(int i = 0; i < bench_passes; ++i)
+                read_sectors(bench_buf, bench_sectors, i * bench_sectors);
+            u64 cycles = rdtsc() - start;
+            dbg_str(g_ata_dma_enabled ? "DMA" : "PIO");
+            dbg_str(" read "); dbg_uint(bench_passes * bench_sectors * 512);
+            dbg_str(" bytes in "); dbg_uint(cycles); dbg_str(" cycles\n");
+        }
+        g_ata_dma_enabled = true;
+        kfree((vaddr)bench_buf);
+    }
+*/
 // ----------------------------------------------------------------------------------------------
     dbg_str("init ext2\n");
     vga_print("init ext2\n");
@@ -1045,6 +1072,544 @@ extern "C" void kernel_main()
     }
     UNREACHABLE();
     */
+// ----------------------------------------------------------------------------------------------
+// block cache benchmark, repeated ls/cat of the same tree should only miss on the first pass
+/*
+    {
+        const char *bench_dir = "/userspace";
+        const char *bench_file = "/boot/grub/grub.cfg";
+        for(int pass = 0; pass < 3; ++pass) {
+            g_block_cache_hits = 0;
+            g_block_cache_misses = 0;
+            u64 start = rdtsc();
+
+            int list_size = fs_list_dir_buffer_size(bench_dir);
+            char *list_buf = (char *)kmalloc(list_size, 64);
+            char *list_end = nullptr;
+            fs_list_dir(bench_dir, list_buf, list_size, &list_end);
+            kfree((vaddr)list_buf);
+
+            FileSizeResult file_size = fs_file_size(bench_file);
+            ASSERT(file_size.found_file);
+            u8 *file_buf = (u8 *)kmalloc(file_size.size, 4096);
+            fs_read(bench_file, file_buf, 0, file_size.size);
+            kfree((vaddr)file_buf);
+
+            u64 cycles = rdtsc() - start;
+            dbg_str("pass "); dbg_uint(pass); dbg_str(": "); dbg_uint(cycles); dbg_str(" cycles, ");
+            block_cache_print_stats();
+        }
+    }
+*/
+// dentry cache check, after the first lookup the exec path should resolve without any disk reads
+/*
+    {
+        for(int pass = 0; pass < 2; ++pass) {
+            u64 misses_before = g_block_cache_misses;
+            auto res = lookup_path("/userspace/stdentry");
+            ASSERT(res.found_inode);
+            dbg_str("pass "); dbg_uint(pass); dbg_str(": block cache misses: "); dbg_uint(g_block_cache_misses - misses_before); dbg_str(", ");
+            dentry_cache_print_stats();
+        }
+    }
+*/
+// metadata write-back check, growing a file by 1000 blocks should only write each touched bitmap/descriptor block once
+/*
+    {
+        u16 result = fs_create("/emptydir/bench.txt", FS_TYPE_REG_FILE);
+        ASSERT(result == FS_STATUS_OK);
+        u64 size = 1000 * 4096;
+        u8 *buf = (u8 *)kmalloc(size, 4096);
+        memset_workaround(buf, 'c', size);
+        u64 writebacks_before = g_block_cache_writebacks;
+        result = fs_write("/emptydir/bench.txt", buf, 0, size);
+        ASSERT(result == FS_STATUS_OK);
+        fs_sync();
+        dbg_str("blocks written for a 1000 block fs_write: "); dbg_uint(g_block_cache_writebacks - writebacks_before); dbg_str("\n");
+        kfree((vaddr)buf);
+        fs_delete("/emptydir/bench.txt");
+        fs_sync();
+    }
+*/
+// bitmap scan microbenchmark, allocating the last free bits of a nearly full 32768 bit (one 4KB block) bitmap
+/*
+    {
+        const u64 bitcount = 4096 * 8;
+        const u64 free_bits = 256;
+        u8 *bitmap = (u8 *)kmalloc(bitcount / 8, 4096);
+        for(int use_hint = 0; use_hint < 2; ++use_hint) {
+            memset_workaround(bitmap, 0xff, bitcount / 8);
+            for(u64 i = bitcount - free_bits; i < bitcount; ++i)
+                bitmap_unset(bitmap, i);
+
+            u64 hint = 0;
+            u64 start = rdtsc();
+            for(u64 i = 0; i < free_bits; ++i) {
+                auto res = bitmap_find_zero_and_set(bitmap, bitcount, use_hint ? hint : 0);
+                ASSERT(res.found_zero);
+                hint = res.byte_i * 8 + res.bit_i + 1;
+            }
+            u64 cycles = rdtsc() - start;
+            dbg_str(use_hint ? "with hint: " : "without hint: "); dbg_uint(cycles); dbg_str(" cycles\n");
+        }
+
+        memset_workaround(bitmap, 0xff, bitcount / 8);
+        for(u64 i = bitcount - 64; i < bitcount; ++i)
+            bitmap_unset(bitmap, i);
+        u64 start = rdtsc();
+        auto run = bitmap_find_zero_run(bitmap, bitcount, 0, 64);
+        u64 cycles = rdtsc() - start;
+        ASSERT(run.found && run.index == bitcount - 64);
+        dbg_str("64 bit run: "); dbg_uint(cycles); dbg_str(" cycles\n");
+        kfree((vaddr)bitmap);
+    }
+*/
+// copy benchmark, copies a 4MB file in 4KB chunks the way cp does, first with the path based calls (which
+// stat and look up both paths for every chunk) and then with open files, which only look up the paths once
+/*
+    {
+        const char *src = "/emptydir/bench_src.txt";
+        const char *dst = "/emptydir/bench_dst.txt";
+        const u64 size = 4*MB;
+        const u64 chunk = 4096;
+        fs_create(src, FS_TYPE_REG_FILE);
+        u8 *buf = (u8 *)kmalloc(size, 4096);
+        memset_workaround(buf, 'c', size);
+        ASSERT(fs_write(src, buf, 0, size) == FS_STATUS_OK);
+        fs_sync();
+
+        for(int use_open_files = 0; use_open_files < 2; ++use_open_files) {
+            fs_create(dst, FS_TYPE_REG_FILE);
+            u64 dentry_misses_before = g_dentry_cache_misses;
+            u64 dentry_hits_before = g_dentry_cache_hits;
+            u64 start = rdtsc();
+            if(use_open_files) {
+                auto src_file = fs_open(src);
+                auto dst_file = fs_open(dst);
+                for(u64 offset = 0; offset < size; offset += chunk) {
+                    u64 nread = fs_read_inode(src_file.inode_num, buf, offset, chunk);
+                    fs_write_inode(dst_file.inode_num, buf, offset, nread);
+                    fs_sync();
+                }
+            } else {
+                for(u64 offset = 0; offset < size; offset += chunk) {
+                    fs_stat(src);
+                    fs_read(src, buf, offset, chunk);
+                    fs_stat(dst);
+                    fs_write(dst, buf, offset, chunk);
+                    fs_sync();
+                }
+            }
+            u64 cycles = rdtsc() - start;
+            dbg_str(use_open_files ? "open files: " : "paths: "); dbg_uint(cycles);
+            dbg_str(" cycles, dentry lookups: "); dbg_uint(g_dentry_cache_hits - dentry_hits_before + g_dentry_cache_misses - dentry_misses_before);
+            dbg_str("\n");
+            fs_delete(dst);
+            fs_sync();
+        }
+
+        kfree((vaddr)buf);
+        fs_delete(src);
+        fs_sync();
+    }
+*/
+// large directory benchmark, creates 10k files in one directory and then looks each one up, bypassing the dentry
+// cache. with the directory index, each lookup only reads the index root and one leaf
+/*
+    {
+        const char *dir_path = "/emptydir/htree/";
+        const u64 file_count = 10000;
+        ASSERT(fs_create(dir_path, FS_TYPE_DIR) == FS_STATUS_OK);
+        fs_sync();
+        u32 dir_inode_num = lookup_path(dir_path).inode_num;
+        char path[64];
+        char digits[21];
+        digits[20] = 0;
+
+        u64 start = rdtsc();
+        for(u64 i = 0; i < file_count; ++i) {
+            concat(path, dir_path, uint_to_str(i, digits, 20), sizeof(path));
+            ASSERT(fs_create(path, FS_TYPE_REG_FILE) == FS_STATUS_OK);
+            fs_sync();
+        }
+        u64 cycles = rdtsc() - start;
+        dbg_str("create: "); dbg_uint(cycles / file_count); dbg_str(" cycles per file\n");
+
+        u64 misses_before = g_block_cache_misses;
+        start = rdtsc();
+        for(u64 i = 0; i < file_count; ++i) {
+            char *name = uint_to_str(i, digits, 20);
+            INode *dir = get_inode(dir_inode_num);
+            ASSERT(dir_find_entry(dir, dir_inode_num, name, strlen_workaround(name)).found);
+            fs_sync();
+        }
+        cycles = rdtsc() - start;
+        dbg_str("lookup: "); dbg_uint(cycles / file_count); dbg_str(" cycles per file, block cache misses: ");
+        dbg_uint(g_block_cache_misses - misses_before);
+        dbg_str(", directory blocks: "); dbg_uint(inode_used_blocks(get_inode(dir_inode_num))); dbg_str("\n");
+
+        for(u64 i = 0; i < file_count; ++i) {
+            concat(path, dir_path, uint_to_str(i, digits, 20), sizeof(path));
+            fs_delete(path);
+            fs_sync();
+        }
+        fs_delete(dir_path);
+        fs_sync();
+    }
+*/
+// readahead benchmark, copies a 16MB file (4x the 4MB block cache, so nothing stays cached between passes) in 4KB
+// chunks the way cp does, first without and then with sequential readahead
+/*
+    {
+        const char *src = "/emptydir/bench_src.txt";
+        const char *dst = "/emptydir/bench_dst.txt";
+        const u64 size = 16*MB;
+        const u64 chunk = 4096;
+        fs_create(src, FS_TYPE_REG_FILE);
+        u8 *buf = (u8 *)kmalloc(size, 4096);
+        memset_workaround(buf, 'c', size);
+        ASSERT(fs_write(src, buf, 0, size) == FS_STATUS_OK);
+        fs_sync();
+        kfree((vaddr)buf);
+        buf = (u8 *)kmalloc(chunk, 4096);
+
+        u32 src_inode_num = fs_open(src).inode_num;
+        for(int use_readahead = 0; use_readahead < 2; ++use_readahead) {
+            fs_create(dst, FS_TYPE_REG_FILE);
+            u32 dst_inode_num = fs_open(dst).inode_num;
+            FileReadahead readahead = {};
+            u64 read_commands_before = g_block_cache_read_commands;
+            u64 start = rdtsc();
+            for(u64 offset = 0; offset < size; offset += chunk) {
+                u64 nread = fs_read_inode(src_inode_num, buf, offset, chunk, use_readahead ? &readahead : nullptr);
+                fs_write_inode(dst_inode_num, buf, offset, nread);
+                fs_sync();
+            }
+            u64 cycles = rdtsc() - start;
+            dbg_str(use_readahead ? "readahead: " : "no readahead: "); dbg_uint(cycles);
+            dbg_str(" cycles, read commands: "); dbg_uint(g_block_cache_read_commands - read_commands_before);
+            dbg_str("\n");
+            fs_delete(dst);
+            fs_sync();
+        }
+
+        kfree((vaddr)buf);
+        fs_delete(src);
+        fs_sync();
+    }
+*/
+// in-kernel copy benchmark, copies a 16MB file with a 4KB read/write loop (like cp did before sys_fs_copy_fd())
+// and then with fs_copy_inode() in 4MB chunks, syncing after each syscall sized step
+/*
+    {
+        const char *src = "/emptydir/bench_src.txt";
+        const char *dst = "/emptydir/bench_dst.txt";
+        const u64 size = 16*MB;
+        const u64 chunk = 4096;
+        const u64 copy_chunk = 4*MB;
+        fs_create(src, FS_TYPE_REG_FILE);
+        u8 *buf = (u8 *)kmalloc(size, 4096);
+        memset_workaround(buf, 'c', size);
+        ASSERT(fs_write(src, buf, 0, size) == FS_STATUS_OK);
+        fs_sync();
+        kfree((vaddr)buf);
+        buf = (u8 *)kmalloc(chunk, 4096);
+
+        u32 src_inode_num = fs_open(src).inode_num;
+        for(int use_copy = 0; use_copy < 2; ++use_copy) {
+            fs_create(dst, FS_TYPE_REG_FILE);
+            u32 dst_inode_num = fs_open(dst).inode_num;
+            u64 read_commands_before = g_block_cache_read_commands;
+            u64 write_commands_before = g_block_cache_write_commands;
+            u64 start = rdtsc();
+            if(use_copy) {
+                for(u64 offset = 0; offset < size; offset += copy_chunk) {
+                    ASSERT(fs_copy_inode(src_inode_num, offset, dst_inode_num, offset, copy_chunk).status == FS_STATUS_OK);
+                    fs_sync();
+                }
+            } else {
+                for(u64 offset = 0; offset < size; offset += chunk) {
+                    u64 nread = fs_read_inode(src_inode_num, buf, offset, chunk);
+                    fs_write_inode(dst_inode_num, buf, offset, nread);
+                    fs_sync();
+                }
+            }
+            u64 cycles = rdtsc() - start;
+            dbg_str(use_copy ? "fs_copy_inode: " : "read/write loop: "); dbg_uint(cycles);
+            dbg_str(" cycles, read commands: "); dbg_uint(g_block_cache_read_commands - read_commands_before);
+            dbg_str(" write commands: "); dbg_uint(g_block_cache_write_commands - write_commands_before);
+            dbg_str("\n");
+            fs_delete(dst);
+            fs_sync();
+        }
+
+        kfree((vaddr)buf);
+        fs_delete(src);
+        fs_sync();
+    }
+*/
+// exec image cache benchmark, the first instantiation loads the image from the file, the later ones only copy the
+// writable pages
+/*
+    {
+        for(int pass = 0; pass < 3; ++pass) {
+            u64 read_commands_before = g_block_cache_read_commands;
+            u64 start = rdtsc();
+            u64 entry = 0;
+            VObject *vobj = instantiate_exec_image("/userspace/stdentry", &entry);
+            u64 cycles = rdtsc() - start;
+            dbg_str("pass "); dbg_uint(pass); dbg_str(": "); dbg_uint(cycles);
+            dbg_str(" cycles, read commands: "); dbg_uint(g_block_cache_read_commands - read_commands_before);
+            dbg_str(", ");
+            exec_cache_print_stats();
+            vobj->~VObject();
+            kfree((vaddr)vobj);
+        }
+    }
+*/
+// demand paging benchmark, measures the startup of a large program (8MB of code, see userspace/bigexec.cpp) up to
+// its' first instruction, first demand paged and then with every page read in up front like exec used to do
+/*
+    {
+        const char *bench_path = "/userspace/bigexec";
+        auto res = fs_open(bench_path);
+        ASSERT(res.status == FS_STATUS_OK);
+        for(int pass = 0; pass < 2; ++pass) {
+            bool read_everything = pass == 1;
+            exec_cache_invalidate(res.inode_num);
+            u64 read_commands_before = g_block_cache_read_commands;
+            u64 pages_read_before = g_exec_cache_pages_read;
+            u64 start = rdtsc();
+
+            u64 entry = 0;
+            VObject *vobj = instantiate_exec_image(bench_path, &entry);
+            for(u64 page_i = 0; page_i < vobj->underlying_pages.length; ++page_i) {
+                bool is_touched = read_everything || page_i == entry / 4096;
+                if(is_touched && !vobj->underlying_pages[page_i])
+                    vobj->fill_page(page_i);
+            }
+
+            u64 cycles = rdtsc() - start;
+            dbg_str(read_everything ? "read everything: " : "demand paged: "); dbg_uint(cycles);
+            dbg_str(" cycles, read commands: "); dbg_uint(g_block_cache_read_commands - read_commands_before);
+            dbg_str(" pages read: "); dbg_uint(g_exec_cache_pages_read - pages_read_before);
+            dbg_str("\n");
+            vobj->~VObject();
+            kfree((vaddr)vobj);
+        }
+    }
+*/
+// zeroed page pool benchmark, kmalloc and exec image instantiation latency with the pool filled up (like it would be
+// after the cpu was idle for a while) and with every page zeroed when it's allocated
+/*
+    {
+        const u32 alloc_count = 256;
+        vaddr ptrs[alloc_count];
+        for(int pass = 0; pass < 2; ++pass) {
+            bool use_pool = pass == 0;
+            g_phys_page_allocator.m_use_zeroed_pool = use_pool;
+
+            while(refill_zeroed_page_pool(ZEROED_POOL_SIZE)) {}
+            g_phys_page_allocator.m_zeroed_pool_hits = 0;
+            g_phys_page_allocator.m_zeroed_pool_misses = 0;
+            u64 start = rdtsc();
+            for(u32 i = 0; i < alloc_count; ++i)
+                ptrs[i] = kmalloc(4096, 4096);
+            u64 kmalloc_cycles = rdtsc() - start;
+            for(u32 i = 0; i < alloc_count; ++i)
+                kfree(ptrs[i]);
+
+            while(refill_zeroed_page_pool(ZEROED_POOL_SIZE)) {}
+            u64 entry = 0;
+            start = rdtsc();
+            VObject *vobj = instantiate_exec_image("/userspace/stdentry", &entry);
+            for(u64 page_i = 0; page_i < vobj->underlying_pages.length; ++page_i)
+                if(!vobj->underlying_pages[page_i])
+                    vobj->fill_page(page_i);
+            u64 exec_cycles = rdtsc() - start;
+            vobj->~VObject();
+            kfree((vaddr)vobj);
+
+            dbg_str(use_pool ? "zeroed pool: " : "no pool: ");
+            dbg_str("kmalloc "); dbg_uint(kmalloc_cycles / alloc_count);
+            dbg_str(" cycles, exec "); dbg_uint(exec_cycles);
+            dbg_str(" cycles, pool hits: "); dbg_uint(g_phys_page_allocator.m_zeroed_pool_hits);
+            dbg_str(" misses: "); dbg_uint(g_phys_page_allocator.m_zeroed_pool_misses);
+            dbg_str("\n");
+        }
+        g_phys_page_allocator.m_use_zeroed_pool = true;
+    }
+*/
+// slab benchmark, kmalloc/kfree latency and physical pages used for small objects, from the slab allocator and
+// from the kernel vspace (a vrange and a buffer page per object, like every kmalloc used to be)
+/*
+    {
+        const u32 alloc_count = 512;
+        const u64 sizes[] = {16, 64, 256, 1024};
+        vaddr ptrs[alloc_count];
+        g_phys_page_allocator.m_use_zeroed_pool = false;
+        for(u64 size : sizes) {
+            for(int pass = 0; pass < 2; ++pass) {
+                bool use_slab = pass == 0;
+                u64 free_pages_before = g_phys_page_allocator.count_freelist_entries();
+                u64 start = rdtsc();
+                for(u32 i = 0; i < alloc_count; ++i)
+                    ptrs[i] = use_slab ? kmalloc(size, 8) : g_kernel_vspace.allocate_size(size, 8);
+                u64 alloc_cycles = rdtsc() - start;
+                u64 pages_used = free_pages_before - g_phys_page_allocator.count_freelist_entries();
+                start = rdtsc();
+                for(u32 i = 0; i < alloc_count; ++i) {
+                    if(use_slab)
+                        kfree(ptrs[i]);
+                    else
+                        g_kernel_vspace.free_size(ptrs[i]);
+                }
+                u64 free_cycles = rdtsc() - start;
+
+                dbg_str(use_slab ? "slab, size " : "vspace, size "); dbg_uint(size);
+                dbg_str(": kmalloc "); dbg_uint(alloc_cycles / alloc_count);
+                dbg_str(" cycles, kfree "); dbg_uint(free_cycles / alloc_count);
+                dbg_str(" cycles, pages used: "); dbg_uint(pages_used);
+                dbg_str("\n");
+            }
+        }
+        g_phys_page_allocator.m_use_zeroed_pool = true;
+        slab_print_stats();
+    }
+*/
+// vrange allocator fragmentation benchmark, takes ranges with the sizes of the kmalloc() test above and frees every
+// other one so none of them can coalesce, then measures take_range()/return_range() with that many free ranges
+// around (the allocator is used directly, so the cost of mapping the ranges isn't included)
+/*
+    {
+        AllocList& allocator = g_kernel_vspace.m_vrange_allocator;
+        const u32 range_count = 4096;
+        const u64 sizes[] = {23464, 1111111, 9*MB, 4*KB, 101, 898989, 55555, 51, 73, 7*MB};
+        const u32 size_count = sizeof(sizes) / sizeof(sizes[0]);
+        static VRange ranges[range_count];
+        u64 start_free_space = allocator.get_free_space();
+        u64 start_free_ranges = allocator.get_free_range_count();
+
+        for(u32 i = 0; i < range_count; ++i)
+            ranges[i] = allocator.take_range(round_up_align(sizes[i % size_count], 4096), (u64)4096 << (i % 3));
+        for(u32 i = 0; i < range_count; i += 2)
+            allocator.return_range(ranges[i]);
+        u64 fragmented_free_ranges = allocator.get_free_range_count();
+
+        // refill the holes with a different mix of sizes
+        u64 start = rdtsc();
+        for(u32 i = 0; i < range_count; i += 2)
+            ranges[i] = allocator.take_range(round_up_align(sizes[(i/2 + 3) % size_count], 4096), 4096);
+        u64 take_cycles = rdtsc() - start;
+        start = rdtsc();
+        for(u32 i = 0; i < range_count; ++i)
+            allocator.return_range(ranges[i]);
+        u64 return_cycles = rdtsc() - start;
+
+        dbg_str("free ranges: "); dbg_uint(fragmented_free_ranges);
+        dbg_str(", take_range "); dbg_uint(take_cycles / (range_count / 2));
+        dbg_str(" cycles, return_range "); dbg_uint(return_cycles / range_count);
+        dbg_str(" cycles\n");
+        ASSERT(allocator.get_free_space() == start_free_space);
+        ASSERT(allocator.get_free_range_count() == start_free_ranges);
+    }
+*/
+// map_vrange/unmap_vrange benchmark, cycles per page to map & unmap a process stack sized range and an 8MB range
+// (like a large executable image) in the kernel vspace
+/*
+    {
+        const u64 sizes[] = {Process::DEFAULT_STACK_SIZE, 8*MB};
+        for(u64 size : sizes) {
+            const u32 iterations = 16;
+            u64 map_cycles = 0;
+            u64 unmap_cycles = 0;
+            for(u32 i = 0; i < iterations; ++i) {
+                VRange vrange = g_kernel_vspace.m_vrange_allocator.take_range(size, 4096);
+                u64 start = rdtsc();
+                map_vrange(vrange, g_kernel_vspace.m_pml4t);
+                map_cycles += rdtsc() - start;
+                start = rdtsc();
+                unmap_vrange(vrange, g_kernel_vspace.m_pml4t);
+                unmap_cycles += rdtsc() - start;
+                g_kernel_vspace.m_vrange_allocator.return_range(vrange);
+            }
+            flush_tlb_all(); // the kernel mappings are global, so reload_cr3() doesn't flush them
+            u64 pages = iterations * (size / 4096);
+            dbg_str("size "); dbg_uint(size);
+            dbg_str(": map "); dbg_uint(map_cycles / pages);
+            dbg_str(" cycles/page, unmap "); dbg_uint(unmap_cycles / pages);
+            dbg_str(" cycles/page\n");
+        }
+    }
+*/
+// TLB flush benchmark, cycles per kmalloc/kfree of a buffer too big for the slab allocator, and cycles to then read
+// a byte from each page of a 1MB buffer, which misses the TLB on every page if kfree() flushed the whole TLB
+/*
+    {
+        const u64 working_set_size = 1*MB;
+        u8 *working_set = (u8 *)kmalloc(working_set_size, 4096);
+        const u32 iterations = 256;
+        u64 alloc_cycles = 0;
+        u64 touch_cycles = 0;
+        u64 sum = 0;
+        for(u32 i = 0; i < iterations; ++i) {
+            u64 start = rdtsc();
+            vaddr buffer = kmalloc(16*KB, 4096);
+            *(u8 *)buffer = 1;
+            kfree(buffer);
+            alloc_cycles += rdtsc() - start;
+
+            start = rdtsc();
+            for(u64 offset = 0; offset < working_set_size; offset += 4096)
+                sum += working_set[offset];
+            touch_cycles += rdtsc() - start;
+        }
+        kfree((vaddr)working_set);
+        dbg_str("kmalloc/kfree "); dbg_uint(alloc_cycles / iterations);
+        dbg_str(" cycles, reading the 1MB buffer "); dbg_uint(touch_cycles / iterations);
+        dbg_str(" cycles (sum "); dbg_uint(sum); dbg_str(")\n");
+    }
+*/
+// fork benchmark, cycles to share a 4MB heap copy on write with a child (what sys_fork() does for each of the parent's
+// VObjects) and then to modify some of its' pages in the parent, copy_page_on_write() is called directly since
+// kernel_main has no process to take the page faults
+/*
+    {
+        const u64 heap_size = 4*MB;
+        const u64 modified_page_counts[] = {0, 1, 16, 128, 1024};
+        for(u64 modified_pages : modified_page_counts) {
+            VObject *parent = (VObject *)kmalloc(sizeof(VObject), alignof(VObject));
+            new ((void *)parent) VObject(heap_size, 4096);
+            u8 *parent_heap = (u8 *)parent->map(g_kernel_vspace);
+            for(u64 offset = 0; offset < heap_size; offset += 4096)
+                parent_heap[offset] = 1;
+
+            u64 start = rdtsc();
+            VObject *child = parent->clone_copy_on_write();
+            child->map(g_kernel_vspace);
+            u64 fork_cycles = rdtsc() - start;
+
+            start = rdtsc();
+            for(u64 page_i = 0; page_i < modified_pages; ++page_i) {
+                parent->copy_page_on_write(page_i);
+                parent_heap[page_i * 4096] = 2;
+            }
+            u64 write_cycles = rdtsc() - start;
+
+            child->unmap(g_kernel_vspace);
+            child->~VObject();
+            kfree((vaddr)child);
+            parent->unmap(g_kernel_vspace);
+            parent->~VObject();
+            kfree((vaddr)parent);
+
+            dbg_str("modified pages "); dbg_uint(modified_pages);
+            dbg_str(": fork "); dbg_uint(fork_cycles);
+            dbg_str(" cycles, writes "); dbg_uint(write_cycles);
+            dbg_str(" cycles\n");
+        }
+    }
+*/
 // ----------------------------------------------------------------------------------------------
     dbg_str("init interrupt stack\n");
     vga_print("init interrupt stack\n");
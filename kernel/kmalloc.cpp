@@ -1,12 +1,16 @@
 #pragma once
 #include "kernel/kmalloc.h"
 #include "kernel/vspace.h"
+#include "kernel/slab.cpp"
 
 extern VSpace g_kernel_vspace;
 
+// small allocations come from the slab allocator, everything else gets its' own vrange in the kernel vspace
 vaddr kmalloc(u64 size, u64 alignment)
 {
     dbg_str("KMALLOC, SIZE: "); dbg_uint(size); dbg_str(" ALIGN: "); dbg_uint(alignment); dbg_str("\n");
+    if(size <= SLAB_MAX_OBJECT_SIZE && alignment <= SLAB_MAX_OBJECT_SIZE)
+        return slab_alloc(max(size, alignment));
     auto addr = g_kernel_vspace.allocate_size(size, alignment);
     return addr;
 }
@@ -14,5 +18,9 @@ vaddr kmalloc(u64 size, u64 alignment)
 void kfree(vaddr ptr)
 {
     dbg_str("KFREE, PTR: "); dbg_uint(ptr); dbg_str("\n");
+    if(is_slab_object(ptr)) {
+        slab_free(ptr);
+        return;
+    }
     g_kernel_vspace.free_size(ptr);
 }
@@ -160,7 +160,65 @@ bool PT::is_empty()
 
 PML4T *current_pml4t()
 {
-    return (PML4T *)read_cr3();
+    return (PML4T *)(read_cr3() & ~CR3_PCID_MASK);
+}
+
+// -------------------------------------------------
+// the kernel's mappings (the pmap and the kernel vspace, all under PML4 entry 0, which every vspace shares) are marked
+// global, so they stay in the TLB when cr3 is written. with PCIDs, each vspace's TLB entries are also tagged with its'
+// PCID, so loading a vspace doesn't flush the entries of the others (see VSpace::cr3_to_load())
+// NOTE entries that weren't present aren't cached, so only changing or removing a mapping needs a TLB flush
+// resource: Intel SDM Vol 3A, section 4.10
+bool g_tlb_has_global_pages = false;
+bool g_tlb_has_pcids = false;
+
+// changes to more pages than this flush the whole TLB instead of doing an invlpg per page
+const u64 TLB_INVLPG_MAX_PAGES = 32;
+
+const u32 CPUID_1_EDX_PGE = (u32)1 << 13;
+const u32 CPUID_1_ECX_PCID = (u32)1 << 17;
+
+// NOTE PCIDs are only used along with global pages, so flush_tlb_all() can always flush every PCID by toggling PGE
+//      cr4.PCIDE can only be set while the PCID in cr3 is 0, which is the kernel vspace's
+void init_tlb()
+{
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    u64 cr4 = read_cr4();
+    if(edx & CPUID_1_EDX_PGE) {
+        g_tlb_has_global_pages = true;
+        cr4 |= CR4_PGE;
+        if(ecx & CPUID_1_ECX_PCID) {
+            g_tlb_has_pcids = true;
+            cr4 |= CR4_PCIDE;
+        }
+    }
+    write_cr4(cr4);
+    dbg_str("global pages: "); dbg_uint(g_tlb_has_global_pages);
+    dbg_str(" pcids: "); dbg_uint(g_tlb_has_pcids); dbg_str("\n");
+}
+
+bool is_global_vaddr(vaddr addr)
+{
+    return addr < USER_VSPACE_START;
+}
+
+void flush_tlb_pages(VRange vrange)
+{
+    for(u64 addr = vrange.addr; addr < vrange.one_past_end(); addr += 4096)
+        invlpg(addr);
+}
+
+// flushes every TLB entry of every PCID, including the global ones
+void flush_tlb_all()
+{
+    if(g_tlb_has_global_pages) {
+        u64 cr4 = read_cr4();
+        write_cr4(cr4 & ~CR4_PGE);
+        write_cr4(cr4);
+    } else {
+        reload_cr3();
+    }
 }
 // -------------------------------------------------
 // TODO this should go with the page table code
@@ -168,146 +226,151 @@ PML4T *current_pml4t()
 // TODO in future the following features will likely need to be added:
 //      - map a vrange to a specific (non-contiguous) set of physical pages (this will require ref counting pages)
 
-// TODO map_vrange and unmap_vrange functions could easily be a performance bottleneck, can probably be sped up by
-//      reducing branching and iterating each table (4kb page) in one go, removing some
-//      of the redundant indexing that happens since the upper tables are indexed each time
-//      through the loop, even though those tables change infrequently. Can also batch all phys_page_allocations
-//      into one go
-//      can also probably be optimized by using 128 bit, 256 bit, 512 bit registers if available, page table
-//      entries are 64 bits large, so multiple can be put in one register and then masked to see if they
-//      are present or not
+// the map/unmap functions below walk the tables one page table (2MB of vspace) at a time, the upper tables are only
+// indexed once per page table, and the PTEs of each page table are filled or cleared in one loop
+const u64 PT_SPAN = (u64)PT::entry_count * 4096;
+
+// the end of the part of [addr, one_past_end) that is mapped by the same page table as addr
+u64 pt_chunk_end(u64 addr, u64 one_past_end)
+{
+    return min(round_down_align(addr, PT_SPAN) + PT_SPAN, one_past_end);
+}
+
+// returns the table the entry points to, a new empty table is allocated if the entry isn't present
+template<typename Table, typename Entry>
+Table& table_or_new(Entry& entry)
+{
+    if(!entry.bitfield.present) {
+        u64 new_page = alloc_phys_page_unzeroed();
+        *(Table *)new_page = Table{};
+
+        entry.clear();
+        entry.bitfield.present = 1;
+        entry.bitfield.writable = 1;
+        entry.set_phys_addr(new_page);
+    }
+    return *(Table *)entry.get_phys_addr();
+}
+
+// returns the page table that maps addr, the tables above it are allocated if they aren't present
+PT& pt_or_new(PML4T& pml4t, u64 addr)
+{
+    PDPT& pdpt = table_or_new<PDPT>(pml4t[pml4t_index(addr)]);
+    PD& pd = table_or_new<PD>(pdpt[pdpt_index(addr)]);
+    return table_or_new<PT>(pd[pd_index(addr)]);
+}
+
+// returns the page table that maps addr, or nullptr if it (or any table above it) isn't present
+PT *pt_if_present(PML4T& pml4t, u64 addr)
+{
+    PML4TE& pml4te = pml4t[pml4t_index(addr)];
+    if(!pml4te.bitfield.present)
+        return nullptr;
+    PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
+    PDPTE& pdpte = pdpt[pdpt_index(addr)];
+    if(!pdpte.bitfield.present)
+        return nullptr;
+    PD& pd = *(PD *)pdpte.get_phys_addr();
+    PDE& pde = pd[pd_index(addr)];
+    if(!pde.bitfield.present)
+        return nullptr;
+    return (PT *)pde.get_phys_addr();
+}
+
+// frees the page table that maps addr if it's empty, and then the tables above it that become empty
+// returns true if any table was freed
+// TODO is_empty() iterates over all entries in the table, but this is only done once per page table now
+bool free_empty_tables(PML4T& pml4t, u64 addr)
+{
+    PML4TE& pml4te = pml4t[pml4t_index(addr)];
+    PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
+    PDPTE& pdpte = pdpt[pdpt_index(addr)];
+    PD& pd = *(PD *)pdpte.get_phys_addr();
+    PDE& pde = pd[pd_index(addr)];
+    PT& pt = *(PT *)pde.get_phys_addr();
+
+    if(!pt.is_empty())
+        return false;
+    free_phys_page(pde.get_phys_addr());
+    pde.clear();
+    if(!pd.is_empty())
+        return true;
+    free_phys_page(pdpte.get_phys_addr());
+    pdpte.clear();
+    if(!pdpt.is_empty())
+        return true;
+    free_phys_page(pml4te.get_phys_addr());
+    pml4te.clear();
+    return true;
+}
 
 void map_vrange(VRange vrange, PML4T *pml4t_to_map)
 {
     ASSERT(vrange.addr >= KERNEL_VSPACE_START);
     dbg_str("map_vrange()\n");
     dbg_str("vrange.addr: "); dbg_uint(vrange.addr); dbg_str(" vrange.length: "); dbg_uint(vrange.length); dbg_str("\n");
-    // TODO cleanup this code
-    u64 vaddr = vrange.addr;
+    u64 addr = vrange.addr;
     u64 one_past_end = vrange.one_past_end();
     PML4T& pml4t = *pml4t_to_map;
-    while(vaddr < one_past_end) {
-        dbg_str("vaddr: "); dbg_uint(vaddr); dbg_str("\n");
-
-        u64 pml4t_i = pml4t_index(vaddr);
-        PML4TE& pml4te = pml4t[pml4t_i];
-        if(!pml4te.bitfield.present) {
-            u64 new_page = alloc_phys_page();
-            *(PDPT *)new_page = PDPT{};
-
-            pml4te.clear();
-            pml4te.bitfield.present = 1;
-            pml4te.bitfield.writable = 1;
-            pml4te.set_phys_addr(new_page);
-        }
-
-        PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
-        u64 pdpt_i = pdpt_index(vaddr);
-        PDPTE& pdpte = pdpt[pdpt_i];
-        if(!pdpte.bitfield.present) {
-            u64 new_page = alloc_phys_page();
-            *(PD *)new_page = PD{};
-
-            pdpte.clear();
-            pdpte.bitfield.present = 1;
-            pdpte.bitfield.writable = 1;
-            pdpte.set_phys_addr(new_page);
-        }
+    bool is_global = is_global_vaddr(addr); // the vrange can't straddle the kernel and user vspaces
+    // the pages are allocated in the largest physically contiguous runs available, so a DMA transfer to the buffer
+    // needs fewer PRD entries (see IDEDevice::build_prdt()), and the physical allocator is called once per run
+    paddr run = 0;
+    u64 run_pages_left = 0;
+    while(addr < one_past_end) {
+        PT& pt = pt_or_new(pml4t, addr);
+        u64 chunk_end = pt_chunk_end(addr, one_past_end);
+        for(u64 pt_i = pt_index(addr); addr < chunk_end; ++pt_i, addr += 4096) {
+            PTE& pte = pt[pt_i];
+            ASSERT(!pte.bitfield.present); // this means the phys_page has already been mapped! something is wrong with vspace allocator
+            if(run_pages_left == 0) {
+                u32 order = 0;
+                run = alloc_phys_run(phys_run_order((one_past_end - addr) / 4096), &order);
+                run_pages_left = (u64)1 << order;
+            }
 
-        PD& pd = *(PD *)pdpte.get_phys_addr();
-        u64 pd_i = pd_index(vaddr);
-        PDE& pde = pd[pd_i];
-        if(!pde.bitfield.present) {
-            u64 new_page = alloc_phys_page();
-            // TODO is __builtin_memset faster than this?
-            *(PT *)new_page = PT{};
-
-            pde.clear();
-            pde.bitfield.present = 1;
-            pde.bitfield.writable = 1;
-            pde.set_phys_addr(new_page);
-            dbg_str("map_in 1\n");
+            pte.clear();
+            pte.bitfield.present = 1;
+            pte.bitfield.writable = 1;
+            pte.bitfield.global = is_global;
+            pte.set_phys_addr(run);
+            run += 4096;
+            --run_pages_left;
         }
-
-        PT& pt = *(PT *)pde.get_phys_addr();
-        u64 pt_i = pt_index(vaddr);
-        PTE& pte = pt[pt_i];
-
-        ASSERT(!pte.bitfield.present); // this means the phys_page has already been mapped! something is wrong with vspace allocator
-        u64 new_page = alloc_phys_page();
-
-        pte.clear();
-        pte.bitfield.present = 1;
-        pte.bitfield.writable = 1;
-        pte.set_phys_addr(new_page);
-
-        vaddr += 4096;
     }
-    ASSERT(vaddr == one_past_end);
+    ASSERT(addr == one_past_end);
+    ASSERT(run_pages_left == 0);
 }
 
-// TODO this doesn't check if the next table is present or not before traversing it
-void unmap_vrange(VRange vrange, PML4T *pml4t_to_unmap)
+// returns true if any page tables were freed, see VSpace::flush_tlb()
+bool unmap_vrange(VRange vrange, PML4T *pml4t_to_unmap)
 {
     ASSERT(vrange.addr >= KERNEL_VSPACE_START);
     dbg_str("unmap_vrange()\n");
     dbg_str("vrage.addr: "); dbg_uint(vrange.addr); dbg_str(" vrange.length: "); dbg_uint(vrange.length); dbg_str("\n");
-    // TODO cleanup this code
-    u64 vaddr = vrange.addr;
+    u64 addr = vrange.addr;
     u64 one_past_end = vrange.one_past_end();
     PML4T& pml4t = *pml4t_to_unmap;
-    while(vaddr < one_past_end) {
-        dbg_str("vaddr: "); dbg_uint(vaddr); dbg_str("\n");
-
-        u64 pml4t_i = pml4t_index(vaddr);
-        PML4TE& pml4te = pml4t[pml4t_i];
-        ASSERT(pml4te.bitfield.present);
-
-        PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
-        u64 pdpt_i = pdpt_index(vaddr);
-        PDPTE& pdpte = pdpt[pdpt_i];
-        ASSERT(pdpte.bitfield.present);
-
-        PD& pd = *(PD *)pdpte.get_phys_addr();
-        u64 pd_i = pd_index(vaddr);
-        PDE& pde = pd[pd_i];
-        ASSERT(pde.bitfield.present);
-
-        PT& pt = *(PT *)pde.get_phys_addr();
-        u64 pt_i = pt_index(vaddr);
-        PTE& pte = pt[pt_i];
-        ASSERT(pte.bitfield.present);
-
-        free_phys_page((paddr)pte.get_phys_addr());
-        pte.clear();
-
-        vaddr += 4096;
-
-        // TODO is_empty() iterates over all entries in the page table
-        //      there are surely more efficient ways of doing this?
-        //      also see the comments in struct PT for possible ways to
-        //      speed up is_empty()
-        if(pt.is_empty()) {
-            dbg_str("is_empty() 1\n");
-            free_phys_page(pde.get_phys_addr());
-            pde.clear();
-        }
-        if(pd.is_empty()) {
-            dbg_str("is_empty() 2\n");
-            free_phys_page(pdpte.get_phys_addr());
-            pdpte.clear();
-        }
-        if(pdpt.is_empty()) {
-            dbg_str("is_empty() 3\n");
-            free_phys_page(pml4te.get_phys_addr());
-            pml4te.clear();
+    bool tables_freed = false;
+    while(addr < one_past_end) {
+        u64 chunk_start = addr;
+        PT *pt = pt_if_present(pml4t, addr);
+        ASSERT(pt);
+        u64 chunk_end = pt_chunk_end(addr, one_past_end);
+        for(u64 pt_i = pt_index(addr); addr < chunk_end; ++pt_i, addr += 4096) {
+            PTE& pte = (*pt)[pt_i];
+            ASSERT(pte.bitfield.present);
+            free_phys_page((paddr)pte.get_phys_addr());
+            pte.clear();
         }
+        tables_freed |= free_empty_tables(pml4t, chunk_start);
     }
-    ASSERT(vaddr == one_past_end);
+    ASSERT(addr == one_past_end);
+    return tables_freed;
 }
 
-// TODO this currently does not reference count pages, so there is room for error here if this is called
-//      when there are pages shared between multiple vspaces
+// NOTE physical pages are reference counted, so the pages that are still mapped are only freed if this was the last
+//      vspace using them
 void free_page_tables(PML4T *pml4t_addr)
 {
     dbg_str("free_page_tables()\n");
@@ -364,142 +427,151 @@ void free_page_tables(PML4T *pml4t_addr)
 }
 
 // --------------------------------------------------------------------------------------------------------
-// TODO this is almost identical to the map_vrange and unmap_vrange above except using a Vector of page addresses
-//      instead of allocating the pages on demand, coalesce both into one pair of functions (or at least make a common
-//      iterator over page tables)
+// like map_vrange() and unmap_vrange() above, but with the physical pages given instead of allocated (and freed) here
+// pages that haven't been allocated yet (0 entries) are left unmapped, see VObject::fill_page(), and no page table
+// is allocated for a chunk that only has unallocated pages in it
 void map_vrange(VRange vrange, PML4T *pml4t_to_map, const Vector<paddr>& pages_to_map)
 {
     ASSERT(vrange.addr >= KERNEL_VSPACE_START);
     dbg_str("map_vrange()\n");
     dbg_str("vrange.addr: "); dbg_uint(vrange.addr); dbg_str(" vrange.length: "); dbg_uint(vrange.length); dbg_str("\n");
-    // TODO cleanup this code
-    u64 vaddr = vrange.addr;
+    u64 addr = vrange.addr;
     u64 one_past_end = vrange.one_past_end();
     PML4T& pml4t = *pml4t_to_map;
+    bool is_global = is_global_vaddr(addr);
     u32 phys_page_index = 0;
-    while(vaddr < one_past_end) {
-        dbg_str("vaddr: "); dbg_uint(vaddr); dbg_str("\n");
-
-        u64 pml4t_i = pml4t_index(vaddr);
-        PML4TE& pml4te = pml4t[pml4t_i];
-        if(!pml4te.bitfield.present) {
-            u64 new_page = alloc_phys_page();
-            *(PDPT *)new_page = PDPT();
-
-            pml4te.clear();
-            pml4te.bitfield.present = 1;
-            pml4te.bitfield.writable = 1;
-            pml4te.set_phys_addr(new_page);
-        }
-
-        PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
-        u64 pdpt_i = pdpt_index(vaddr);
-        PDPTE& pdpte = pdpt[pdpt_i];
-        if(!pdpte.bitfield.present) {
-            u64 new_page = alloc_phys_page();
-            *(PD *)new_page = PD();
-
-            pdpte.clear();
-            pdpte.bitfield.present = 1;
-            pdpte.bitfield.writable = 1;
-            pdpte.set_phys_addr(new_page);
-        }
-
-        PD& pd = *(PD *)pdpte.get_phys_addr();
-        u64 pd_i = pd_index(vaddr);
-        PDE& pde = pd[pd_i];
-        if(!pde.bitfield.present) {
-            u64 new_page = alloc_phys_page();
-            // TODO is __builtin_memset faster than this?
-            *(PT *)new_page = PT();
-
-            pde.clear();
-            pde.bitfield.present = 1;
-            pde.bitfield.writable = 1;
-            pde.set_phys_addr(new_page);
-            dbg_str("map_in 1\n");
+    while(addr < one_past_end) {
+        PT *pt = nullptr;
+        u64 chunk_end = pt_chunk_end(addr, one_past_end);
+        for(u64 pt_i = pt_index(addr); addr < chunk_end; ++pt_i, addr += 4096) {
+            paddr page = pages_to_map[phys_page_index++];
+            if(page == 0)
+                continue;
+            if(!pt)
+                pt = &pt_or_new(pml4t, addr);
+
+            PTE& pte = (*pt)[pt_i];
+            ASSERT(!pte.bitfield.present); // this means the phys_page has already been mapped! something is wrong with vspace allocator
+            pte.clear();
+            pte.bitfield.present = 1;
+            pte.bitfield.writable = 1;
+            pte.bitfield.global = is_global;
+            pte.set_phys_addr(page);
         }
-
-        PT& pt = *(PT *)pde.get_phys_addr();
-        u64 pt_i = pt_index(vaddr);
-        PTE& pte = pt[pt_i];
-
-        ASSERT(!pte.bitfield.present); // this means the phys_page has already been mapped! something is wrong with vspace allocator
-        u64 new_page = (u64)pages_to_map[phys_page_index++];
-
-        pte.clear();
-        pte.bitfield.present = 1;
-        pte.bitfield.writable = 1;
-        pte.set_phys_addr(new_page);
-
-        vaddr += 4096;
     }
-    ASSERT(vaddr == one_past_end);
+    ASSERT(addr == one_past_end);
     ASSERT(phys_page_index == pages_to_map.length);
 }
 
-void unmap_vrange(VRange vrange, PML4T *pml4t_to_unmap, const Vector<paddr>& pages_to_unmap)
+// NOTE the pages aren't freed, they belong to whoever passed them in (see VObject)
+bool unmap_vrange(VRange vrange, PML4T *pml4t_to_unmap, const Vector<paddr>& pages_to_unmap)
 {
     ASSERT(vrange.addr >= KERNEL_VSPACE_START);
     dbg_str("unmap_vrange()\n");
     dbg_str("vrage.addr: "); dbg_uint(vrange.addr); dbg_str(" vrange.length: "); dbg_uint(vrange.length); dbg_str("\n");
-    // TODO cleanup this code
-    u64 vaddr = vrange.addr;
+    u64 addr = vrange.addr;
     u64 one_past_end = vrange.one_past_end();
     PML4T& pml4t = *pml4t_to_unmap;
+    bool tables_freed = false;
     u32 phys_page_index = 0;
-    while(vaddr < one_past_end) {
-        dbg_str("vaddr: "); dbg_uint(vaddr); dbg_str("\n");
-
-        u64 pml4t_i = pml4t_index(vaddr);
-        PML4TE& pml4te = pml4t[pml4t_i];
-        ASSERT(pml4te.bitfield.present);
-
-        PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
-        u64 pdpt_i = pdpt_index(vaddr);
-        PDPTE& pdpte = pdpt[pdpt_i];
-        ASSERT(pdpte.bitfield.present);
-
-        PD& pd = *(PD *)pdpte.get_phys_addr();
-        u64 pd_i = pd_index(vaddr);
-        PDE& pde = pd[pd_i];
-        ASSERT(pde.bitfield.present);
-
-        PT& pt = *(PT *)pde.get_phys_addr();
-        u64 pt_i = pt_index(vaddr);
-        PTE& pte = pt[pt_i];
-        ASSERT(pte.bitfield.present);
-
-        ASSERT(pte.get_phys_addr() == (u64)pages_to_unmap[phys_page_index++]);
-        pte.clear();
-
-        vaddr += 4096;
-
-        // TODO is_empty() iterates over all entries in the page table
-        //      there are surely more efficient ways of doing this?
-        //      also see the comments in struct PT for possible ways to
-        //      speed up is_empty()
-        if(pt.is_empty()) {
-            dbg_str("is_empty() 1\n");
-            free_phys_page(pde.get_phys_addr());
-            pde.clear();
-        }
-        if(pd.is_empty()) {
-            dbg_str("is_empty() 2\n");
-            free_phys_page(pdpte.get_phys_addr());
-            pdpte.clear();
-        }
-        if(pdpt.is_empty()) {
-            dbg_str("is_empty() 3\n");
-            free_phys_page(pml4te.get_phys_addr());
-            pml4te.clear();
+    while(addr < one_past_end) {
+        u64 chunk_start = addr;
+        // the page table may not exist if none of the chunk's pages were ever allocated
+        PT *pt = pt_if_present(pml4t, addr);
+        u64 chunk_end = pt_chunk_end(addr, one_past_end);
+        for(u64 pt_i = pt_index(addr); addr < chunk_end; ++pt_i, addr += 4096) {
+            paddr page = pages_to_unmap[phys_page_index++];
+            if(page == 0) {
+                ASSERT(!pt || !(*pt)[pt_i].bitfield.present);
+                continue;
+            }
+            ASSERT(pt);
+            PTE& pte = (*pt)[pt_i];
+            ASSERT(pte.bitfield.present);
+            ASSERT(pte.get_phys_addr() == page);
+            pte.clear();
         }
+        if(pt)
+            tables_freed |= free_empty_tables(pml4t, chunk_start);
     }
-    ASSERT(vaddr == one_past_end);
+    ASSERT(addr == one_past_end);
     ASSERT(phys_page_index == pages_to_unmap.length);
+    return tables_freed;
 }
 // --------------------------------------------------------------------------------------------------------
 
+// walks the page tables to find the physical address that addr is mapped to
+// returns 0 if addr is not mapped
+// NOTE the pmap uses 2MB pages, these are detected using the page_size bit in the PDE
+paddr vaddr_to_paddr(vaddr addr, PML4T *pml4t_to_walk)
+{
+    PML4T& pml4t = *pml4t_to_walk;
+    PML4TE& pml4te = pml4t[pml4t_index(addr)];
+    if(!pml4te.bitfield.present)
+        return 0;
+
+    PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
+    PDPTE& pdpte = pdpt[pdpt_index(addr)];
+    if(!pdpte.bitfield.present)
+        return 0;
+
+    PD& pd = *(PD *)pdpte.get_phys_addr();
+    PDE& pde = pd[pd_index(addr)];
+    if(!pde.bitfield.present)
+        return 0;
+
+    if(pde.bitfield.page_size) {
+        PDEMaps2MBPage pde2mb = pde.raw;
+        return pde2mb.get_phys_addr() + (addr & (2*MB - 1));
+    }
+
+    PT& pt = *(PT *)pde.get_phys_addr();
+    PTE& pte = pt[pt_index(addr)];
+    if(!pte.bitfield.present)
+        return 0;
+
+    return pte.get_phys_addr() + page_index(addr);
+}
+
+// returns the page table entry that maps addr, or nullptr if the page table that would hold it doesn't exist
+// NOTE the entry may not be present
+PTE *vaddr_to_pte(vaddr addr, PML4T *pml4t_to_walk)
+{
+    PML4T& pml4t = *pml4t_to_walk;
+    PML4TE& pml4te = pml4t[pml4t_index(addr)];
+    if(!pml4te.bitfield.present)
+        return nullptr;
+
+    PDPT& pdpt = *(PDPT *)pml4te.get_phys_addr();
+    PDPTE& pdpte = pdpt[pdpt_index(addr)];
+    if(!pdpte.bitfield.present)
+        return nullptr;
+
+    PD& pd = *(PD *)pdpte.get_phys_addr();
+    PDE& pde = pd[pd_index(addr)];
+    if(!pde.bitfield.present || pde.bitfield.page_size)
+        return nullptr;
+
+    PT& pt = *(PT *)pde.get_phys_addr();
+    return &pt[pt_index(addr)];
+}
+
+// maps a single page, allocating any of the tables above it that don't exist
+// NOTE used to map in pages that are allocated after the rest of their vrange was mapped (see VObject::fill_page())
+void map_page(vaddr addr, paddr page, PML4T *pml4t_to_map)
+{
+    ASSERT(addr >= KERNEL_VSPACE_START);
+    ASSERT(is_aligned(addr, 4096) && is_aligned(page, 4096));
+    PT& pt = pt_or_new(*pml4t_to_map, addr);
+    PTE& pte = pt[pt_index(addr)];
+    ASSERT(!pte.bitfield.present);
+    pte.clear();
+    pte.bitfield.present = 1;
+    pte.bitfield.writable = 1;
+    pte.bitfield.global = is_global_vaddr(addr);
+    pte.set_phys_addr(page);
+}
+
 // this is for debugging purposes
 bool is_page_mapped_pmap(paddr addr, PML4T *pml4t_to_map)
 {
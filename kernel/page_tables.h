@@ -310,3 +310,7 @@ static_assert(sizeof(PT) == 4096, "PT is incorrect size, must be 4096 bytes");
 static_assert(alignof(PT) == 4096, "PT has incorrect alignment, must be 4096 bytes");
 
 PML4T *current_pml4t();
+
+paddr vaddr_to_paddr(vaddr addr, PML4T *pml4t_to_walk);
+PTE *vaddr_to_pte(vaddr addr, PML4T *pml4t_to_walk);
+void map_page(vaddr addr, paddr page, PML4T *pml4t_to_map);
@@ -0,0 +1,96 @@
+#pragma once
+#include "kernel/types.h"
+#include "kernel/asm.cpp"
+
+// based on info from
+//  https://wiki.osdev.org/PCI
+//  https://wiki.osdev.org/PCI_IDE_Controller
+
+const u16 PCI_CONFIG_ADDRESS = 0xcf8;
+const u16 PCI_CONFIG_DATA = 0xcfc;
+
+const u8 PCI_OFFSET_VENDOR_ID = 0x0;
+const u8 PCI_OFFSET_COMMAND = 0x4;
+const u8 PCI_OFFSET_CLASS = 0x8; // bits [8, 15]: prog IF, bits [16, 23]: subclass, bits [24, 31]: class
+const u8 PCI_OFFSET_HEADER_TYPE = 0xc; // bits [16, 23]
+const u8 PCI_OFFSET_BAR4 = 0x20;
+
+const u16 PCI_COMMAND_IO_SPACE = 1 << 0;
+const u16 PCI_COMMAND_BUS_MASTER = 1 << 2;
+
+const u8 PCI_CLASS_MASS_STORAGE = 0x1;
+const u8 PCI_SUBCLASS_IDE = 0x1;
+
+const u16 PCI_INVALID_VENDOR = 0xffff;
+
+struct PCIDevice
+{
+    bool found = false;
+    u8 bus = 0;
+    u8 device = 0;
+    u8 function = 0;
+};
+
+u32 pci_config_address(const PCIDevice& dev, u8 offset)
+{
+    ASSERT(is_aligned(offset, 4));
+    return (1u << 31) | ((u32)dev.bus << 16) | ((u32)dev.device << 11) | ((u32)dev.function << 8) | offset;
+}
+
+u32 pci_config_read32(const PCIDevice& dev, u8 offset)
+{
+    out32(PCI_CONFIG_ADDRESS, pci_config_address(dev, offset));
+    return in32(PCI_CONFIG_DATA);
+}
+
+void pci_config_write32(const PCIDevice& dev, u8 offset, u32 val)
+{
+    out32(PCI_CONFIG_ADDRESS, pci_config_address(dev, offset));
+    out32(PCI_CONFIG_DATA, val);
+}
+
+// NOTE this does a brute force scan of every bus/device/function, this is only done once at boot so it
+//      doesn't need to be fast
+PCIDevice pci_find_device(u8 class_code, u8 subclass)
+{
+    PCIDevice dev;
+    for(u32 bus = 0; bus < 256; ++bus) {
+        for(u8 device = 0; device < 32; ++device) {
+            for(u8 function = 0; function < 8; ++function) {
+                dev.bus = bus;
+                dev.device = device;
+                dev.function = function;
+
+                u32 id = pci_config_read32(dev, PCI_OFFSET_VENDOR_ID);
+                if((id & 0xffff) == PCI_INVALID_VENDOR) {
+                    if(function == 0)
+                        break;
+                    continue;
+                }
+
+                u32 class_reg = pci_config_read32(dev, PCI_OFFSET_CLASS);
+                if((u8)(class_reg >> 24) == class_code && (u8)(class_reg >> 16) == subclass) {
+                    dev.found = true;
+                    return dev;
+                }
+
+                // only multifunction devices implement functions other than 0
+                u32 header_reg = pci_config_read32(dev, PCI_OFFSET_HEADER_TYPE);
+                bool is_multifunction = (header_reg >> 16) & 0x80;
+                if(function == 0 && !is_multifunction)
+                    break;
+            }
+        }
+    }
+
+    return PCIDevice{};
+}
+
+void pci_enable_bus_master(const PCIDevice& dev)
+{
+    ASSERT(dev.found);
+    u32 reg = pci_config_read32(dev, PCI_OFFSET_COMMAND);
+    // the upper 16 bits are the status register, writing 1s to those bits clears them so mask them out
+    u32 command = (reg & 0xffff) | PCI_COMMAND_IO_SPACE | PCI_COMMAND_BUS_MASTER;
+    pci_config_write32(dev, PCI_OFFSET_COMMAND, command);
+}
@@ -4,31 +4,203 @@
 
 PhysicalPageAllocator g_phys_page_allocator;
 
+u64 PhysicalPageAllocator::page_index(paddr addr)
+{
+    ASSERT(is_aligned(addr, 4096));
+    u64 index = (addr - m_allocation_region.addr) / 4096;
+    ASSERT(index < m_page_count);
+    return index;
+}
+
+paddr PhysicalPageAllocator::page_addr(u64 index)
+{
+    return m_allocation_region.addr + index*4096;
+}
+
+// blocks are aligned by their physical address, so the buddy is found from the page frame number
+// NOTE the buddy may be outside of the allocation region, in which case this returns an index >= m_page_count
+u64 PhysicalPageAllocator::buddy_index(u64 index, u32 order)
+{
+    u64 first_frame = m_allocation_region.addr / 4096;
+    u64 buddy_frame = (first_frame + index) ^ ((u64)1 << order);
+    if(buddy_frame < first_frame)
+        return m_page_count;
+    return buddy_frame - first_frame;
+}
+
+void PhysicalPageAllocator::push_free_block(u64 index, u32 order)
+{
+    PhysicalPage& page = m_pages[index];
+    page.is_free_block = true;
+    page.order = order;
+    page.freelist_prev = 0;
+    page.freelist_next = m_freelists[order];
+    if(m_freelists[order])
+        m_freelists[order]->freelist_prev = &page;
+    m_freelists[order] = &page;
+}
+
+void PhysicalPageAllocator::remove_free_block(u64 index)
+{
+    PhysicalPage& page = m_pages[index];
+    ASSERT(page.is_free_block);
+    if(page.freelist_prev)
+        page.freelist_prev->freelist_next = page.freelist_next;
+    else
+        m_freelists[page.order] = page.freelist_next;
+    if(page.freelist_next)
+        page.freelist_next->freelist_prev = page.freelist_prev;
+    page.freelist_next = 0;
+    page.freelist_prev = 0;
+    page.is_free_block = false;
+}
+
+// takes a block from the from_order freelist and splits it down to order, the upper halves go back on the freelists
+// every page of the returned block is allocated with a single reference
+paddr PhysicalPageAllocator::take_block(u32 from_order, u32 order, bool zero)
+{
+    ASSERT(m_freelists[from_order]);
+    u64 index = ((u64)m_freelists[from_order] - (u64)m_pages) / sizeof(PhysicalPage);
+    remove_free_block(index);
+    for(u32 o = from_order; o > order; --o)
+        push_free_block(index + ((u64)1 << (o-1)), o-1);
+
+    u64 count = (u64)1 << order;
+    for(u64 i = index; i < index + count; ++i) {
+        PhysicalPage& page = m_pages[i];
+        ASSERT(!page.is_allocated);
+        page.is_allocated = true;
+        page.ref_count = 1;
+    }
+    m_free_page_count -= count;
+
+    paddr addr = page_addr(index);
+    if(zero) {
+        for(u64 i = 0; i < count; ++i)
+            __builtin_memset((void *)(addr + i*4096), 0, 4096);
+    }
+    return addr;
+}
+
+paddr PhysicalPageAllocator::take_from_zeroed_pool()
+{
+    ASSERT(m_zeroed_pool_count > 0);
+    paddr addr = m_zeroed_pool[--m_zeroed_pool_count];
+    PhysicalPage& page = m_pages[page_index(addr)];
+    ASSERT(page.is_allocated && page.ref_count == 0);
+    page.ref_count = 1;
+    return addr;
+}
+
 paddr PhysicalPageAllocator::allocate_page()
 {
-    // under normal conditions a pointer of 0 means the freelist is empty
-    ASSERT(m_freelist != 0);
+    if(m_use_zeroed_pool && m_zeroed_pool_count > 0) {
+        ++m_zeroed_pool_hits;
+        return take_from_zeroed_pool();
+    }
+    ++m_zeroed_pool_misses;
+    return allocate_pages(0);
+}
 
-    PhysicalPage *page = m_freelist;
-    m_freelist = m_freelist->freelist_next;
+// for pages the caller overwrites completely, these don't use up the pre-zeroed pages
+paddr PhysicalPageAllocator::allocate_page_unzeroed()
+{
+    for(u32 o = 0; o <= PHYS_PAGE_MAX_ORDER; ++o)
+        if(m_freelists[o])
+            return take_block(o, 0, false);
+    return take_from_zeroed_pool();
+}
+
+paddr PhysicalPageAllocator::allocate_pages(u32 order)
+{
+    ASSERT(order <= PHYS_PAGE_MAX_ORDER);
+    for(u32 o = order; o <= PHYS_PAGE_MAX_ORDER; ++o)
+        if(m_freelists[o])
+            return take_block(o, order, true);
+
+    // the pool's pages are free memory too
+    if(order == 0 && m_zeroed_pool_count > 0)
+        return take_from_zeroed_pool();
+
+    // out of memory (or too fragmented for this order)
+    UNREACHABLE();
+    return 0;
+}
 
-    ASSERT(!page->is_allocated);
-    page->is_allocated = true;
-    page->freelist_next = 0;
+// prefers splitting a larger block over returning a smaller one, so large allocations stay contiguous when possible
+// NOTE small runs are handed out one page at a time from the zeroed pool instead, contiguity only matters for larger
+//      buffers
+paddr PhysicalPageAllocator::allocate_run(u32 max_order, u32 *order)
+{
+    ASSERT(max_order <= PHYS_PAGE_MAX_ORDER);
+    if(max_order <= ZEROED_POOL_MAX_RUN_ORDER && m_use_zeroed_pool && m_zeroed_pool_count > 0) {
+        ++m_zeroed_pool_hits;
+        *order = 0;
+        return take_from_zeroed_pool();
+    }
+    ++m_zeroed_pool_misses;
+
+    for(u32 o = max_order; o <= PHYS_PAGE_MAX_ORDER; ++o) {
+        if(m_freelists[o]) {
+            *order = max_order;
+            return take_block(o, max_order, true);
+        }
+    }
+    for(u32 o = max_order; o-- > 0;) {
+        if(m_freelists[o]) {
+            *order = o;
+            return take_block(o, o, true);
+        }
+    }
+    if(m_zeroed_pool_count > 0) {
+        *order = 0;
+        return take_from_zeroed_pool();
+    }
 
-    u64 index = ((u64)page - (u64)m_pages) / sizeof(PhysicalPage);
-    paddr page_addr = m_allocation_region.addr + index*4096;
+    // out of memory
+    UNREACHABLE();
+    return 0;
+}
 
-    __builtin_memset((void *)page_addr, 0, 4096);
+// zeroes up to max_pages free pages into the zeroed pool, returns false if no page was added (the pool is full, or
+// too few pages are free to take any)
+// this is run by the scheduler when there is nothing else to do (see scheduler_idle_loop()), so allocate_page()
+// usually doesn't have to zero the page
+// NOTE the pages are taken from the smallest free blocks, so this breaks up as few large blocks as possible
+bool PhysicalPageAllocator::refill_zeroed_pool(u32 max_pages)
+{
+    u32 added = 0;
+    while(added < max_pages && m_zeroed_pool_count < ZEROED_POOL_SIZE) {
+        // keep some memory in the freelists for allocations that need contiguous pages
+        if(m_free_page_count <= ZEROED_POOL_SIZE)
+            break;
+        paddr addr = allocate_pages(0);
+        m_pages[page_index(addr)].ref_count = 0;
+        m_zeroed_pool[m_zeroed_pool_count++] = addr;
+        ++added;
+    }
+    return added > 0;
+}
 
-    return page_addr;
+// puts a single free page back, merging it with its' buddies while they are free
+void PhysicalPageAllocator::free_block(u64 index)
+{
+    u32 order = 0;
+    ASSERT(!m_pages[index].is_allocated);
+    while(order < PHYS_PAGE_MAX_ORDER) {
+        u64 buddy = buddy_index(index, order);
+        if(buddy >= m_page_count || !m_pages[buddy].is_free_block || m_pages[buddy].order != order)
+            break;
+        remove_free_block(buddy);
+        index = min(index, buddy);
+        ++order;
+    }
+    push_free_block(index, order);
 }
 
 void PhysicalPageAllocator::free_page(paddr addr)
 {
-    ASSERT(is_aligned(addr, 4096));
-
-    u64 index = (addr - m_allocation_region.addr) / 4096;
+    u64 index = page_index(addr);
     PhysicalPage& page = m_pages[index];
 
     if(!page.is_allocated) {
@@ -36,10 +208,28 @@ void PhysicalPageAllocator::free_page(paddr addr)
         [[maybe_unused]] int breakpoint2 = 0;
     }
     ASSERT(page.is_allocated);
+    ASSERT(page.ref_count > 0);
+    if(--page.ref_count > 0)
+        return;
 
     page.is_allocated = false;
-    page.freelist_next = m_freelist;
-    m_freelist = &page;
+    ++m_free_page_count;
+    free_block(index);
+}
+
+// adds a reference to an allocated page, the page then has to be freed one more time before it's actually freed
+void PhysicalPageAllocator::ref_page(paddr addr)
+{
+    PhysicalPage& page = m_pages[page_index(addr)];
+    ASSERT(page.is_allocated);
+    ++page.ref_count;
+}
+
+u32 PhysicalPageAllocator::ref_count(paddr addr)
+{
+    PhysicalPage& page = m_pages[page_index(addr)];
+    ASSERT(page.is_allocated);
+    return page.ref_count;
 }
 
 void PhysicalPageAllocator::init(const PRange& range)
@@ -74,8 +264,11 @@ void PhysicalPageAllocator::init(const PRange& range)
         round_up_align(page_arr_size, 4096)
     };
 
+    // NOTE the array only has num_structs entries, the usable memory can be a few pages more than that (since the
+    //      array is rounded up to pages after it shrinks), those pages are left unused so their PhysicalPages don't
+    //      overlap the first allocatable page
     paddr usable_base_addr = allocator_range.one_past_end();
-    u64 usable_size = range.length - allocator_range.length;
+    u64 usable_size = min(range.length - allocator_range.length, num_structs * 4096);
     PRange allocatable_range = {
         round_up_align(usable_base_addr, 4096),
         round_down_align(usable_size, 4096)
@@ -95,25 +288,37 @@ void PhysicalPageAllocator::init(const PRange& range)
     g_phys_page_allocator.m_page_count = allocatable_range.length / 4096;
     ASSERT(g_phys_page_allocator.m_page_count * 4096 == g_phys_page_allocator.m_allocation_region.length);
 
-    // init freelist
-    g_phys_page_allocator.m_freelist = g_phys_page_allocator.m_pages;
-    for(u32 i = 1; i < g_phys_page_allocator.m_page_count; ++i) {
-        PhysicalPage& page = g_phys_page_allocator.m_pages[i];
-        PhysicalPage& prev_page = g_phys_page_allocator.m_pages[i-1];
-        prev_page.freelist_next = &page;
+    // init freelists, the region is split into the largest blocks that are aligned to their size
+    PhysicalPageAllocator& allocator = g_phys_page_allocator;
+    for(u32 o = 0; o <= PHYS_PAGE_MAX_ORDER; ++o)
+        allocator.m_freelists[o] = 0;
+    for(u64 i = 0; i < allocator.m_page_count; ++i)
+        allocator.m_pages[i] = PhysicalPage{};
+
+    u64 first_frame = allocatable_range.addr / 4096;
+    u64 index = 0;
+    while(index < allocator.m_page_count) {
+        u32 order = PHYS_PAGE_MAX_ORDER;
+        while(!is_aligned(first_frame + index, (u64)1 << order) || index + ((u64)1 << order) > allocator.m_page_count)
+            --order;
+        allocator.push_free_block(index, order);
+        index += (u64)1 << order;
     }
+    allocator.m_free_page_count = allocator.m_page_count;
 
     g_phys_page_allocator.m_is_initialized = true;
     dbg_str("init_phys_pages\n");
 }
 
+// returns the number of free pages, including the ones in the zeroed pool
 u64 PhysicalPageAllocator::count_freelist_entries()
 {
     u64 sum = 0;
-    for(auto ptr = m_freelist; ptr; ptr = ptr->freelist_next) {
-        sum++;
-    }
-    return sum;
+    for(u32 o = 0; o <= PHYS_PAGE_MAX_ORDER; ++o)
+        for(auto ptr = m_freelists[o]; ptr; ptr = ptr->freelist_next)
+            sum += (u64)1 << o;
+    ASSERT(sum == m_free_page_count);
+    return sum + m_zeroed_pool_count;
 }
 
 paddr alloc_phys_page()
@@ -121,11 +326,49 @@ paddr alloc_phys_page()
     return g_phys_page_allocator.allocate_page();
 }
 
+paddr alloc_phys_page_unzeroed()
+{
+    return g_phys_page_allocator.allocate_page_unzeroed();
+}
+
+bool refill_zeroed_page_pool(u32 max_pages)
+{
+    return g_phys_page_allocator.refill_zeroed_pool(max_pages);
+}
+
+paddr alloc_phys_pages(u32 order)
+{
+    return g_phys_page_allocator.allocate_pages(order);
+}
+
+paddr alloc_phys_run(u32 max_order, u32 *order)
+{
+    return g_phys_page_allocator.allocate_run(max_order, order);
+}
+
+u32 phys_run_order(u64 page_count)
+{
+    u32 order = 0;
+    while(order < PHYS_PAGE_MAX_ORDER && ((u64)2 << order) <= page_count)
+        ++order;
+    return order;
+}
+
 void free_phys_page(paddr page)
 {
     return g_phys_page_allocator.free_page(page);
 }
 
+void ref_phys_page(paddr page)
+{
+    g_phys_page_allocator.ref_page(page);
+}
+
+u32 phys_page_ref_count(paddr page)
+{
+    return g_phys_page_allocator.ref_count(page);
+}
+
 /*
 void test_phys_arr_allocations_and_deallocations()
 {
@@ -5,16 +5,29 @@
 // TODO use the 0 to 2MB memory range or the space under the kernel image for this?
 // TODO zero memory (this has bitten me, qemu seems to zero memory unless you restart...)
 
-// TODO this struct could be made smaller by removing is_allocated
-//      and using invalid pointer values in freelist_next to indicate 
-//      if page is allocated or not
-// TODO future features may require that this is reference counted 
-//      (e.g. mapping the same buffer to kernel & user address space, mapping the same pages to multiple process addr spaces)
+// pages are reference counted so the same page can be used by several VObjects (e.g. the read-only pages of a cached
+// executable image, or the copy on write pages of a forked process), free_page() drops one reference and the page is
+// only freed once the last one is dropped
+//
+// this is a buddy allocator: free memory is kept as blocks of 2^order pages that are aligned to their size (in
+// physical memory), a block is split in half when a smaller one is needed, and a freed page is merged back with its'
+// free buddy into a larger block. multi-page allocations are handed out as individual pages, so each page is still
+// reference counted & freed on its' own and the block is rebuilt as its' pages are freed
+// resource: Unix Interals (Uresh Vahalia), chapter 12
+
+const u32 PHYS_PAGE_MAX_ORDER = 10; // 4MB blocks
+const u32 ZEROED_POOL_SIZE = 1024; // 4MB of pages zeroed ahead of time
+const u32 ZEROED_POOL_MAX_RUN_ORDER = 1; // runs of up to 2 pages are taken from the zeroed pool instead
 
 struct PhysicalPage
 {
+    // only used by the first page of a free block
     PhysicalPage *freelist_next = 0;
+    PhysicalPage *freelist_prev = 0;
+    u32 ref_count = 0;
+    u8 order = 0; // the order of the free block, if this is the first page of one
     bool is_allocated = false;
+    bool is_free_block = false; // true if this is the first page of a free block
 };
 
 // this object keeps track of which physical pages are used/unused in the region described by allocation_region
@@ -27,7 +40,16 @@ struct PhysicalPageAllocator
     PhysicalPage *m_pages;
     u32 m_page_count;
 
-    PhysicalPage *m_freelist;
+    // one freelist of blocks per order
+    PhysicalPage *m_freelists[PHYS_PAGE_MAX_ORDER+1];
+    u64 m_free_page_count = 0;
+
+    // pages that were zeroed while the cpu was idle, they are allocated but have no references
+    paddr m_zeroed_pool[ZEROED_POOL_SIZE];
+    u32 m_zeroed_pool_count = 0;
+    bool m_use_zeroed_pool = true; // for benchmarking
+    u64 m_zeroed_pool_hits = 0;
+    u64 m_zeroed_pool_misses = 0;
 
     // used to track which phys_pages_arr index is associated with which physical page
     PRange m_allocation_region;
@@ -35,14 +57,51 @@ struct PhysicalPageAllocator
     bool m_is_initialized = false;
 
     paddr allocate_page();
+    paddr allocate_page_unzeroed();
+    paddr allocate_pages(u32 order);
+    paddr allocate_run(u32 max_order, u32 *order);
 
     void free_page(paddr addr);
+    void ref_page(paddr addr);
+    u32 ref_count(paddr addr);
 
     static void init(const PRange& range);
 
     u64 count_freelist_entries();
+
+    u64 page_index(paddr addr);
+    paddr page_addr(u64 index);
+    u64 buddy_index(u64 index, u32 order);
+    void push_free_block(u64 index, u32 order);
+    void remove_free_block(u64 index);
+    paddr take_block(u32 from_order, u32 order, bool zero);
+    paddr take_from_zeroed_pool();
+    bool refill_zeroed_pool(u32 max_pages);
+    void free_block(u64 index);
 };
 
+// the page is zeroed
 paddr alloc_phys_page();
 
-void free_phys_page(paddr page);
\ No newline at end of file
+// for pages that the caller overwrites completely, the page is not zeroed
+paddr alloc_phys_page_unzeroed();
+
+// zeroes up to max_pages free pages ahead of time, returns false if no page was zeroed, either because the pool is
+// full or because too few pages are free
+bool refill_zeroed_page_pool(u32 max_pages);
+
+// allocates 2^order physically contiguous pages, aligned to their size
+// NOTE the pages are freed one at a time with free_phys_page()
+paddr alloc_phys_pages(u32 order);
+
+// allocates the largest available block of at most 2^max_order contiguous pages, its' order is returned in order
+paddr alloc_phys_run(u32 max_order, u32 *order);
+
+// the largest order whose block fits in page_count pages
+u32 phys_run_order(u64 page_count);
+
+void free_phys_page(paddr page);
+
+void ref_phys_page(paddr page);
+
+u32 phys_page_ref_count(paddr page);
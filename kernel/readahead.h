@@ -0,0 +1,11 @@
+#pragma once
+#include "kernel/types.h"
+
+// sequential readahead state of an open file, see inode_readahead()
+// NOTE the blocks are block indexes within the file
+struct FileReadahead
+{
+    u64 next_block = 0; // the block a sequential read continues from
+    u64 end_block = 0; // the blocks before this were already read ahead
+    u32 window = 0; // blocks read ahead the last time, 0 if the reads aren't sequential
+};
@@ -3,6 +3,7 @@
 #include "kernel/cpu.h"
 #include "external/elf_abi.h"
 #include "kernel/ext2.cpp"
+#include "kernel/exec_cache.cpp"
 
 Scheduler g_scheduler;
 extern bool g_in_kernel_init;
@@ -19,6 +20,14 @@ extern Stack g_interrupt_stack;
 // numer of timer ticks before a process gets switched out with another process
 const u64 TICKS_PER_SLICE = 25;
 
+// these stacks are used when the scheduler can't run on the interrupt stack:
+//  - the switch stack is used while copying a blocked process's saved interrupt stack back into place
+//  - the idle stack is used while waiting for an interrupt to unblock a process, since interrupts arriving
+//    while idle will reuse the top of the interrupt stack
+const u64 SCHEDULER_STACK_SIZE = 16*KB;
+alignas(64) u8 g_scheduler_switch_stack[SCHEDULER_STACK_SIZE];
+alignas(64) u8 g_scheduler_idle_stack[SCHEDULER_STACK_SIZE];
+
 // TODO this s_block_tick is error prone and messy, can probably be removed since interrupts should be disabled
 //      in all of these methods anyways as they are all entered via syscalls or early kernel startup
 static bool s_block_tick = true;
@@ -92,6 +101,17 @@ Process::Process(process_entry_ptr fn_ptr, bool can_orphan, const char *proc_nam
     dbg_str("\n");
 }
 
+// looks up the executable in the exec image cache and makes this process' VObject for it
+// NOTE this must be called with the fs lock held (or during kernel init)
+VObject *instantiate_exec_image(const char *path, u64 *entry)
+{
+    auto res = fs_open(path);
+    ASSERT(res.status == FS_STATUS_OK);
+    ExecImage *img = exec_cache_get(res.inode_num, res.generation);
+    *entry = img->entry;
+    return exec_image_instantiate(img);
+}
+
 // NOTE: this assumes the caller will kmalloc() the exe_path, then this Process object
 //       will take ownership of the pointer
 Process::Process(const char *exe_path, char **argv, bool can_orphan, bool kernel_proc, const char *pwd)
@@ -126,6 +146,84 @@ Process::Process(const char *exe_path, char **argv, bool can_orphan, bool kernel
     proc_stack_kspace.set_stack_top(DEFAULT_STACK_SIZE, DEFAULT_STACK_ALIGNMENT);
     copy_argv_to_stack(argv);
 
+    // NOTE the images are set up here instead of in user_process_start() since this runs in the exec syscall, which
+    //      holds the fs lock
+    const char *stdentry_path = "/userspace/stdentry";
+    exe_img_vobj = instantiate_exec_image(this->exe_path, &exe_img_entry);
+    std_img_vobj = instantiate_exec_image(stdentry_path, &std_img_entry);
+
+    dbg_str("NAME: "); dbg_str(name);
+    dbg_str(" PML4T: "); dbg_uint((u64)m_vspace->m_pml4t);
+    dbg_str("\n");
+}
+
+// makes a copy of parent_proc for the fork syscall, parent_state is the state the parent will resume with
+// the memory is shared copy on write (see VObject::clone_copy_on_write()) and mapped at the same addresses, so the
+// pointers in it stay valid. the child returns 0 from the syscall
+// NOTE the process stack is copied instead of shared, since switch_context() writes to it through its' kernel mapping
+//      mapped files aren't inherited, and the open files are copied so each process has its' own offsets
+Process::Process(Process *parent_proc, const ProcessRegisterState& parent_state)
+    : m_blockers(32),
+      start_rip(parent_proc->start_rip),
+      can_be_orphaned(false),
+      pid(++s_next_pid),
+      is_kernel_process(false),
+      proc_stack_vobj(DEFAULT_STACK_SIZE, DEFAULT_STACK_ALIGNMENT)
+{
+    dbg_str("Process() FORK\n");
+    ASSERT(!parent_proc->is_kernel_process);
+    ASSERT(parent_proc->state == State::RUNNING);
+
+    set_pwd(parent_proc->get_pwd());
+    setup_vspace(false);
+    VSpace& parent_vspace = *parent_proc->m_vspace;
+
+    int pathlen = strlen_workaround(parent_proc->exe_path);
+    exe_path = (char *)kmalloc(pathlen+1, 64);
+    memmove_workaround((char *)exe_path, (char *)parent_proc->exe_path, pathlen+1);
+    memmove_workaround(name, parent_proc->name, MAX_PROC_NAME_LEN+1);
+    for(int fd = 0; fd < MAX_OPEN_FILES; ++fd)
+        open_files[fd] = parent_proc->open_files[fd];
+    m_argc = parent_proc->m_argc;
+
+    exe_img_entry = parent_proc->exe_img_entry;
+    std_img_entry = parent_proc->std_img_entry;
+    exe_img_vobj = parent_proc->exe_img_vobj->clone_copy_on_write();
+    exe_img_vobj->map_at(*m_vspace, parent_proc->exe_img_vobj->mapped_addr(parent_vspace));
+    std_img_vobj = parent_proc->std_img_vobj->clone_copy_on_write();
+    std_img_vobj->map_at(*m_vspace, parent_proc->std_img_vobj->mapped_addr(parent_vspace));
+
+    vobjs.expand_capacity(parent_proc->vobjs.length);
+    for(u32 i = 0; i < parent_proc->vobjs.length; ++i) {
+        VObjectAllocation v = parent_proc->vobjs[i];
+        VObject *vobj = v.vobj->clone_copy_on_write();
+        vobj->map_at(*m_vspace, v.alloced_addr);
+        vobjs.append({vobj, v.alloced_addr});
+    }
+
+    // TODO this should allocate a guard page at bottom of stack
+    proc_stack_kspace.bottom = proc_stack_vobj.map(g_kernel_vspace);
+    proc_stack_kspace.set_stack_top(DEFAULT_STACK_SIZE, DEFAULT_STACK_ALIGNMENT);
+    proc_stack_uspace.bottom = proc_stack_vobj.map_at(*m_vspace, parent_proc->proc_stack_uspace.bottom);
+    proc_stack_uspace.set_stack_top(DEFAULT_STACK_SIZE, DEFAULT_STACK_ALIGNMENT);
+    proc_stack_offset = proc_stack_uspace.top - proc_stack_kspace.top;
+    ASSERT(proc_stack_uspace.top == parent_proc->proc_stack_uspace.top);
+
+    // only the part of the stack that is in use is copied
+    vaddr used_stack_start = round_down_align(parent_state.rsp, 4096);
+    ASSERT(used_stack_start >= proc_stack_uspace.bottom && used_stack_start < proc_stack_uspace.top);
+    memmove_workaround((void *)(used_stack_start - proc_stack_offset),
+                       (void *)(used_stack_start - parent_proc->proc_stack_offset),
+                       proc_stack_uspace.top - used_stack_start);
+
+    interrupt_stack_uspace.bottom = g_interrupt_stack_vobj.map_at(*m_vspace, parent_proc->interrupt_stack_uspace.bottom);
+    interrupt_stack_uspace.set_stack_top(DEFAULT_STACK_SIZE, DEFAULT_STACK_ALIGNMENT);
+    interrupt_stack_offset = interrupt_stack_uspace.top - g_interrupt_stack.top;
+
+    saved_state = parent_state;
+    saved_state.reg_state.rax = 0;
+    state = State::RUNNING;
+
     dbg_str("NAME: "); dbg_str(name);
     dbg_str(" PML4T: "); dbg_uint((u64)m_vspace->m_pml4t);
     dbg_str("\n");
@@ -201,6 +299,57 @@ void Process::free_mem_in_vspace(vaddr addr)
     vobjs.unstable_remove(i);
 }
 
+// maps size bytes of the file starting at offset into the process, the pages are read from the file the first time
+// they are touched (see page_fault_handler())
+// NOTE offset must be page aligned
+vaddr Process::map_file(u32 inode_num, u32 generation, u64 offset, u64 size)
+{
+    VObject *vobj = (VObject *)kmalloc(sizeof(VObject), alignof(VObject));
+    new ((void *)vobj) VObject(inode_num, generation, offset, size);
+
+    vaddr addr = vobj->map(*m_vspace);
+    file_mappings.append({vobj, addr});
+    return addr;
+}
+
+// writes the modified pages of the mapping at addr back to the file, returns false if addr isn't a mapped file
+// NOTE the fs lock must be held
+bool Process::sync_file_mapping(vaddr addr)
+{
+    for(u32 i = 0; i < file_mappings.length; ++i) {
+        if(file_mappings[i].alloced_addr == addr) {
+            file_mappings[i].vobj->writeback_file_pages();
+            return true;
+        }
+    }
+    return false;
+}
+
+// writes back and unmaps the mapping at addr, returns false if addr isn't a mapped file
+// NOTE the fs lock must be held
+bool Process::unmap_file_mapping(vaddr addr)
+{
+    for(u32 i = 0; i < file_mappings.length; ++i) {
+        VObjectAllocation v = file_mappings[i];
+        if(v.alloced_addr == addr) {
+            v.vobj->writeback_file_pages();
+            v.vobj->unmap(*m_vspace);
+            v.vobj->~VObject();
+            kfree((vaddr)v.vobj);
+            file_mappings.unstable_remove(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// NOTE the fs lock must be held
+void Process::unmap_all_file_mappings()
+{
+    while(file_mappings.length > 0)
+        unmap_file_mapping(file_mappings[file_mappings.length - 1].alloced_addr);
+}
+
 void Process::setup_interrupt_entry()
 {
     // NOTE: using ist here since it always forces the interrupt to switch to the ist stack, even if
@@ -211,11 +360,6 @@ void Process::setup_interrupt_entry()
     g_offset = interrupt_stack_offset;
 }
 
-struct LoadElfResult
-{
-    VObject *elf_img_vobj;
-    u64 start_rip = 0;
-};
 void Process::user_process_start()
 {
     ASSERT(g_in_syscall_context || g_in_kernel_init);
@@ -224,7 +368,7 @@ void Process::user_process_start()
     dbg_str("user_process_start()\n");
 
     // it is necessary to load the user vspace before making allocations in that vspace
-    write_cr3((u64)m_vspace->m_pml4t); // TODO there is a redundant write to cr3 in switch_context()
+    m_vspace->load(); // switch_context() then sees that it's already loaded
 
     // TODO this should allocate a guard page at bottom of stack
     interrupt_stack_uspace.bottom = g_interrupt_stack_vobj.map(*m_vspace);
@@ -239,76 +383,12 @@ void Process::user_process_start()
 
     proc_stack_offset = proc_stack_uspace.top - proc_stack_kspace.top;
 
-    auto load_elf_into_uspace = [&](const char *path) -> LoadElfResult {
-        // TODO make_this a load_elf function
-        auto res = fs_file_size(path);
-        ASSERT(res.found_file);
-
-        u8 *elf_buffer = (u8 *)kmalloc(res.size, 64);
-        fs_read(path, (u8 *)elf_buffer, 0, res.size);
-        auto elf_hdr = (Elf64_Ehdr *)elf_buffer;
-        ASSERT(IS_ELF(*elf_hdr));
-
-        for(int i = 0; i < elf_hdr->e_phnum; ++i) {
-            auto phdr = (Elf64_Phdr *)(elf_buffer + elf_hdr->e_phoff + elf_hdr->e_phentsize * i);
-            if(phdr->p_type != PT_DYNAMIC)
-                continue;
-            Elf64_Dyn *dyn = (Elf64_Dyn *)(elf_buffer + phdr->p_offset);
-            while(1) {
-                ASSERT(!(dyn->d_tag == DT_REL || dyn->d_tag == DT_RELA || dyn->d_tag == DT_RELR));
-                if(dyn->d_tag == DT_NULL)
-                    break;
-                dyn++;
-            }
-        }
-
-        u64 img_size = 0;
-        for(int i = 0; i < elf_hdr->e_phnum; ++i) {
-            auto phdr = (Elf64_Phdr *)(elf_buffer + elf_hdr->e_phoff + elf_hdr->e_phentsize * i);
-            if(phdr->p_type != PT_LOAD)
-                continue;
-            img_size += phdr->p_memsz;
-        }
-
-        dbg_str("QWERTY 1 ");
-        auto elf_img_vobj = (VObject *)kmalloc(sizeof(VObject), alignof(VObject));
-        dbg_str("QWERTY 2 ");
-        new (elf_img_vobj) VObject(img_size, 4096);
-        dbg_str("QWERTY 3 ");
-        vaddr load_addr = elf_img_vobj->map(*m_vspace);
-        dbg_str("QWERTY 4 ");
-        memset_workaround((void *)load_addr, 0, img_size);
-        dbg_str("QWERTY 5 ");
-
-        for(int i = 0; i < elf_hdr->e_phnum; ++i) {
-            auto phdr = (Elf64_Phdr *)(elf_buffer + elf_hdr->e_phoff + elf_hdr->e_phentsize * i);
-            if(phdr->p_type != PT_LOAD)
-                continue;
-            memmove_workaround((void *)(load_addr + phdr->p_vaddr), elf_buffer + phdr->p_offset, phdr->p_filesz);
-            memset_workaround((void *)(load_addr + phdr->p_vaddr + phdr->p_filesz), 0, phdr->p_memsz - phdr->p_filesz);// TODO is this redundant because of the memset(load_addr, 0, img_size) above?
-        }
-
-        u64 start_rip = load_addr + elf_hdr->e_entry;
-
-        kfree((vaddr)elf_buffer);
-
-        return {elf_img_vobj, start_rip};
-    };
-
     ASSERT(xor_(exe_path, start_rip));
     u64 exe_entry_rip = 0;
     if(exe_path) {
-
-        dbg_str("QWERTY A ");
-        auto res = load_elf_into_uspace(exe_path);
-        exe_img_vobj = res.elf_img_vobj;
-        exe_entry_rip = res.start_rip;
-
-        dbg_str("QWERTY B ");
-        const char *stdentry_path = "/userspace/stdentry";
-        res = load_elf_into_uspace(stdentry_path);
-        std_img_vobj = res.elf_img_vobj;
-        start_rip = res.start_rip;
+        ASSERT(exe_img_vobj && std_img_vobj);
+        exe_entry_rip = exe_img_vobj->map(*m_vspace) + exe_img_entry;
+        start_rip = std_img_vobj->map(*m_vspace) + std_img_entry;
     }
 
     ASSERT(is_aligned(proc_stack_uspace.top, 64));
@@ -438,6 +518,9 @@ void Process::switch_context()
     //      less error prone
     u64 adjusted_pop_stack = saved_state.rsp - 20*8;
 
+    // 0 if the vspace is already loaded (e.g. kernel processes, or the process that was just interrupted)
+    u64 cr3 = m_vspace->cr3_to_load();
+
     g_in_syscall_context = false;
     g_in_kernel_init = false;
     s_block_tick = false;
@@ -476,7 +559,10 @@ void Process::switch_context()
 // ---------------------------------------
 
         "movq %[adjusted_pop_stack], %%rsp\n"
-        "movq %[pml4t], %%cr3\n" /* TODO this is inefficient in the case where this is not switching to a different pml4t (e.g. for kernel processes) */
+        "testq %[cr3], %[cr3]\n"
+        "jz 1f\n"
+        "movq %[cr3], %%cr3\n"
+        "1:\n"
 
 // ---------------------------------------
 
@@ -522,7 +608,7 @@ void Process::switch_context()
             [push_stack] "r"(push_stack),
             [code_segment] "m"(saved_state.cs.raw),
             [start_rip] "m"(saved_state.rip),
-            [pml4t] "r"((u64)m_vspace->m_pml4t) // must use a register since the stack gets switched right before this value is used
+            [cr3] "r"(cr3) // must use a register since the stack gets switched right before this value is used
         : /* "rbp", "rsp", "rsi", "rdi", "rax", "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "memory", "cc" */
     );
     __builtin_unreachable();
@@ -542,6 +628,12 @@ void Process::save_register_state(InterruptStackFrame *stack_frame, RegisterStat
 void Process::resume()
 {
     ASSERT(g_in_syscall_context || g_in_kernel_init);
+    if(m_kernel_continuation.is_valid) {
+        resume_kernel_continuation();
+        __builtin_unreachable();
+        UNREACHABLE();
+    }
+
     switch(state)
     {
         case State::NOT_YET_STARTED:
@@ -608,6 +700,27 @@ int Process::pwd_length()
     return pwd_len;
 }
 
+// returns -1 if the process has too many open files
+int Process::alloc_fd()
+{
+    for(int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+        if(!open_files[fd].is_open) {
+            open_files[fd] = {};
+            open_files[fd].is_open = true;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// returns nullptr if fd isn't an open file
+OpenFile *Process::get_open_file(int fd)
+{
+    if(fd < 0 || fd >= MAX_OPEN_FILES || !open_files[fd].is_open)
+        return nullptr;
+    return &open_files[fd];
+}
+
 // TODO have processes clean up their own vspace mappings/allocations on exit
 void Process::exit()
 {
@@ -619,21 +732,31 @@ void Process::exit()
 
     dbg_str("exit()\n");
 
-    for(u32 i = vobjs.length-1; i <= 0; --i) {
-        VObjectAllocation v = vobjs[i];
+    while(vobjs.length > 0) {
+        VObjectAllocation v = vobjs[vobjs.length - 1];
         v.vobj->unmap(*m_vspace);
         v.vobj->~VObject();
         kfree((vaddr)v.vobj);
-        vobjs.unstable_remove(i);
+        vobjs.unstable_remove(vobjs.length - 1);
+    }
+
+    // mapped files are written back like munmap would, SYSCALL_EXIT holds the fs lock for this (see exit_uses_fs())
+    // NOTE kill_process() syncs the filesystem after exit()
+    if(file_mappings.length > 0) {
+        ASSERT(g_fs_lock.is_locked && g_fs_lock.owner == current_process()->pid);
+        unmap_all_file_mappings();
     }
 
     // ASSERT((exe_img_vobj && std_img_vobj) || (!exe_img_vobj && !std_img_vobj));
     ASSERT(!xor_(exe_img_vobj, std_img_vobj));
     if(exe_img_vobj) {
+        // the VObject destructor drops this process' references to the image pages
         exe_img_vobj->unmap(*m_vspace);
+        exe_img_vobj->~VObject();
         kfree((vaddr)exe_img_vobj);
 
         std_img_vobj->unmap(*m_vspace);
+        std_img_vobj->~VObject();
         kfree((vaddr)std_img_vobj);
     }
 
@@ -649,8 +772,7 @@ void Process::exit()
 
     // unshare kernelspace pages so the kernel page tables don't get cleaned up
     // also switch to kernel pml4t since unshared_kernelspace() will unmap the kernel page tables, which we are currently using
-        if(!in_kernel_vspace())
-            write_cr3((u64)kernel_pml4t());
+        g_kernel_vspace.load();
         m_vspace->unshare_kernelspace();
         m_vspace->~VSpace();
         kfree((vaddr)m_vspace);
@@ -663,6 +785,8 @@ void Process::exit()
         kfree((vaddr)m_pwd);
     if(exe_path)
         kfree((vaddr)exe_path);
+    if(m_kernel_continuation.stack_copy)
+        kfree((vaddr)m_kernel_continuation.stack_copy);
 
     ASSERT(parent); // process should always have parent unless it is init process, and the init process should never exit()
     parent->unblock_process(pid);
@@ -687,6 +811,19 @@ void Process::exit()
     state = State::TERMINATED;
 }
 
+// SYSCALL_EXIT holds the fs lock if this returns true, mapped files are written back by exit(), and children that
+// can't be orphaned are killed by it, holding the lock means none of them are blocked in the middle of using the
+// filesystem when they are killed
+bool Process::exit_uses_fs()
+{
+    if(file_mappings.length > 0)
+        return true;
+    for(Process *child = children; child; child = child->sibling_next)
+        if(!child->can_be_orphaned)
+            return true;
+    return false;
+}
+
 // TODO how much of process cleanup should be in exit() and how much should be in ~Process()
 Process::~Process()
 {
@@ -743,6 +880,126 @@ void Process::add_blocker_process(pid_t blocker_pid)
     m_blockers.append(blocker);
 }
 
+void Process::add_blocker_io(u64 channel)
+{
+    Blocker blocker;
+    blocker.type = Blocker::Type::IO;
+    blocker.data.io.channel = channel;
+    m_blockers.append(blocker);
+}
+
+void Process::unblock_io(u64 channel)
+{
+    // NOTE: this loop restarts after each removal since unstable_remove modifies the vector under the loop
+    u32 i = 0;
+    while(i < m_blockers.length) {
+        Blocker blocker = m_blockers[i];
+        if(blocker.type == Blocker::Type::IO && blocker.data.io.channel == channel) {
+            m_blockers.unstable_remove(i);
+            continue;
+        }
+        ++i;
+    }
+}
+
+// processes can only block in the middle of a syscall, since that is the only time the kernel is
+// running on the interrupt stack on behalf of a process that is already running
+bool Process::can_block_in_kernel()
+{
+    return g_in_syscall_context &&
+           !g_in_kernel_init &&
+           state == State::RUNNING &&
+           this == current_process() &&
+           g_interrupt_stack.currently_using_stack() &&
+           !are_interrupts_enabled();
+}
+
+// saves the syscall's part of the interrupt stack and switches to another process, this returns
+// once the process has been unblocked and rescheduled
+__attribute__((noinline)) void Process::block_in_kernel()
+{
+    ASSERT(can_block_in_kernel());
+    KernelContinuation& k = m_kernel_continuation;
+    ASSERT(!k.is_valid);
+
+    if(__builtin_setjmp(k.jmp_buf) == 0) {
+        // NOTE everything below this rsp is not needed once the process is resumed, since the
+        //      longjmp returns into this frame
+        vaddr stack_start = rsp();
+        k.stack_start = stack_start;
+        k.stack_length = g_interrupt_stack.top - stack_start;
+        if(k.stack_copy_capacity < k.stack_length) {
+            if(k.stack_copy)
+                kfree((vaddr)k.stack_copy);
+            k.stack_copy_capacity = round_up_align(k.stack_length, 4096);
+            k.stack_copy = (u8 *)kmalloc(k.stack_copy_capacity, 64);
+        }
+        memmove_workaround(k.stack_copy, (void *)k.stack_start, k.stack_length);
+        k.is_valid = true;
+
+        g_scheduler.schedule();
+        __builtin_unreachable();
+        UNREACHABLE();
+    }
+
+    // resumed by restore_kernel_continuation()
+    ASSERT(!k.is_valid);
+}
+
+extern "C" __attribute__((used)) void restore_kernel_continuation(Process *proc)
+{
+    KernelContinuation& k = proc->m_kernel_continuation;
+    k.is_valid = false;
+    memmove_workaround((void *)k.stack_start, k.stack_copy, k.stack_length);
+    __builtin_longjmp(k.jmp_buf, 1);
+}
+
+void Process::resume_kernel_continuation()
+{
+    ASSERT(m_kernel_continuation.is_valid);
+    ASSERT(!are_interrupts_enabled());
+
+    m_vspace->load();
+    setup_interrupt_entry();
+    g_in_syscall_context = true;
+    g_in_kernel_init = false;
+    s_block_tick = false;
+
+    // NOTE the saved interrupt stack may overlap with the stack this is currently running on, so the copy
+    //      is done on a separate stack
+    u64 switch_stack_top = (u64)(g_scheduler_switch_stack + SCHEDULER_STACK_SIZE);
+    asm volatile(
+        "movq %0, %%rsp\n"
+        "call restore_kernel_continuation\n"
+        :
+        : "r"(switch_stack_top), "D"(this)
+        : "memory"
+    );
+    __builtin_unreachable();
+    UNREACHABLE();
+}
+
+bool can_block_current_process()
+{
+    Process *proc = current_process();
+    return proc && proc->can_block_in_kernel();
+}
+
+void block_current_process_on_io(u64 channel)
+{
+    Process *proc = current_process();
+    proc->add_blocker_io(channel);
+    proc->block_in_kernel();
+}
+
+void unblock_processes_on_io(u64 channel)
+{
+    for(Process *proc = g_scheduler.wait_queue_start; proc; proc = proc->queue_next)
+        proc->unblock_io(channel);
+    if(g_scheduler.current)
+        g_scheduler.current->unblock_io(channel);
+}
+
 void Scheduler::add_to_queue(Process *proc)
 {
     bool old_s_block_tick = s_block_tick;
@@ -810,11 +1067,17 @@ Process *Scheduler::next_process_to_run()
     ASSERT(wait_queue_start);
     Process *proc;
         dbg_str("1\n");
-    for(proc = wait_queue_start; proc != wait_queue_end; proc = proc->queue_next) {
+    for(proc = wait_queue_start; proc; proc = proc->queue_next) {
         if(!proc->is_blocked())
             break;
     }
 
+    // every process is blocked (e.g. waiting on disk I/O)
+    if(!proc) {
+        s_block_tick = old_s_block_tick;
+        return 0;
+    }
+
         dbg_str("3\n");
     remove_from_queue(proc);
         dbg_str("4\n");
@@ -823,6 +1086,55 @@ Process *Scheduler::next_process_to_run()
     return proc;
 }
 
+bool Scheduler::has_runnable_process()
+{
+    for(Process *proc = wait_queue_start; proc; proc = proc->queue_next) {
+        if(!proc->is_blocked())
+            return true;
+    }
+    return false;
+}
+
+const u32 IDLE_ZEROED_PAGES_PER_BATCH = 16;
+extern "C" __attribute__((used)) void scheduler_idle_loop()
+{
+    // interrupts that arrive while idle use the kernel mapping of the interrupt stack, since the
+    // vspace of the last process may not be valid anymore
+    g_kernel_vspace.load();
+    tss.set_ist1_stack(g_interrupt_stack.top);
+    g_offset = 0;
+
+    while(!g_scheduler.has_runnable_process()) {
+        // pages are zeroed in small batches while there is nothing else to do, with a window for interrupts after
+        // each batch, so a process that gets woken up doesn't have to wait long
+        if(refill_zeroed_page_pool(IDLE_ZEROED_PAGES_PER_BATCH)) {
+            asm volatile("sti\nnop\ncli\n" : : : "memory");
+            continue;
+        }
+        // NOTE sti only takes effect after the next instruction, so an interrupt can't be missed between sti and hlt
+        asm volatile("sti\nhlt\ncli\n" : : : "memory");
+    }
+
+    g_scheduler.schedule();
+    __builtin_unreachable();
+    UNREACHABLE();
+}
+
+void Scheduler::idle()
+{
+    dbg_str("scheduler idle\n");
+    u64 idle_stack_top = (u64)(g_scheduler_idle_stack + SCHEDULER_STACK_SIZE);
+    asm volatile(
+        "movq %0, %%rsp\n"
+        "call scheduler_idle_loop\n"
+        :
+        : "r"(idle_stack_top)
+        : "memory"
+    );
+    __builtin_unreachable();
+    UNREACHABLE();
+}
+
 void Scheduler::schedule()
 {
     s_block_tick = true;
@@ -835,6 +1147,11 @@ void Scheduler::schedule()
         current = 0;
     }
     Process *proc = next_process_to_run();
+    if(!proc) {
+        idle();
+        __builtin_unreachable();
+        UNREACHABLE();
+    }
     dbg_str("2\n");
     current = proc;
     current->m_ticks_left = TICKS_PER_SLICE;
@@ -6,6 +6,7 @@
 #include "kernel/vspace.h"
 #include "kernel/stack.h"
 #include "include/syscall.h"
+#include "kernel/readahead.h"
 
 const u64 MAX_PROC_NAME_LEN = 256;
 typedef void (*process_entry_ptr)();
@@ -24,7 +25,8 @@ struct Blocker
 {
     enum Type
     {
-        PROCESS
+        PROCESS,
+        IO
     };
     u32 type;
     union 
@@ -33,9 +35,39 @@ struct Blocker
         {
             pid_t pid;
         } process;
+        // NOTE channel is an arbitrary value (usually the address of the object being waited on, e.g. an IDEDevice)
+        //      that the waking code uses to find the processes to unblock
+        struct
+        {
+            u64 channel;
+        } io;
     } data;
 };
 
+// all processes share the same interrupt stack, so a process that blocks in the middle of a syscall
+// saves the part of the interrupt stack that the syscall is using and restores it when it's resumed
+struct KernelContinuation
+{
+    void *jmp_buf[5]; // layout used by __builtin_setjmp/__builtin_longjmp
+    vaddr stack_start = 0;
+    u64 stack_length = 0;
+    u8 *stack_copy = 0;
+    u64 stack_copy_capacity = 0;
+    bool is_valid = false;
+};
+
+// a file opened with SYSCALL_FS_OPEN, the inode number is cached so reads & writes don't have to look up the path again
+// NOTE generation is the inode's generation when the file was opened, used to detect that the file was deleted
+struct OpenFile
+{
+    bool is_open = false;
+    u32 inode_num = 0;
+    u32 generation = 0;
+    u64 offset = 0;
+    FileReadahead readahead;
+};
+const int MAX_OPEN_FILES = 16;
+
 struct Process
 {
     ProcessRegisterState saved_state;
@@ -56,9 +88,14 @@ struct Process
     };
     // TODO make sure these are cleaned up properly on process exit
     Vector<VObjectAllocation> vobjs = {};
+    // memory mapped files, see map_file()
+    Vector<VObjectAllocation> file_mappings = {};
 
     VObject *exe_img_vobj = 0;
     VObject *std_img_vobj = 0;
+    // offsets of the entry points from the start of the images
+    u64 exe_img_entry = 0;
+    u64 std_img_entry = 0;
 
     Process *queue_next = 0;
     Process *queue_prev = 0;
@@ -75,6 +112,8 @@ struct Process
 
     u64 m_ticks_left = 0;
 
+    KernelContinuation m_kernel_continuation;
+
     // TODO should this use a pid and some code for looking up pids and making sure they are in a valid state?
     //      then children & siblings would be vectors of pids
     Process *parent = 0;
@@ -85,6 +124,9 @@ struct Process
 
     const char *m_pwd = 0;
     int pwd_len = 0;
+    // the index into open_files is the file descriptor
+    // NOTE open files don't hold any resources, so they don't need to be closed when the process exits
+    OpenFile open_files[MAX_OPEN_FILES] = {};
     int m_argc = 0;
     char **m_argv_kspace = 0;
 
@@ -102,6 +144,7 @@ struct Process
 
     Process(void (*)(), bool, const char *, bool, const char *);
     Process(const char *, char **, bool, bool, const char *);
+    Process(Process *, const ProcessRegisterState&);
     ~Process();
 
     void setup_vspace(bool);
@@ -117,6 +160,7 @@ struct Process
     void resume();
 
     void exit();
+    bool exit_uses_fs();
 
     void switch_context();
 
@@ -124,6 +168,11 @@ struct Process
 
     bool is_blocked();
     void add_blocker_process(pid_t);
+    void add_blocker_io(u64);
+    void unblock_io(u64);
+    bool can_block_in_kernel();
+    void block_in_kernel();
+    void resume_kernel_continuation();
     void add_child(Process *);
     void remove_child(Process *);
     void setup_interrupt_entry();
@@ -131,11 +180,19 @@ struct Process
     vaddr alloc_mem_in_vspace(u64 size, u64 align);
     void free_mem_in_vspace(vaddr addr);
 
+    vaddr map_file(u32 inode_num, u32 generation, u64 offset, u64 size);
+    bool sync_file_mapping(vaddr addr);
+    bool unmap_file_mapping(vaddr addr);
+    void unmap_all_file_mappings();
+
     void set_pwd(const char *pwd);
     void copy_argv_to_stack(char **src_argv);
 
     const char *get_pwd();
     int pwd_length();
+
+    int alloc_fd();
+    OpenFile *get_open_file(int fd);
 };
 
 void unlink_proc_queue(Process *);
@@ -160,6 +217,12 @@ struct Scheduler
     void schedule();
     bool tick();
     Process *take_from_start();
+    bool has_runnable_process();
+    void idle();
 };
 
 Process *current_process();
+
+bool can_block_current_process();
+void block_current_process_on_io(u64 channel);
+void unblock_processes_on_io(u64 channel);
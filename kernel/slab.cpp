@@ -0,0 +1,184 @@
+#pragma once
+#include "kernel/types.h"
+#include "kernel/debug.cpp"
+#include "kernel/kernel_defs.h"
+#include "kernel/physical_allocator.h"
+#include "include/math.h"
+#include "include/stdlib_workaround.h"
+
+// slab allocator for small kmalloc() requests, so a small object doesn't cost a vrange, a buffer page
+// and a map_vrange() call like an allocation from the kernel vspace does
+//
+// each size class (16 bytes to 2KB) has its' own slabs, a slab is a physically contiguous block from the physical
+// page allocator that is used through the pmap, and is cut into equal sized objects. the Slab header is at the end of
+// the block, and blocks are aligned to their size, so kfree() finds the slab from the pointer. objects are aligned to
+// their size, so any alignment up to the size class is satisfied
+// NOTE the pmap is below KERNEL_VSPACE_START, which is how kfree() tells slab objects apart from vspace allocations
+// resource: Unix Internals (Uresh Vahalia), chapter 12
+
+const u32 SLAB_ORDER = 2;
+const u64 SLAB_SIZE = (u64)4096 << SLAB_ORDER;
+const u64 SLAB_MIN_OBJECT_SIZE = 16;
+const u64 SLAB_MAX_OBJECT_SIZE = 2048;
+const u32 SLAB_SIZE_CLASS_COUNT = 8; // 16, 32, ..., 2048
+
+struct SlabFreeObject
+{
+    SlabFreeObject *next;
+};
+
+struct Slab
+{
+    Slab *next = nullptr; // partial slabs only
+    Slab *prev = nullptr;
+    SlabFreeObject *freelist = nullptr;
+    u32 used_count = 0;
+    u32 object_count = 0;
+    u32 size_class = 0;
+};
+
+struct SlabCache
+{
+    Slab *partial = nullptr; // slabs with at least one free object, full slabs aren't tracked
+    u64 slab_count = 0;
+    u64 used_objects = 0;
+};
+SlabCache g_slab_caches[SLAB_SIZE_CLASS_COUNT];
+
+u64 slab_object_size(u32 size_class)
+{
+    return SLAB_MIN_OBJECT_SIZE << size_class;
+}
+
+u32 slab_size_class(u64 size)
+{
+    u32 size_class = 0;
+    while(slab_object_size(size_class) < size)
+        ++size_class;
+    ASSERT(size_class < SLAB_SIZE_CLASS_COUNT);
+    return size_class;
+}
+
+bool is_slab_object(vaddr ptr)
+{
+    return ptr < KERNEL_VSPACE_START;
+}
+
+Slab *slab_from_object(vaddr ptr)
+{
+    return (Slab *)(round_down_align(ptr, SLAB_SIZE) + SLAB_SIZE - sizeof(Slab));
+}
+
+void slab_push_partial(SlabCache& cache, Slab *slab)
+{
+    slab->prev = nullptr;
+    slab->next = cache.partial;
+    if(cache.partial)
+        cache.partial->prev = slab;
+    cache.partial = slab;
+}
+
+void slab_remove_partial(SlabCache& cache, Slab *slab)
+{
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cache.partial = slab->next;
+    if(slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = nullptr;
+    slab->prev = nullptr;
+}
+
+Slab *slab_create(u32 size_class)
+{
+    paddr base = alloc_phys_pages(SLAB_ORDER);
+    auto slab = (Slab *)(base + SLAB_SIZE - sizeof(Slab));
+    *slab = Slab{};
+    slab->size_class = size_class;
+
+    u64 object_size = slab_object_size(size_class);
+    slab->object_count = (SLAB_SIZE - sizeof(Slab)) / object_size;
+    // built back to front, so objects are handed out in address order
+    for(u32 i = slab->object_count; i-- > 0;) {
+        auto obj = (SlabFreeObject *)(base + i * object_size);
+        obj->next = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    SlabCache& cache = g_slab_caches[size_class];
+    ++cache.slab_count;
+    slab_push_partial(cache, slab);
+    return slab;
+}
+
+void slab_destroy(Slab *slab)
+{
+    ASSERT(slab->used_count == 0);
+    --g_slab_caches[slab->size_class].slab_count;
+    paddr base = round_down_align((u64)slab, SLAB_SIZE);
+    // the block's pages are handed out individually by the physical page allocator
+    for(u64 i = 0; i < ((u64)1 << SLAB_ORDER); ++i)
+        free_phys_page(base + i * 4096);
+}
+
+// NOTE the object is zeroed, like the pages of a vspace allocation are
+vaddr slab_alloc(u64 size)
+{
+    u32 size_class = slab_size_class(max(size, SLAB_MIN_OBJECT_SIZE));
+    SlabCache& cache = g_slab_caches[size_class];
+    Slab *slab = cache.partial;
+    if(!slab)
+        slab = slab_create(size_class);
+
+    SlabFreeObject *obj = slab->freelist;
+    ASSERT(obj);
+    slab->freelist = obj->next;
+    ++slab->used_count;
+    ++cache.used_objects;
+    if(slab->used_count == slab->object_count)
+        slab_remove_partial(cache, slab);
+
+    memset_workaround(obj, 0, slab_object_size(size_class));
+    return (vaddr)obj;
+}
+
+// an empty slab is kept if it's the only one with free objects, so allocating and freeing a single object doesn't
+// allocate and free a slab every time
+void slab_free(vaddr ptr)
+{
+    Slab *slab = slab_from_object(ptr);
+    SlabCache& cache = g_slab_caches[slab->size_class];
+    ASSERT(slab->used_count > 0);
+    ASSERT(is_aligned(ptr, slab_object_size(slab->size_class)));
+
+    bool was_full = slab->used_count == slab->object_count;
+    auto obj = (SlabFreeObject *)ptr;
+    obj->next = slab->freelist;
+    slab->freelist = obj;
+    --slab->used_count;
+    --cache.used_objects;
+
+    if(was_full)
+        slab_push_partial(cache, slab);
+    if(slab->used_count == 0 && (cache.partial != slab || slab->next)) {
+        slab_remove_partial(cache, slab);
+        slab_destroy(slab);
+    }
+}
+
+void slab_print_stats()
+{
+    u64 total_slabs = 0;
+    for(u32 i = 0; i < SLAB_SIZE_CLASS_COUNT; ++i) {
+        SlabCache& cache = g_slab_caches[i];
+        if(cache.slab_count == 0)
+            continue;
+        dbg_str("slab "); dbg_uint(slab_object_size(i));
+        dbg_str(": slabs "); dbg_uint(cache.slab_count);
+        dbg_str(" objects "); dbg_uint(cache.used_objects);
+        dbg_str("\n");
+        total_slabs += cache.slab_count;
+    }
+    dbg_str("slab pages: "); dbg_uint(total_slabs << SLAB_ORDER); dbg_str("\n");
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "kernel/types.h"
+
+// shell sort, this is in place and doesn't need any allocations, and is fast on input that is already
+// mostly sorted (which is the common case for lists of block numbers)
+// less(a, b) must return true if a should come before b
+template<typename T, typename Less>
+void sort(T *arr, u64 count, Less less)
+{
+    // Ciura's gap sequence
+    const u64 gaps[] = {701, 301, 132, 57, 23, 10, 4, 1};
+    for(u64 gap : gaps) {
+        for(u64 i = gap; i < count; ++i) {
+            T val = arr[i];
+            u64 j = i;
+            for(; j >= gap && less(val, arr[j - gap]); j -= gap)
+                arr[j] = arr[j - gap];
+            arr[j] = val;
+        }
+    }
+}
@@ -47,7 +47,7 @@ struct Vector
             return;
 
         dbg_str("DEBUG: VECTOR KMALLOC\n");
-        T *new_mem = (T *)kmalloc(new_capacity, alignof(T));
+        T *new_mem = (T *)kmalloc(new_capacity * sizeof(T), alignof(T));
 
         // TODO zero memory? or add option to kmalloc to zero memory
         for(u32 i = 0; i < length; ++i)
@@ -60,6 +60,13 @@ struct Vector
         capacity = new_capacity;
     }
 
+    void clear()
+    {
+        for(u32 i = 0; i < length; ++i)
+            mem[i].~T();
+        length = 0;
+    }
+
     void unstable_remove(u32 index)
     {
         ASSERT(length > 0);
@@ -1,9 +1,18 @@
 #pragma once
 #include "kernel/vspace.h"
 #include "kernel/range.h"
+#include "kernel/ext2.cpp"
+#include "kernel/exec_cache.cpp"
 
 VSpace g_kernel_vspace = {};
 bool g_kernel_vspace_is_initialized = false;
+
+// the vspace whose TLB entries may be tagged with each PCID, PCID 0 is the kernel vspace's
+// PCIDs are handed out round robin, so once there are more vspaces than PCIDs, some vspaces share one, and the TLB
+// entries of the last vspace to use it are flushed when another one is loaded
+const u32 PCID_COUNT = 4096;
+VSpace *g_pcid_owners[PCID_COUNT] = {};
+u16 g_next_pcid = 1;
 extern bool g_in_kernel_init;
 
 AllocList::AllocList()
@@ -17,208 +26,134 @@ AllocList::AllocList(VRange span) : alloc_range(span)
     ASSERT(is_aligned(span.one_past_end(), 4096));
     ASSERT(g_phys_page_allocator.m_is_initialized);
 
-    m_first = take_from_hdr_freelist();
-    m_first->next = 0;
-    m_first->prev = 0;
-    m_first->alloc_range = span;
-
-    m_last = m_first;
+    add_free_range(span);
 }
 
+// best fit, the smallest free range that fits the buffer however its' start is aligned
 VRange AllocList::take_range(u64 wanted_size, u64 alignment)
 {
-    ASSERT(m_first);
-    ASSERT(m_last);
-
     ASSERT(is_aligned(wanted_size, 4096));
     ASSERT(is_aligned(alignment, 4096));
 
-    dbg_str("\nTAKE_RANGE START: "); dbg_uint(m_first->alloc_range.addr); dbg_str("\n");
-    u64 worst_case_size = wanted_size + alignment-1;
-    for(auto hdr = m_first; hdr; hdr = hdr->next) {
-        ASSERT(hdr->alloc_range.length != 0);
-        if(hdr->alloc_range.length >= worst_case_size) {
-            u64 aligned_addr = round_up_align(hdr->alloc_range.addr, alignment);
-            ASSERT(aligned_addr + wanted_size <= hdr->alloc_range.one_past_end());
-            VRange taken_range = {
-                aligned_addr,
-                wanted_size
-            };
-
-            AllocHeader hdr_copy = *hdr;
-            add_to_hdr_freelist(hdr);
-
-            // 2 unused ranges, before & after the taken_range
-            u64 unused_size_before = aligned_addr - hdr_copy.alloc_range.addr;
-            if(unused_size_before > 0) {
-                VRange unused = {
-                    hdr_copy.alloc_range.addr,
-                    unused_size_before
-                };
-                return_range(unused);
-            }
-
-            u64 unused_size_after = hdr_copy.alloc_range.one_past_end() - taken_range.one_past_end();
-            if(unused_size_after > 0) {
-                VRange unused = {
-                    taken_range.one_past_end(),
-                    unused_size_after
-                };
-                return_range(unused);
-            }
-
-            dbg_str("TAKE_RANGE END: "); dbg_uint(m_first->alloc_range.addr); dbg_str("\n\n");
-            return taken_range;
-        }
-    }
-
-    UNREACHABLE();
+    // free ranges are page aligned, so at most alignment-4096 bytes are skipped to align the start
+    u64 worst_case_size = wanted_size + alignment - 4096;
+    VRange *best_fit = m_by_size.lower_bound({0, worst_case_size});
+    ASSERT(best_fit);
+    VRange free_range = *best_fit;
+
+    u64 aligned_addr = round_up_align(free_range.addr, alignment);
+    ASSERT(aligned_addr + wanted_size <= free_range.one_past_end());
+    VRange taken_range = {
+        aligned_addr,
+        wanted_size
+    };
+    take_from(free_range, taken_range);
+    return taken_range;
 }
 
-void AllocList::return_range(VRange returned_range)
+// takes a specific range, which must be free
+// used to map a forked process' memory at the same addresses as in its' parent
+void AllocList::take_range_at(VRange wanted_range)
 {
-    // TODO can be skipped if check if range will be coalesced first
-    auto new_hdr = take_from_hdr_freelist();
-
-    new_hdr->alloc_range = returned_range;
-
-    if(!m_first) {
-        ASSERT(!m_last);
-        m_first = m_last = new_hdr;
-        m_first->next = m_first->prev = 0;
-        return;
-    }
-
-    if(new_hdr->alloc_range.addr < m_first->alloc_range.addr) {
-        new_hdr->next = m_first;
-        new_hdr->prev = 0;
-
-        m_first->prev = new_hdr;
-        m_first = new_hdr;
-        coalesce(new_hdr);
-        return;
-    }
+    ASSERT(is_aligned(wanted_range.addr, 4096));
+    ASSERT(is_aligned(wanted_range.length, 4096));
 
-    if(new_hdr->alloc_range.addr > m_last->alloc_range.addr) {
-        new_hdr->next = 0;
-        new_hdr->prev = m_last;
-
-        m_last->next = new_hdr;
-        m_last = new_hdr;
-        coalesce(new_hdr);
-        return;
-    }
-
-    for(auto search_hdr = m_first; search_hdr; search_hdr = search_hdr->next) {
-        ASSERT(search_hdr->alloc_range.addr != returned_range.addr);
-        ASSERT(search_hdr->alloc_range.length != 0);
-        if(search_hdr->alloc_range.addr > returned_range.addr) {
-            new_hdr->next = search_hdr;
-            new_hdr->prev = search_hdr->prev;
-
-            if(search_hdr->prev)
-                search_hdr->prev->next = new_hdr;
-            search_hdr->prev = new_hdr;
-
-            coalesce(new_hdr);
-            return;
-        }
-    }
-
-    UNREACHABLE();
+    VRange *containing = m_by_addr.floor({wanted_range.addr, 0});
+    ASSERT(containing);
+    ASSERT(wanted_range.one_past_end() <= containing->one_past_end());
+    take_from(*containing, wanted_range);
 }
 
-void AllocList::coalesce(AllocHeader *hdr)
+// removes taken_range from free_range, the parts before & after it stay free
+void AllocList::take_from(VRange free_range, VRange taken_range)
 {
-    ASSERT(hdr);
-    auto prev_hdr = hdr->prev;
-    auto next_hdr = hdr->next;
+    remove_free_range(free_range);
 
-    if(next_hdr) {
-        impl_coalesce(hdr, next_hdr);
+    // 2 unused ranges, before & after the taken_range
+    u64 unused_size_before = taken_range.addr - free_range.addr;
+    if(unused_size_before > 0) {
+        VRange unused = {
+            free_range.addr,
+            unused_size_before
+        };
+        add_free_range(unused);
     }
 
-    if(prev_hdr) {
-        impl_coalesce(prev_hdr, hdr);
+    u64 unused_size_after = free_range.one_past_end() - taken_range.one_past_end();
+    if(unused_size_after > 0) {
+        VRange unused = {
+            taken_range.one_past_end(),
+            unused_size_after
+        };
+        add_free_range(unused);
     }
 }
 
-void AllocList::impl_coalesce(AllocHeader *curr, AllocHeader *next_hdr)
+// coalesces the returned range with the free ranges right before & after it
+void AllocList::return_range(VRange returned_range)
 {
-    ASSERT(next_hdr->prev == curr);
-    ASSERT(curr->next = next_hdr);
-
-    auto curr_end = curr->alloc_range.addr + curr->alloc_range.length;
-    if(curr_end == next_hdr->alloc_range.addr) {
-        curr->alloc_range.length += next_hdr->alloc_range.length;
-
-        curr->next = next_hdr->next;
-        if(next_hdr->next)
-            next_hdr->next->prev = curr;
+    ASSERT(returned_range.length != 0);
+    VRange coalesced = returned_range;
+
+    VRange *prev = m_by_addr.floor({returned_range.addr, 0});
+    if(prev) {
+        ASSERT(prev->one_past_end() <= returned_range.addr);
+        if(prev->one_past_end() == returned_range.addr) {
+            VRange prev_range = *prev;
+            remove_free_range(prev_range);
+            coalesced.addr = prev_range.addr;
+            coalesced.length += prev_range.length;
+        }
+    }
 
-        add_to_hdr_freelist(next_hdr);
+    VRange *next = m_by_addr.lower_bound({returned_range.addr, 0});
+    if(next) {
+        ASSERT(returned_range.one_past_end() <= next->addr);
+        if(returned_range.one_past_end() == next->addr) {
+            VRange next_range = *next;
+            remove_free_range(next_range);
+            coalesced.length += next_range.length;
+        }
     }
+
+    add_free_range(coalesced);
 }
 
-void AllocList::add_to_hdr_freelist(AllocHeader *hdr)
+void AllocList::add_free_range(VRange range)
 {
-    if(m_first == hdr)
-        m_first = m_first->next;
-    if(m_last == hdr)
-        m_last = m_last->prev;
-
-    // TODO these can be merged with the above 2 if statements
-    if(hdr->next)
-        hdr->next->prev = hdr->prev;
-    if(hdr->prev)
-        hdr->prev->next = hdr->next;
-
-    // zero out header to catch bugs
-    hdr->next = 0;
-    hdr->prev = 0;
-    hdr->alloc_range.addr = 0;
-    hdr->alloc_range.length = 0;
-
-    hdr->next = m_freelist;
-    m_freelist = hdr;
+    ASSERT(range.length != 0);
+    m_by_addr.insert(range);
+    m_by_size.insert(range);
+    m_free_space += range.length;
 }
 
-void AllocList::expand_hdr_freelist()
+void AllocList::remove_free_range(VRange range)
 {
-    paddr new_page = alloc_phys_page();
-
-    u32 hdrs_per_page = 4096 / sizeof(AllocHeader);
-
-    // page is 4kb aligned, so no need to handle alignment of AllocHeader
-    // TODO is it better performance to zero and link entire page of free hdrs first then add only the first to freelist?
-    ASSERT(4096 % alignof(AllocHeader) == 0);
-    AllocHeader *base_hdr = (AllocHeader *)new_page; 
-    for(u32 i = 0; i < hdrs_per_page; ++i) {
-        AllocHeader *hdr = base_hdr + i;
-        add_to_hdr_freelist(hdr);
-    }
+    bool removed = m_by_addr.remove(range);
+    ASSERT(removed);
+    removed = m_by_size.remove(range);
+    ASSERT(removed);
+    m_free_space -= range.length;
 }
 
-AllocList::AllocHeader *AllocList::take_from_hdr_freelist()
+// frees the pages of both trees
+void AllocList::clear()
 {
-    if(!m_freelist) {
-        expand_hdr_freelist();
-    }
-
-    ASSERT(m_freelist);
-    auto free_hdr = m_freelist;
-    m_freelist = m_freelist->next;
-    return free_hdr;
+    m_by_addr.clear();
+    m_by_size.clear();
+    m_free_space = 0;
 }
 
 // for testing/debugging purposes
 u64 AllocList::get_free_space()
 {
-    u64 sum = 0;
-    for(auto hdr = m_first; hdr; hdr = hdr->next) {
-        sum += hdr->alloc_range.length;
-    }
-    return sum;
+    return m_free_space;
+}
+
+// for testing/debugging purposes, this is how fragmented the vspace is
+u64 AllocList::get_free_range_count()
+{
+    return m_by_addr.m_count;
 }
 
 VSpace::VSpace() : m_pml4t(0)
@@ -230,20 +165,29 @@ VSpace::VSpace(VRange alloc_span) : m_pml4t(0), m_vrange_allocator(alloc_span)
 {
     // NOTE for processes, the pml4t must be available in both the kernel vspace and the process vspace
     //      the simplest way to do this is to put the pml4t (and all other page tables) in the pmap memory
-    m_pml4t = (PML4T *)g_phys_page_allocator.allocate_page();
+    m_pml4t = (PML4T *)alloc_phys_page_unzeroed();
     m_pml4t->clear();
-    m_vrange_allocator = AllocList(alloc_span);
+
+    m_pcid = g_next_pcid;
+    g_next_pcid = g_next_pcid % (PCID_COUNT - 1) + 1;
 }
 
 VSpace::~VSpace()
 {
     ASSERT(this != &g_kernel_vspace); // there is a bug somwhere if the destructor for g_kernel_vspace is called
+    ASSERT(current_pml4t() != m_pml4t);
+
+    // the TLB entries left with this vspace's PCID are flushed when the PCID is next loaded
+    if(g_pcid_owners[m_pcid] == this)
+        g_pcid_owners[m_pcid] = nullptr;
 
     // clear all
-// TODO free_page_tables currently does not reference count pages, so there is room for error here if this is called
-//      when there are pages shared between multiple vspaces
+// NOTE pages that are still mapped only lose this vspace's reference to them, so pages shared with other vspaces
+//      (e.g. the copy on write pages of a forked process) stay around
     free_page_tables(m_pml4t);
     m_pml4t = 0;
+    m_allocations.clear();
+    m_vrange_allocator.clear();
 }
 
 extern PML4T g_kernel_pml4t;
@@ -257,111 +201,116 @@ void VSpace::init_kernel_vspace()
     g_kernel_vspace.m_vrange_allocator = AllocList(kernel_vspace);
 }
 
-u64 VSpace::worst_case_size(u64 size, u64 alignment)
+// buffers start at the start of their vrange, which is at least page aligned, so an alignment only needs extra space
+// if it's more than a page, and then it's taken care of by the vrange allocator
+u64 VSpace::worst_case_size(u64 size, u64)
 {
-    u64 adjusted_align = (alignment == 0) ? 0 : alignment-1;
-    u64 worst_case_size = round_up_align(size + adjusted_align, 4096);
-    return worst_case_size;
+    return round_up_align(size, 4096);
 }
 
-VSpace::VBuffer VSpace::alloc_vbuffer(u64 size, u64 alignment)
+// takes a vrange for a buffer of size bytes and records it in m_allocations, the buffer starts at the start of the
+// returned range
+VRange VSpace::alloc_vbuffer(u64 size, u64 alignment)
 {
-    // this code is written on the assumption that alignment is less than 4096
-    // otherwise buffer_start will be on a different page than the AllocHeader, which will
-    // lead to problems for get_allocated_vrange_from_ptr()
-
     ASSERT(size > 0);
 
     dbg_str("POW2 "); dbg_uint(alignment);
     ASSERT(is_power_of_2(alignment));
 
-    u64 round_up_alignment = round_up_align(4096, alignment);
-    u64 page_alignment = (round_up_alignment / 4096) * 4096;
-    u64 alloc_alignment = max((u64)4096, page_alignment - 4096);
-    u64 in_page_alignment = round_up_alignment % 4096;
-    //u64 header_page_alignment -= round_down_align(in_page_alignment;
-    // round up to page align buffer, then add one page for the AllocHeader
-    ASSERT(in_page_alignment < 4096);
-    u64 alloc_size = worst_case_size(size, in_page_alignment) + 4096;
-    auto full_alloc_range = m_vrange_allocator.take_range(alloc_size, alloc_alignment);
-
-    VRange header_alloc_range = {
-        full_alloc_range.addr,
-        4096
-    };
-    u64 alloc_hdr_start = round_up_align(header_alloc_range.addr, alignof(AllocHeader));
-
-    VRange buffer_alloc_range = full_alloc_range.subtract(header_alloc_range);
-    u64 buffer_start = round_up_align(buffer_alloc_range.addr, in_page_alignment);
-    u64 buffer_end = buffer_start + size;
-
-    ASSERT(is_aligned(full_alloc_range.addr, 4096));
-    ASSERT(is_aligned(full_alloc_range.one_past_end(), 4096));
-
-    ASSERT(is_aligned(full_alloc_range.addr, alloc_alignment));
-    ASSERT(full_alloc_range.length == alloc_size);
-
-    ASSERT(is_aligned(buffer_alloc_range.addr, page_alignment));
-    ASSERT(header_alloc_range.length + buffer_alloc_range.length == full_alloc_range.length);
-    ASSERT(buffer_alloc_range.length >= size);
+    u64 alloc_size = worst_case_size(size, alignment);
+    u64 alloc_alignment = max((u64)4096, alignment);
+    auto alloc_range = m_vrange_allocator.take_range(alloc_size, alloc_alignment);
 
-    ASSERT(is_aligned(buffer_start, alignment));
-    ASSERT(buffer_end <= buffer_alloc_range.one_past_end());
-    
-// this makes sure the computation to get the header from a ptr (get_allocated_vrage_from_ptr()) will work
-    ASSERT(round_down_align(buffer_start, 4096) == buffer_alloc_range.addr); 
+    ASSERT(is_aligned(alloc_range.addr, alloc_alignment));
+    ASSERT(alloc_range.length == alloc_size);
 
-    return {full_alloc_range, header_alloc_range, buffer_alloc_range, alloc_hdr_start, buffer_start};
+    m_allocations.insert(alloc_range);
+    return alloc_range;
 }
 
-void VSpace::reload_cr3_if_needed()
+// the value to write to cr3 to load this vspace, or 0 if it's already loaded
+// with PCIDs, the TLB entries from the last time this vspace was loaded are kept, unless another vspace has used its'
+// PCID since, or its' mappings were changed while it wasn't loaded (see flush_tlb())
+u64 VSpace::cr3_to_load()
 {
-    // NOTE: all process vspaces share the kernel page tables, so must reload cr3 if any changes
-    //       happen to kernel tables
-    // TODO it may be necessary to implement a more general mechanism for objs shared between mutliple processes
-    // TODO speed this up by using invlpg instead?
-    if(m_pml4t == current_pml4t() || m_pml4t == kernel_pml4t()) {
-        reload_cr3();
+    if(current_pml4t() == m_pml4t)
+        return 0;
+    u64 cr3 = (u64)m_pml4t;
+    if(g_tlb_has_pcids) {
+        cr3 |= m_pcid;
+        if(g_pcid_owners[m_pcid] == this && !m_tlb_is_stale)
+            cr3 |= CR3_NO_FLUSH;
+        g_pcid_owners[m_pcid] = this;
+    }
+    m_tlb_is_stale = false;
+    return cr3;
+}
+
+void VSpace::load()
+{
+    u64 cr3 = cr3_to_load();
+    if(cr3)
+        write_cr3(cr3);
+}
+
+// flushes the TLB entries for vrange after its' mappings were changed or removed
+// tables_freed is set if page tables were freed as well, since the paging structure caches may still point to them
+// NOTE all process vspaces share the kernel page tables, whose entries are global. invlpg flushes a global entry
+//      under every PCID, but the paging structure caches only under the current one
+void VSpace::flush_tlb(VRange vrange, bool tables_freed)
+{
+    bool is_small = vrange.length / 4096 <= TLB_INVLPG_MAX_PAGES;
+    if(m_pml4t == kernel_pml4t()) {
+        if(is_small && !(tables_freed && g_tlb_has_pcids))
+            flush_tlb_pages(vrange);
+        else
+            flush_tlb_all();
+    } else if(m_pml4t == current_pml4t()) {
+        if(is_small)
+            flush_tlb_pages(vrange);
+        else
+            reload_cr3(); // the non-global entries of the current PCID
+    } else {
+        m_tlb_is_stale = true;
     }
 }
 
 vaddr VSpace::allocate_size(u64 size, u64 alignment)
 {
     dbg_str("VSPACE::ALLOC_SIZE\n");
-    VBuffer vbuf = alloc_vbuffer(size, alignment);
-    auto full_alloc_range = vbuf.full_alloc_range;
-    //auto header_alloc_range = vbuf.header_alloc_range;
-    auto buffer_alloc_range = vbuf.buffer_alloc_range;
-    auto alloc_hdr_start = vbuf.alloc_hdr_start;
-    auto buffer_start = vbuf.buffer_start;
-
-    map_vrange(full_alloc_range, m_pml4t);
-    reload_cr3_if_needed();
-    
-    auto hdr = (AllocHeader *)alloc_hdr_start;
-    hdr->buffer_alloc_range = buffer_alloc_range;
+    VRange alloc_range = alloc_vbuffer(size, alignment);
 
-    return buffer_start;
+    map_vrange(alloc_range, m_pml4t); // the range wasn't mapped, so there is nothing in the TLB to flush
+
+    return alloc_range.addr;
 }
 
-// NOTE: each VSpace that allocates a VObject must have its' own separate header, so the header is allocated & mapped separately from the rest of the pages
 vaddr VSpace::allocate_pages(const Vector<paddr>& pages, u64 alignment)
 {
     dbg_str("VSPACE::ALLOC_PAGES\n");
     u64 size = pages.length * 4096; // pages.length is already based off of worst_case_size()
-    VBuffer vbuf = alloc_vbuffer(size, alignment);
-    //auto full_alloc_range = vbuf.full_alloc_range;
-    auto header_alloc_range = vbuf.header_alloc_range;
-    auto buffer_alloc_range = vbuf.buffer_alloc_range;
-    auto alloc_hdr_start = vbuf.alloc_hdr_start;
-    auto buffer_start = vbuf.buffer_start;
-
-    map_vrange(header_alloc_range, m_pml4t);
-    map_vrange(buffer_alloc_range, m_pml4t, pages);
-    reload_cr3_if_needed();
-    
-    auto hdr = (AllocHeader *)alloc_hdr_start;
-    hdr->buffer_alloc_range = buffer_alloc_range;
+    VRange alloc_range = alloc_vbuffer(size, alignment);
+
+    map_vrange(alloc_range, m_pml4t, pages);
+
+    return alloc_range.addr;
+}
+
+// like allocate_pages(), but the buffer is placed at buffer_start, which must be free
+// used to give a forked process the same memory layout as its' parent
+// NOTE this vspace doesn't have to be loaded
+vaddr VSpace::allocate_pages_at(const Vector<paddr>& pages, vaddr buffer_start)
+{
+    dbg_str("VSPACE::ALLOC_PAGES_AT\n");
+    ASSERT(is_aligned(buffer_start, 4096));
+    VRange alloc_range = {
+        buffer_start,
+        pages.length * 4096
+    };
+    m_vrange_allocator.take_range_at(alloc_range);
+    m_allocations.insert(alloc_range);
+
+    map_vrange(alloc_range, m_pml4t, pages);
 
     return buffer_start;
 }
@@ -373,6 +322,14 @@ vaddr VSpace::allocate_vobj(VObject *vobj)
     mapped_vobjs.append(vobj);
     return addr;
 }
+
+vaddr VSpace::allocate_vobj_at(VObject *vobj, vaddr addr)
+{
+    dbg_str("VSPACE::ALLOC_VOBJ_AT\n");
+    allocate_pages_at(vobj->underlying_pages, addr);
+    mapped_vobjs.append(vobj);
+    return addr;
+}
 void VSpace::free_vobj(VObject *vobj, vaddr addr)
 {
     dbg_str("VSPACE::FREE_VOBJ\n");
@@ -396,56 +353,73 @@ void VSpace::free_size(vaddr ptr)
 {
     dbg_str("VSPACE::FREE_SIZE\n");
     dbg_str("FREE PTR: "); dbg_uint(ptr); dbg_str("\n");
-    AllocedVRanges ranges = get_alloc_vranges_from_ptr(ptr);
-    auto header_alloc_range = ranges.header_alloc_range;
-    auto buffer_alloc_range = ranges.buffer_alloc_range;
-
-    ASSERT(header_alloc_range.one_past_end() == buffer_alloc_range.addr);
-    VRange full_alloc_range = {
-        header_alloc_range.addr,
-        header_alloc_range.length + buffer_alloc_range.length
-    };
+    VRange alloc_range = take_alloc_vrange(ptr);
 
-    unmap_vrange(full_alloc_range, m_pml4t);
+    bool tables_freed = unmap_vrange(alloc_range, m_pml4t);
+    flush_tlb(alloc_range, tables_freed);
 
-    reload_cr3_if_needed();
-
-    m_vrange_allocator.return_range(full_alloc_range);
+    m_vrange_allocator.return_range(alloc_range);
 }
 
 void VSpace::free_pages(const Vector<paddr>& pages, vaddr ptr)
 {
     dbg_str("VSPACE::FREE_PAGES\n");
-    AllocedVRanges ranges = get_alloc_vranges_from_ptr(ptr);
-    auto header_alloc_range = ranges.header_alloc_range;
-    auto buffer_alloc_range = ranges.buffer_alloc_range;
-    ASSERT(header_alloc_range.one_past_end() == buffer_alloc_range.addr);
-    VRange full_alloc_range = {
-        header_alloc_range.addr,
-        header_alloc_range.length + buffer_alloc_range.length
-    };
+    VRange alloc_range = take_alloc_vrange(ptr);
 
-    unmap_vrange(header_alloc_range, m_pml4t);
-    unmap_vrange(buffer_alloc_range, m_pml4t, pages);
+    bool tables_freed = unmap_vrange(alloc_range, m_pml4t, pages);
+    flush_tlb(alloc_range, tables_freed);
 
-    reload_cr3_if_needed();
+    m_vrange_allocator.return_range(alloc_range);
+}
 
-    m_vrange_allocator.return_range(full_alloc_range);
+// returns the VObject mapped at addr, or nullptr if there isn't one
+VObject *VSpace::vobj_at(vaddr addr)
+{
+    for(u32 i = 0; i < mapped_vobjs.length; ++i) {
+        VObject *vobj = mapped_vobjs[i];
+        vaddr start = vobj->mapped_addr(*this);
+        if(addr >= start && addr < start + vobj->underlying_pages.length * 4096)
+            return vobj;
+    }
+    return nullptr;
 }
 
-VSpace::AllocedVRanges VSpace::get_alloc_vranges_from_ptr(vaddr ptr)
+// allocates the pages of any demand paged VObjects in the range that haven't been touched yet, and if the range is
+// going to be written, gives the process its' own copy of any copy on write pages in it
+// NOTE the kernel must call this before it accesses a user buffer, since a page fault inside a syscall can't be
+//      handled (see page_fault_handler()). the fs lock must be held
+void VSpace::populate_pages(vaddr addr, u64 size, bool is_write)
 {
-    // TODO is there a way to do a sanity check that ptr is valid and was allocated by allocate() ?
-    vaddr base_of_allocation = round_down_align(ptr, 4096);
-    VRange header_alloc_range = {
-        base_of_allocation - 4096,
-        4096
-    };
-    u64 alloc_hdr_start = round_up_align(header_alloc_range.addr, alignof(AllocHeader));
-    auto hdr = (AllocHeader *)alloc_hdr_start;
-    VRange buffer_alloc_range = hdr->buffer_alloc_range;
+    if(size == 0)
+        return;
+    vaddr end = addr + size;
+    for(u32 i = 0; i < mapped_vobjs.length; ++i) {
+        VObject *vobj = mapped_vobjs[i];
+        vaddr start = vobj->mapped_addr(*this);
+        vaddr vobj_end = start + vobj->underlying_pages.length * 4096;
+        if(end <= start || addr >= vobj_end)
+            continue;
+
+        u64 first = (max(addr, start) - start) / 4096;
+        u64 last = (min(end, vobj_end) - 1 - start) / 4096;
+        for(u64 page_i = first; page_i <= last; ++page_i) {
+            if(!vobj->underlying_pages[page_i])
+                vobj->fill_page(page_i);
+            if(is_write && vobj->page_is_cow(page_i))
+                vobj->copy_page_on_write(page_i);
+        }
+    }
+}
 
-    return {header_alloc_range, buffer_alloc_range};
+// removes the allocation that starts at ptr from m_allocations and returns its' vrange
+VRange VSpace::take_alloc_vrange(vaddr ptr)
+{
+    VRange key = {ptr, 0};
+    VRange *found = m_allocations.find(key);
+    ASSERT(found); // ptr wasn't returned by allocate_size() or allocate_pages()
+    VRange alloc_range = *found;
+    m_allocations.remove(key);
+    return alloc_range;
 }
 
 // for testing/debugging purposes
@@ -500,6 +474,20 @@ PML4T *kernel_pml4t()
     return &g_kernel_pml4t;
 }
 
+// allocates page_count pages in the largest physically contiguous runs that are available
+void append_phys_pages(Vector<paddr>& pages, u64 page_count)
+{
+    pages.expand_capacity(pages.length + page_count);
+    while(page_count > 0) {
+        u32 order = 0;
+        paddr run = alloc_phys_run(phys_run_order(page_count), &order);
+        u64 run_length = (u64)1 << order;
+        for(u64 i = 0; i < run_length; ++i)
+            pages.append(run + i*4096);
+        page_count -= run_length;
+    }
+}
+
 void VObject::initialize_interrupt_stack(u64 alloc_size, u64 alignment)
 {
     g_interrupt_stack_vobj.underlying_pages = Vector<paddr>();
@@ -508,11 +496,7 @@ void VObject::initialize_interrupt_stack(u64 alloc_size, u64 alignment)
     // TODO this is a copy of the constructor
     u64 worst_case_vrange_size = VSpace::worst_case_size(alloc_size, alignment);
     u64 page_count = round_up_divide(worst_case_vrange_size, 4096);
-    g_interrupt_stack_vobj.underlying_pages.expand_capacity(page_count);
-    for(u64 i = 0; i < page_count; ++i) {
-        paddr page = g_phys_page_allocator.allocate_page();
-        g_interrupt_stack_vobj.underlying_pages.append(page);
-    }
+    append_phys_pages(g_interrupt_stack_vobj.underlying_pages, page_count);
 }
 
 VObject::VObject() : underlying_pages(), alignment(0) {}
@@ -523,12 +507,116 @@ VObject::VObject(u64 alloc_size, u64 align) : underlying_pages(0), alignment(ali
     ASSERT(g_kernel_vspace_is_initialized);
     u64 worst_case_vrange_size = VSpace::worst_case_size(alloc_size, alignment);
     u64 page_count = round_up_divide(worst_case_vrange_size, 4096);
+    append_phys_pages(underlying_pages, page_count);
+    ASSERT(underlying_pages.length == page_count);
+}
+
+// a file backed VObject for size bytes of the file starting at offset, none of the pages are allocated until they
+// are touched
+// NOTE offset must be page aligned
+VObject::VObject(u32 inode_num, u32 generation, u64 offset, u64 size) : underlying_pages(0), alignment(4096)
+{
+    dbg_str("VOBJECT() FILE\n");
+    ASSERT(g_kernel_vspace_is_initialized);
+    ASSERT(inode_num != 0);
+    ASSERT(is_aligned(offset, 4096));
+    file.inode_num = inode_num;
+    file.generation = generation;
+    file.offset = offset;
+
+    u64 page_count = round_up_divide(size, 4096);
     underlying_pages.expand_capacity(page_count);
-    for(u64 i = 0; i < page_count; ++i) {
-        paddr page = g_phys_page_allocator.allocate_page();
-        underlying_pages.append(page);
+    for(u64 i = 0; i < page_count; ++i)
+        underlying_pages.append(0);
+}
+
+// makes a copy of this VObject for a forked process, the pages are shared until either VObject writes to them
+// NOTE the writable pages become read-only in every place this VObject is already mapped, the first write to one of
+//      them copies it (see copy_page_on_write())
+VObject *VObject::clone_copy_on_write()
+{
+    ASSERT(!is_file_backed()); // mapped files aren't inherited by forked processes
+
+    auto clone = (VObject *)kmalloc(sizeof(VObject), alignof(VObject));
+    new ((void *)clone) VObject();
+    clone->alignment = alignment;
+    clone->exec_image = exec_image;
+    if(exec_image)
+        ++exec_image->ref_count;
+
+    if(page_is_copy_on_write.length == 0) {
+        page_is_copy_on_write.expand_capacity(underlying_pages.length);
+        for(u64 i = 0; i < underlying_pages.length; ++i)
+            page_is_copy_on_write.append(false);
+    }
+
+    clone->underlying_pages.expand_capacity(underlying_pages.length);
+    clone->page_is_read_only.expand_capacity(page_is_read_only.length);
+    clone->page_is_copy_on_write.expand_capacity(underlying_pages.length);
+    for(u64 i = 0; i < underlying_pages.length; ++i) {
+        paddr page = underlying_pages[i];
+        bool is_read_only = i < page_is_read_only.length && page_is_read_only[i];
+        if(page) {
+            ref_phys_page(page);
+            if(!is_read_only)
+                page_is_copy_on_write[i] = true;
+        }
+        clone->underlying_pages.append(page);
+        clone->page_is_copy_on_write.append(page_is_copy_on_write[i]);
+    }
+    for(u64 i = 0; i < page_is_read_only.length; ++i)
+        clone->page_is_read_only.append(page_is_read_only[i]);
+
+    for(u32 i = 0; i < vspaces_mapped_in.length; ++i) {
+        VSpaceMapping& mapping = vspaces_mapped_in[i];
+        for(u64 page_i = 0; page_i < underlying_pages.length; ++page_i) {
+            if(page_is_copy_on_write[page_i]) {
+                PTE *pte = vaddr_to_pte(mapping.alloced_addr + page_i * 4096, mapping.vspace->m_pml4t);
+                ASSERT(pte && pte->bitfield.present);
+                pte->bitfield.writable = 0;
+            }
+        }
+        mapping.vspace->flush_tlb({mapping.alloced_addr, underlying_pages.length * 4096}, false);
+    }
+
+    return clone;
+}
+
+bool VObject::page_is_cow(u64 index)
+{
+    return index < page_is_copy_on_write.length && page_is_copy_on_write[index];
+}
+
+// pages that must be mapped read-only, writes to copy on write pages are caught by page_fault_handler()
+bool VObject::page_is_protected(u64 index)
+{
+    return (index < page_is_read_only.length && page_is_read_only[index]) || page_is_cow(index);
+}
+
+// gives this VObject its' own writable copy of a copy on write page, the page is re-used if no other VObject shares
+// it anymore
+void VObject::copy_page_on_write(u64 index)
+{
+    ASSERT(page_is_cow(index));
+    paddr page = underlying_pages[index];
+    ASSERT(page);
+    if(phys_page_ref_count(page) > 1) {
+        paddr copy = alloc_phys_page_unzeroed();
+        memmove_workaround((void *)copy, (void *)page, 4096);
+        free_phys_page(page);
+        page = copy;
+        underlying_pages[index] = page;
+    }
+    page_is_copy_on_write[index] = false;
+
+    for(u32 i = 0; i < vspaces_mapped_in.length; ++i) {
+        VSpaceMapping& mapping = vspaces_mapped_in[i];
+        PTE *pte = vaddr_to_pte(mapping.alloced_addr + index * 4096, mapping.vspace->m_pml4t);
+        ASSERT(pte && pte->bitfield.present);
+        pte->set_phys_addr(page);
+        pte->bitfield.writable = 1;
+        mapping.vspace->flush_tlb({mapping.alloced_addr + index * 4096, 4096}, false);
     }
-    ASSERT(underlying_pages.length == page_count);
 }
 
 VObject::~VObject()
@@ -537,18 +625,153 @@ VObject::~VObject()
     ASSERT(vspaces_mapped_in.length == 0); // object does not keep track of the vranges it is mapped to, so client code must keep track of this and unmap all vranges before destroying VObject
     for(u64 i = 0; i < underlying_pages.length; ++i) {
         paddr page = underlying_pages[i];
-        g_phys_page_allocator.free_page(page);
+        if(page) // demand paged pages that were never touched
+            g_phys_page_allocator.free_page(page);
+    }
+    if(exec_image)
+        exec_image_release(exec_image);
+}
+
+bool VObject::is_file_backed()
+{
+    return file.inode_num != 0;
+}
+
+bool VObject::is_demand_paged()
+{
+    return is_file_backed() || exec_image;
+}
+
+vaddr VObject::mapped_addr(VSpace& vspace)
+{
+    for(u32 i = 0; i < vspaces_mapped_in.length; ++i)
+        if(vspaces_mapped_in[i].vspace == &vspace)
+            return vspaces_mapped_in[i].alloced_addr;
+    UNREACHABLE();
+    return 0;
+}
+
+// allocates an untouched page of a demand paged VObject
+// NOTE the fs lock must be held
+void VObject::fill_page(u64 index)
+{
+    if(is_file_backed())
+        fill_file_page(index);
+    else
+        fill_exec_page(index);
+}
+
+// allocates the page and reads its' part of the file into it, then maps it in everywhere the VObject is mapped
+// NOTE the fs lock must be held. the part of the page past the end of the file is left zeroed, and so is the whole
+//      page if the file was deleted
+void VObject::fill_file_page(u64 index)
+{
+    ASSERT(is_file_backed());
+    ASSERT(underlying_pages[index] == 0);
+    paddr page = g_phys_page_allocator.allocate_page();
+    // the readahead state makes touching the pages in order read the file in large runs, like read()ing it would
+    if(fs_open_file_is_valid(file.inode_num, file.generation))
+        fs_read_inode(file.inode_num, (u8 *)page, file.offset + index * 4096, 4096, &file.readahead);
+    underlying_pages[index] = page;
+    map_filled_page(index);
+}
+
+// gets the page from the executable image (code is shared, the bss is zeroed), then maps it in everywhere the
+// VObject is mapped
+// NOTE the fs lock must be held
+void VObject::fill_exec_page(u64 index)
+{
+    ASSERT(exec_image);
+    ASSERT(underlying_pages[index] == 0);
+    underlying_pages[index] = exec_image_fill_page(exec_image, index);
+    map_filled_page(index);
+}
+
+// NOTE the page wasn't mapped before, so it can't be cached in the TLB
+void VObject::map_filled_page(u64 index)
+{
+    paddr page = underlying_pages[index];
+    bool is_protected = page_is_protected(index);
+    for(u32 i = 0; i < vspaces_mapped_in.length; ++i) {
+        VSpaceMapping& mapping = vspaces_mapped_in[i];
+        vaddr addr = mapping.alloced_addr + index * 4096;
+        map_page(addr, page, mapping.vspace->m_pml4t);
+        if(is_protected)
+            vaddr_to_pte(addr, mapping.vspace->m_pml4t)->bitfield.writable = 0;
+    }
+}
+
+// writes the pages that were modified since they were read in or last written back to the file
+// the CPU sets the dirty bit in the page table entry when a page is written, so this clears it after the write
+// NOTE the fs lock must be held. the file is never extended, the part of the mapping past the end of the file is
+//      dropped
+void VObject::writeback_file_pages()
+{
+    ASSERT(is_file_backed());
+    if(!fs_open_file_is_valid(file.inode_num, file.generation))
+        return;
+
+    u64 file_size = fs_stat_inode(file.inode_num).size;
+    for(u64 page_i = 0; page_i < underlying_pages.length; ++page_i) {
+        paddr page = underlying_pages[page_i];
+        if(!page)
+            continue;
+
+        bool is_dirty = false;
+        for(u32 i = 0; i < vspaces_mapped_in.length; ++i) {
+            VSpaceMapping& mapping = vspaces_mapped_in[i];
+            PTE *pte = vaddr_to_pte(mapping.alloced_addr + page_i * 4096, mapping.vspace->m_pml4t);
+            ASSERT(pte && pte->bitfield.present);
+            if(pte->bitfield.dirty) {
+                is_dirty = true;
+                pte->bitfield.dirty = 0;
+            }
+        }
+
+        u64 offset = file.offset + page_i * 4096;
+        if(!is_dirty || offset >= file_size)
+            continue;
+        fs_write_inode(file.inode_num, (u8 *)page, offset, min((u64)4096, file_size - offset));
+    }
+
+    // the cleared dirty bits may still be cached in the TLB, in which case the next write wouldn't set them again
+    for(u32 i = 0; i < vspaces_mapped_in.length; ++i) {
+        VSpaceMapping& mapping = vspaces_mapped_in[i];
+        mapping.vspace->flush_tlb({mapping.alloced_addr, underlying_pages.length * 4096}, false);
     }
 }
 
 vaddr VObject::map(VSpace& map_into)
 {
     vaddr addr = map_into.allocate_vobj(this);
+    protect_mapped_pages(map_into, addr);
     VSpaceMapping mapping = {&map_into, addr};
     vspaces_mapped_in.append(mapping);
     return addr;
 }
 
+// maps the VObject at addr, which must be free (see VSpace::allocate_pages_at())
+vaddr VObject::map_at(VSpace& map_into, vaddr addr)
+{
+    map_into.allocate_vobj_at(this, addr);
+    protect_mapped_pages(map_into, addr);
+    VSpaceMapping mapping = {&map_into, addr};
+    vspaces_mapped_in.append(mapping);
+    return addr;
+}
+
+// NOTE the new mappings haven't been used yet, so they can't be cached in the TLB
+void VObject::protect_mapped_pages(VSpace& mapped_into, vaddr addr)
+{
+    for(u64 i = 0; i < underlying_pages.length; ++i) {
+        if(underlying_pages[i] && page_is_protected(i)) {
+            PTE *pte = vaddr_to_pte(addr + i * 4096, mapped_into.m_pml4t);
+            ASSERT(pte && pte->bitfield.present);
+            pte->bitfield.writable = 0;
+        }
+    }
+}
+
 void VObject::unmap(VSpace& map_outof)
 {
     bool found = false;
@@ -3,6 +3,8 @@
 #include "kernel/page_tables.h"
 #include "kernel/range.h"
 #include "kernel/vector.h"
+#include "kernel/readahead.h"
+#include "kernel/avl_tree.h"
 
 // resource: Unix Interals (Uresh Vahalia), chapter 12
 // TODO implement:
@@ -40,29 +42,35 @@
 //      also noteworthy is that each freelist entry takes up an entire page, just to store a freelist pointer
 //      also because we are dealing with vranges, any gaps between the allocated buffers are irrelevant, since that space will not be maped to physical pages
 //      buddy allocators don't use freelist entries like power of 2 freelist allocators do, but they are more complicated
-//      I may use object pool / slab allocator for fixed size kernel objects in the future if I have time to implement this after rest of project is completed
+//      small kmalloc() requests (2KB or less) now come from the slab allocator instead (see slab.cpp)
 
 // this is based off the 'resource map' as described in Unix Internals (Uresh Vahalia) chapter 12
-// NOTE: this does not free physical pages that are no longer used
-//       pages that are no longer used will stay around with their freelist entries
-//       this is not ideal, but it will still lead to less memory usage than the alternative allocators
-//       if this becomes an issue, a prune() method can be added to look for pages that contain nothing but freelist entries, and then those pages can be freed and their freelist entries discarded
+// the free vranges are kept in 2 trees, one ordered by address to find the neighbours a returned range coalesces with
+// (and the range containing a given address), and one ordered by size for best fit allocation, so both taking and
+// returning a range are O(log n) in the number of free ranges
+// NOTE: the tree nodes are only freed along with the AllocList (see clear())
 
 bool is_page_mapped_pmap(paddr, PML4T *);
-struct AllocList
+struct VRangeAddrLess
+{
+    bool operator()(const VRange& a, const VRange& b) { return a.addr < b.addr; }
+};
+// ties are broken by address, so every free range is a distinct element
+struct VRangeSizeLess
 {
-    struct AllocHeader
+    bool operator()(const VRange& a, const VRange& b)
     {
-        AllocHeader *next;
-        AllocHeader *prev;
-        VRange alloc_range;
-    };
-
-    // TODO look over this code to see if the 0 first, last and 0 next and prev cases are accounted for properly
-    AllocHeader *m_first = 0;
-    AllocHeader *m_last = 0; // TODO is there any reason to track the last entry?
+        if(a.length != b.length)
+            return a.length < b.length;
+        return a.addr < b.addr;
+    }
+};
 
-    AllocHeader *m_freelist = 0;
+struct AllocList
+{
+    AvlTree<VRange, VRangeAddrLess> m_by_addr = {};
+    AvlTree<VRange, VRangeSizeLess> m_by_size = {};
+    u64 m_free_space = 0;
 
     VRange alloc_range = {};
 
@@ -70,21 +78,19 @@ struct AllocList
     AllocList(VRange span);
 
     VRange take_range(u64, u64);
+    void take_range_at(VRange);
+    void take_from(VRange, VRange);
 
     void return_range(VRange);
 
-    void coalesce(AllocHeader *);
-
-    void impl_coalesce(AllocHeader *, AllocHeader *);
-
-    void add_to_hdr_freelist(AllocHeader *);
-
-    void expand_hdr_freelist();
+    void add_free_range(VRange);
+    void remove_free_range(VRange);
 
-    AllocHeader *take_from_hdr_freelist();
+    void clear();
 
     // for testing/debugging purposes
     u64 get_free_space();
+    u64 get_free_range_count();
 };
 
 struct VObject;
@@ -96,28 +102,13 @@ struct VSpace
     AllocList m_vrange_allocator = {};
     Vector<VObject *> mapped_vobjs = {};
 
-    // this header is specifically to keep track of the allocation size, so that given a pointer, the alloc_size can be found
-    // this allows for returning the entire allocated range to vrange_allocator
-    struct AllocHeader
-    {
-        VRange buffer_alloc_range;
-    };
+    // the vrange of each buffer handed out by allocate_size() and allocate_pages(), keyed by its' start (which is
+    // the pointer that was returned), so given a pointer, the entire allocated range can be returned to
+    // m_vrange_allocator. this used to be kept in a header page in front of every buffer
+    AvlTree<VRange, VRangeAddrLess> m_allocations = {};
 
-    // return type for alloc_vbuffer to return multiple values
-    struct VBuffer
-    {
-        VRange full_alloc_range;
-        VRange header_alloc_range;
-        VRange buffer_alloc_range;
-        u64 alloc_hdr_start;
-        u64 buffer_start;
-    };
-    // return type for get_alloc_vranges_from_ptr to return multiple values
-    struct AllocedVRanges
-    {
-        VRange header_alloc_range;
-        VRange buffer_alloc_range;
-    };
+    u16 m_pcid = 0; // 0 for the kernel vspace, only used if the CPU supports PCIDs (see cr3_to_load())
+    bool m_tlb_is_stale = false; // mappings were changed or removed while this vspace wasn't loaded
 
     VSpace();
     VSpace(VRange);
@@ -129,8 +120,8 @@ struct VSpace
     // buffers overlap on the same page, which would be messier to implement
 
     static u64 worst_case_size(u64, u64);
-    AllocedVRanges get_alloc_vranges_from_ptr(vaddr);
-    VBuffer alloc_vbuffer(u64, u64);
+    VRange alloc_vbuffer(u64, u64);
+    VRange take_alloc_vrange(vaddr);
 
     // used by kmalloc and kfree
     vaddr allocate_size(u64, u64);
@@ -138,22 +129,33 @@ struct VSpace
     
     // used by VObject map and unmap
     vaddr allocate_vobj(VObject *vobj);
+    vaddr allocate_vobj_at(VObject *vobj, vaddr addr);
     void free_vobj(VObject *vobj, vaddr addr);
     vaddr allocate_pages(const Vector<paddr>&, u64);
+    vaddr allocate_pages_at(const Vector<paddr>&, vaddr);
     void free_pages(const Vector<paddr>&, vaddr);
 
+    // used for demand paged VObjects (file backed and executable images), whose pages are allocated on first touch,
+    // and copy on write VObjects, whose pages are copied on first write
+    VObject *vobj_at(vaddr);
+    void populate_pages(vaddr, u64, bool);
+
     // for testing/debugging purposes
     u64 get_free_space();
 
     void share_kernelspace();
     void unshare_kernelspace();
 
-    void reload_cr3_if_needed();
+    u64 cr3_to_load();
+    void load();
+    void flush_tlb(VRange, bool);
 };
 
 bool in_kernel_vspace();
 PML4T *kernel_pml4t();
 
+struct ExecImage;
+
 struct VObject
 {
     struct VSpaceMapping
@@ -161,13 +163,44 @@ struct VObject
         VSpace *vspace = 0;
         vaddr alloced_addr = 0;
     };
+    // a memory mapped range of a file, the pages are read from the file the first time they are touched and
+    // written back by writeback_file_pages() if they were modified
+    // NOTE the file is identified the same way as an OpenFile, so a deleted file is detected
+    struct FileBacking
+    {
+        u32 inode_num = 0; // 0 if the VObject isn't file backed
+        u32 generation = 0;
+        u64 offset = 0;
+        FileReadahead readahead = {};
+    };
     Vector<paddr> underlying_pages{}; // TODO this may need to be switched to an entirely physical page based linked list
+    Vector<bool> page_is_read_only = {}; // empty if every page is writable, used for pages shared with other VObjects
+    Vector<bool> page_is_copy_on_write = {}; // empty if no page is copy on write, see clone_copy_on_write()
     Vector<VSpaceMapping> vspaces_mapped_in = {};
     u64 alignment = 0;
+    FileBacking file = {};
+    ExecImage *exec_image = 0; // set if the VObject is a process' copy of an executable (see exec_cache.cpp)
     VObject();
     VObject(u64, u64);
+    VObject(u32, u32, u64, u64);
     ~VObject();
     vaddr map(VSpace&);
+    vaddr map_at(VSpace&, vaddr);
+    void protect_mapped_pages(VSpace&, vaddr);
     void unmap(VSpace&);
     static void initialize_interrupt_stack(u64, u64);
+
+    bool is_file_backed();
+    bool is_demand_paged();
+    vaddr mapped_addr(VSpace&);
+    void fill_page(u64);
+    void fill_file_page(u64);
+    void fill_exec_page(u64);
+    void map_filled_page(u64);
+    void writeback_file_pages();
+
+    VObject *clone_copy_on_write();
+    bool page_is_cow(u64);
+    bool page_is_protected(u64);
+    void copy_page_on_write(u64);
 };
@@ -0,0 +1,18 @@
+#include "include/types.h"
+#include "include/syscall.h"
+#include "include/string.h"
+
+// a large program for measuring how long it takes to start, most of its' code is never executed
+// 8MB of padding in .text, like a big program with lots of rarely used code
+asm(".text\n"
+    ".globl bigexec_unused_code\n"
+    "bigexec_unused_code:\n"
+    ".fill 0x800000, 1, 0x90\n"
+    "ret\n");
+
+int main(int argc, char **argv)
+{
+    sys_tty_write("bigexec started\n", 16);
+    sys_tty_flush();
+    return 0;
+}
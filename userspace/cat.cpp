@@ -21,6 +21,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    int fd = sys_fs_open(path, 0);
+    if(fd < 0) {
+        prog_error(argv[0], "error opening file");
+        return 1;
+    }
+
     TTYInfo tty_info = {};
     sys_tty_info(&tty_info);
     int offset = stat.size - tty_info.scrollback_buffer_size;
@@ -29,13 +35,16 @@ int main(int argc, char **argv)
 
     int buf_size = stat.size - offset;
     char *buf = (char *)sys_alloc(buf_size+1, 64);
-    int result = sys_fs_read(path, buf, offset, buf_size);
-    buf[buf_size] = 0;
+    s64 nread = 0;
+    if(sys_fs_seek(fd, offset, SEEK_SET) == offset)
+        nread = sys_fs_read_fd(fd, buf, buf_size);
+    sys_fs_close(fd);
 
-    if(result != FS_STATUS_OK) {
+    if(nread < 0) {
         prog_error(argv[0], "error reading file");
         return 1;
     }
+    buf[nread] = 0;
 
     sys_tty_write(buf);
     sys_tty_flush();
@@ -34,25 +34,33 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    auto dest_stat = sys_stat(dest);
-    if(dest_stat.found_file) {
-        sys_fs_truncate(dest, src_stat.size);
-    } else {
-        sys_fs_create_file(dest);
+    int src_fd = sys_fs_open(src, 0);
+    if(src_fd < 0) {
+        prog_error(argv[0], "error opening source file");
+        return 1;
+    }
+    int dest_fd = sys_fs_open(dest, OPEN_CREATE | OPEN_TRUNCATE);
+    if(dest_fd < 0) {
+        prog_error(argv[0], "error opening dest file");
+        sys_fs_close(src_fd);
+        return 1;
     }
 
-    const int BUF_SIZE = 4096;
-    char buf[BUF_SIZE];
-    int remaining = src_stat.size;
-    int offset = 0;
-    while(remaining > 0) {
-        int size = min(BUF_SIZE, remaining);
-        sys_fs_read(src, buf, offset, size);
-        sys_fs_write(dest, buf, offset, size);
-
-        remaining -= size;
-        offset += size;
+    // the data is copied inside the kernel, the chunk size only limits how long the fs lock is held per syscall
+    const u64 CHUNK_SIZE = 4 * 1024 * 1024;
+    int result = 0;
+    while(true) {
+        s64 ncopied = sys_fs_copy_fd(src_fd, dest_fd, CHUNK_SIZE);
+        if(ncopied == 0)
+            break;
+        if(ncopied < 0) {
+            prog_error(argv[0], "error copying file");
+            result = 1;
+            break;
+        }
     }
 
-    return 0;
+    sys_fs_close(src_fd);
+    sys_fs_close(dest_fd);
+    return result;
 }
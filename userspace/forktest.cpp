@@ -0,0 +1,75 @@
+#include "include/types.h"
+#include "include/syscall.h"
+#include "include/string.h"
+
+// tests that a forked child and its' parent get separate copies of the heap and stack: both write their own value to
+// the same pages, then each checks that it only sees its' own writes
+// NOTE there is no way to wait for the child, the yields give it time to run before the parent checks and exits
+
+const u64 HEAP_PAGES = 4;
+const u64 STACK_PAGES = 2;
+const int YIELD_COUNT = 16;
+
+void fill_pages(u8 *pages, u64 page_count, u8 value)
+{
+    for(u64 i = 0; i < page_count; ++i)
+        pages[i * 4096] = value;
+}
+
+bool check_pages(u8 *pages, u64 page_count, u8 value)
+{
+    for(u64 i = 0; i < page_count; ++i) {
+        if(pages[i * 4096] != value)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    u8 *heap = (u8 *)sys_alloc(HEAP_PAGES * 4096, 4096);
+    if(heap == nullptr) {
+        prog_error(argv[0], "error allocating memory");
+        return 1;
+    }
+    volatile u8 stack[STACK_PAGES * 4096];
+    fill_pages(heap, HEAP_PAGES, 'o');
+    fill_pages((u8 *)stack, STACK_PAGES, 'o');
+
+    int pid = sys_fork();
+    if(pid < 0) {
+        prog_error(argv[0], "error in fork");
+        return 1;
+    }
+    bool is_child = pid == 0;
+    u8 value = is_child ? 'c' : 'p';
+
+    // the last heap page is left alone, it has to keep the value from before the fork in both processes
+    fill_pages(heap, HEAP_PAGES - 1, value);
+    fill_pages((u8 *)stack, STACK_PAGES, value);
+    for(int i = 0; i < YIELD_COUNT; ++i)
+        sys_yield();
+
+    const char *who = is_child ? "child" : "parent";
+    int result = 0;
+    if(!check_pages(heap, HEAP_PAGES - 1, value) || !check_pages(heap + (HEAP_PAGES - 1) * 4096, 1, 'o')) {
+        prog_error(who, "FAIL: heap pages were modified by the other process");
+        result = 1;
+    }
+    if(!check_pages((u8 *)stack, STACK_PAGES, value)) {
+        prog_error(who, "FAIL: stack pages were modified by the other process");
+        result = 1;
+    }
+    if(result == 0) {
+        sys_tty_write(who);
+        sys_tty_write(": forktest passed\n");
+        sys_tty_flush();
+    }
+
+    // the child is killed when the parent exits
+    if(!is_child) {
+        for(int i = 0; i < YIELD_COUNT; ++i)
+            sys_yield();
+    }
+    return result;
+}
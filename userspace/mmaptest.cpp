@@ -0,0 +1,109 @@
+#include "include/types.h"
+#include "include/syscall.h"
+#include "include/string.h"
+
+// tests memory mapped files: the file is written, read and modified through a mapping, then written back by
+// sys_fs_msync()/sys_fs_munmap() and read again with sys_fs_read_fd()
+
+const u64 TEST_SIZE = 3 * 4096;
+
+char g_buf[TEST_SIZE];
+
+char expected_byte(u64 i, bool modified)
+{
+    if(modified && i % 4096 < 100)
+        return (char)('A' + i / 4096);
+    return (char)('a' + i % 26);
+}
+
+bool check_bytes(const char *data, bool modified)
+{
+    for(u64 i = 0; i < TEST_SIZE; ++i) {
+        if(data[i] != expected_byte(i, modified))
+            return false;
+    }
+    return true;
+}
+
+bool read_back(int fd)
+{
+    if(sys_fs_seek(fd, 0, SEEK_SET) != 0)
+        return false;
+    u64 nread = 0;
+    while(nread < TEST_SIZE) {
+        s64 n = sys_fs_read_fd(fd, g_buf + nread, TEST_SIZE - nread);
+        if(n <= 0)
+            return false;
+        nread += n;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 2) {
+        usage_error(argv[0], "<path>");
+        return 1;
+    }
+
+    int fd = sys_fs_open(argv[1], OPEN_CREATE | OPEN_TRUNCATE);
+    if(fd < 0) {
+        prog_error(argv[0], "error opening file");
+        return 1;
+    }
+
+    for(u64 i = 0; i < TEST_SIZE; ++i)
+        g_buf[i] = expected_byte(i, false);
+    if(sys_fs_write_fd(fd, g_buf, TEST_SIZE) != (s64)TEST_SIZE) {
+        prog_error(argv[0], "error writing file");
+        sys_fs_close(fd);
+        return 1;
+    }
+
+    char *map = (char *)sys_fs_mmap(fd, 0, TEST_SIZE);
+    if(map == nullptr) {
+        prog_error(argv[0], "error mapping file");
+        sys_fs_close(fd);
+        return 1;
+    }
+
+    if(!check_bytes(map, false)) {
+        prog_error(argv[0], "FAIL: mapping doesn't match the file");
+        sys_fs_close(fd);
+        return 1;
+    }
+
+    // modify the start of every page, then check that msync wrote them back while the mapping is still in place
+    for(u64 i = 0; i < TEST_SIZE; ++i) {
+        if(i % 4096 < 100)
+            map[i] = expected_byte(i, true);
+    }
+    if(sys_fs_msync(map) != SYS_SUCCESS) {
+        prog_error(argv[0], "error in msync");
+        sys_fs_close(fd);
+        return 1;
+    }
+    if(!read_back(fd) || !check_bytes(g_buf, true)) {
+        prog_error(argv[0], "FAIL: file doesn't match after msync");
+        sys_fs_close(fd);
+        return 1;
+    }
+
+    // modify the mapping again, munmap has to write back the pages dirtied since the msync
+    map[TEST_SIZE - 1] = '!';
+    if(sys_fs_munmap(map) != SYS_SUCCESS) {
+        prog_error(argv[0], "error in munmap");
+        sys_fs_close(fd);
+        return 1;
+    }
+    if(!read_back(fd) || g_buf[TEST_SIZE - 1] != '!') {
+        prog_error(argv[0], "FAIL: file doesn't match after munmap");
+        sys_fs_close(fd);
+        return 1;
+    }
+
+    sys_fs_close(fd);
+    sys_tty_write("mmaptest passed\n");
+    sys_tty_flush();
+    return 0;
+}
@@ -10,16 +10,16 @@ int main(int argc, char **argv)
 
     char *path = argv[1];
     char *str = argv[2];
-    int offset = 0;
     
     auto stat = sys_stat(path);
-    if(!stat.found_file) {
-        sys_fs_create_file(path);
-    } else if(stat.is_dir) {
+    if(stat.found_file && stat.is_dir) {
         prog_error(argv[0], "path is a directory");
         return 1;
     }
 
+    // NOTE: without an offset arg the string is appended to the end of the file
+    u64 flags = OPEN_CREATE;
+    int offset = 0;
     if (argc == 4) {
         char *offset_arg = argv[3];
         if(!str_is_num(offset_arg)) {
@@ -28,12 +28,24 @@ int main(int argc, char **argv)
         }
         offset = str_to_uint(offset_arg);
     } else {
-        stat = sys_stat(path); // NOTE: re-do stat() since above code may have just created file
-        offset = stat.size;
+        flags |= OPEN_APPEND;
+    }
+
+    int fd = sys_fs_open(path, flags);
+    if(fd < 0) {
+        prog_error(argv[0], "error opening file");
+        return 1;
     }
 
+    int result = 0;
     int len = strlen_workaround(str);
-    sys_fs_write(path, str, offset, len);
+    if(argc == 4 && sys_fs_seek(fd, offset, SEEK_SET) != offset)
+        result = 1;
+    else if(sys_fs_write_fd(fd, str, len) != len)
+        result = 1;
+    if(result != 0)
+        prog_error(argv[0], "error writing file");
 
-    return 0;
+    sys_fs_close(fd);
+    return result;
 }